@@ -0,0 +1,54 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; arith_float.bas
+;;
+
+;; Benchmark of the floating-point arithmetic instructions.
+
+.entry start
+start:
+    mov %r1, #f1.5
+    mov %r9, #1000000
+    
+loop:
+    push %r1         ; x = ((x * 0.9999 + 0.5) * 2) / 2 - 0.25
+    push #f0.9999
+    fmul
+    push #f0.5
+    fadd
+    dup
+    fadd
+    push #f2
+    fdiv
+    push #f0.25
+    fsub
+    pop %r1
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    mov %rv, %r1
+    halt
@@ -0,0 +1,364 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bolt/as_assembler.h"
+#include "bolt/as_linker.h"
+#include "bolt/vm_core.h"
+#include "bolt/vm_jit.h"
+#include "bolt/vm_runtime.h"
+#include "bolt/vm_trace.h"
+#include "bolt/vm_verifier.h"
+
+#include <lconf/cli.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <stdexcept>
+
+//!
+//! bench
+//!
+
+//! This is the interpreter's benchmark suite (see make bench), to be run
+//!   from the repository's root : each benchmark is linked from its modules,
+//!   run once to count its instructions, once more to warm up, and then
+//!   timed over a few runs, keeping the best one. Each run must halt with
+//!   the benchmark's result in RV, or the benchmark fails.
+//!
+//! The instructions are counted by recording the run in a one-entry trace
+//!   (see vm_trace.h), which runs fused sequences (see vm_fusions.inc) one
+//!   instruction at a time, so that the counts and rates are in program
+//!   instructions, whatever the interpreter fused.
+//! The allocations are the host's heap allocations (through operator new)
+//!   during the timed runs, which the interpreter should not need.
+
+//! The number of heap allocations made so far.
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(std::size_t size)
+{
+    ++allocations;
+    
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+        
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+//! The benchmarks' execution modes.
+enum : uint32_t
+{
+    BENCH_CHECKED,
+    BENCH_TRUSTED,
+    BENCH_JIT
+};
+
+//! A benchmark is made of modules (libraries first, see as_linker.h), and
+//!   leaves result in RV (the bits of a float result).
+struct benchmark
+{
+    char const* name;
+    char const* group;
+    char const* modules[2];
+    uint32_t result;
+};
+
+static benchmark const benchmarks[] =
+{
+    { "push_pop",    "micro", { "bench/push_pop.bas" },                         1784293667 },
+    { "mov",         "micro", { "bench/mov.bas" },                              28 },
+    { "arith_int",   "micro", { "bench/arith_int.bas" },                        386 },
+    { "arith_float", "micro", { "bench/arith_float.bas" },                      0x451C25D6 },  // 2498.36
+    { "jcc",         "micro", { "bench/jcc.bas" },                              500000 },
+    { "call_ret",    "micro", { "bench/call_ret.bas" },                         1000001 },
+    { "dive",        "micro", { "bench/dive.bas" },                             0x49742400 },  // 1e6
+    { "fib",         "macro", { "bench/fib.bas" },                              75025 },
+    { "sieve",       "macro", { "bench/sieve.bas" },                            1028 },
+    { "nbody",       "macro", { "bench/nbody.bas" },                            0xBFD28AA2 },  // -1.64486
+    { "strlen",      "macro", { "samples/string.bas", "bench/strlen.bas" },     1000 },
+    { "fsqrt",       "macro", { "samples/math.bas", "bench/fsqrt.bas" },        0x430D6CCF }   // 141.425
+};
+
+//! Assemble and link the modules of a benchmark, with the runtime.
+static bolt::vm::core bench_load(benchmark const& bch)
+{
+    using namespace bolt::as;
+    
+    linker ln = linker_create();
+    
+    try
+    {
+        for (uint32_t i = 0; i < 2 && bch.modules[i]; ++i)
+        {
+            std::ifstream fs(bch.modules[i], std::ios::in);
+            if (!fs)
+                throw std::logic_error(std::string("Unable to open \"") + bch.modules[i] + "\"");
+                
+            lexer lex = lexer_create(fs);
+            assembler ass = assembler_create(lex);
+            module mod = assembler_assemble(ass);
+            assembler_free(ass);
+            lexer_free(lex);
+            
+            linker_add_module(ln, mod);
+        }
+        
+        bolt::vm::runtime_expose(ln);
+        
+        bolt::vm::core vco = linker_link(ln);
+        linker_free_modules(ln);
+        linker_free(ln);
+        
+        return vco;
+    }
+    catch (...)
+    {
+        linker_free_modules(ln);
+        linker_free(ln);
+        throw;
+    }
+}
+
+//! Run a benchmark's core from its entry point.
+static void bench_run(bolt::vm::core& vco, uint32_t mode)
+{
+    using namespace bolt::vm;
+    
+    core_reset(vco);
+    
+    switch (mode)
+    {
+        case BENCH_TRUSTED:
+            core_run_trusted(vco);
+            break;
+            
+        case BENCH_JIT:
+            jit_run(vco);
+            break;
+            
+        default:
+            core_run(vco);
+            break;
+    }
+}
+
+//! Check that a benchmark's run halted with its result.
+static void bench_check(bolt::vm::core const& vco, benchmark const& bch)
+{
+    using namespace bolt::vm;
+    
+    if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_HALT))
+        throw std::logic_error("Did not halt");
+        
+    uint32_t rv = vco.registers[REG_CODE_RV];
+    if (rv != bch.result)
+        throw std::logic_error("Returned " + std::to_string(rv) + " instead of " + std::to_string(bch.result));
+}
+
+//! Count the instructions run by a benchmark (by the checked interpreter),
+//!   and check its result.
+static uint64_t bench_count(bolt::vm::core& vco, benchmark const& bch)
+{
+    using namespace bolt::vm;
+    
+    trace_buffer trace = trace_create(1);
+    vco.trace = &trace;
+    
+    try
+    {
+        bench_run(vco, BENCH_CHECKED);
+    }
+    catch (...)
+    {
+        vco.trace = 0;
+        trace_free(trace);
+        throw;
+    }
+    
+    uint64_t count = trace.position;
+    vco.trace = 0;
+    trace_free(trace);
+    
+    bench_check(vco, bch);
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    using namespace bolt::vm;
+    
+    /****************************************/
+    /*** Command-line options definitions ***/
+    /****************************************/
+    
+    lconf::cli::Parser options(argc, argv);
+    
+    options.setProgramDescription("The Bolt interpreter benchmarks (only runs the benchmarks named after the arguments, if any).");
+    
+    options.addSwitch('h', "help")
+           .setStop()
+           .setDescription("Print this help");
+           
+    options.addOption('m', "mode")
+           .setDescription("Run the benchmarks with the given interpreter : checked (by default), trusted or jit");
+           
+    options.addOption('r', "runs")
+           .setDescription("Time the given number of runs of each benchmark, and keep the best one (5 by default)");
+           
+    /************************************/
+    /*** Options parsing and checking ***/
+    /************************************/
+    
+    try
+    {
+        options.parse();
+    }
+    catch (std::exception const& exc)
+    {
+        std::cerr << "Error: " << exc.what() << std::endl;
+        return -1;
+    }
+    
+    if (options.has("help"))
+    {
+        options.showHelp();
+        return 0;
+    }
+    
+    uint32_t mode = BENCH_CHECKED;
+    if (options.has("mode"))
+    {
+        std::string const& name = options.get("mode");
+        if (name == "trusted")
+            mode = BENCH_TRUSTED;
+        else if (name == "jit")
+            mode = BENCH_JIT;
+        else if (name != "checked")
+        {
+            std::cerr << "Error: Unknown mode \"" << name << "\"." << std::endl;
+            return -1;
+        }
+    }
+    
+    uint32_t runs = 5;
+    if (options.has("runs"))
+    {
+        try
+        {
+            std::size_t end;
+            runs = std::stoul(options.get("runs"), &end);
+            if (end != options.get("runs").size() || !runs)
+                throw std::out_of_range(options.get("runs"));
+        }
+        catch (std::exception const& exc)
+        {
+            std::cerr << "Error: Invalid number of runs (" << exc.what() << ")." << std::endl;
+            return -1;
+        }
+    }
+    
+    /******************/
+    /*** Benchmarks ***/
+    /******************/
+    
+    std::cout << std::left << std::setw(14) << "benchmark" << std::setw(7) << "group" << std::right
+              << std::setw(14) << "instructions" << std::setw(12) << "ms/run"
+              << std::setw(12) << "ns/instr" << std::setw(12) << "Minstr/s"
+              << std::setw(12) << "allocs/run" << std::endl;
+              
+    int status = 0;
+    
+    for (benchmark const& bch : benchmarks)
+    {
+        bool selected = options.arguments().empty();
+        for (uint32_t i = 0; i < options.arguments().size(); ++i)
+            selected = selected || options.arguments()[i] == bch.name;
+            
+        if (!selected)
+            continue;
+            
+        std::cout << std::left << std::setw(14) << bch.name << std::setw(7) << bch.group << std::right << std::flush;
+        
+        core vco;
+        try
+        {
+            vco = bench_load(bch);
+        }
+        catch (std::exception const& exc)
+        {
+            std::cout << std::endl;
+            std::cerr << "Error: " << exc.what() << std::endl;
+            status = -1;
+            continue;
+        }
+        
+        try
+        {
+            if (mode == BENCH_TRUSTED)
+                verifier_verify(vco);
+                
+            uint64_t count = bench_count(vco, bch);
+            bench_run(vco, mode);
+            bench_check(vco, bch);
+            
+            double best = 0;
+            uint64_t start_allocations = allocations;
+            
+            for (uint32_t i = 0; i < runs; ++i)
+            {
+                auto start = std::chrono::steady_clock::now();
+                bench_run(vco, mode);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                bench_check(vco, bch);
+                
+                if (!i || elapsed.count() < best)
+                    best = elapsed.count();
+            }
+            
+            double allocs = (double) (allocations - start_allocations) / runs;
+            
+            std::cout << std::fixed
+                      << std::setw(14) << count
+                      << std::setw(12) << std::setprecision(2) << best * 1e3
+                      << std::setw(12) << std::setprecision(2) << best * 1e9 / count
+                      << std::setw(12) << std::setprecision(1) << count / best / 1e6
+                      << std::setw(12) << std::setprecision(1) << allocs << std::endl;
+        }
+        catch (std::exception const& exc)
+        {
+            std::cout << std::endl;
+            std::cerr << "Error: " << exc.what() << std::endl;
+            status = -1;
+        }
+        
+        core_free_hatches(vco);
+        core_free_segments(vco);
+        core_free(vco);
+    }
+    
+    return status;
+}
@@ -0,0 +1,52 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; dive.bas
+;;
+
+;; Benchmark of the DIVE instruction (calling a runtime hatch).
+
+.entry start
+start:
+    mov %r1, #f0
+    mov %r9, #1000000
+    
+loop:
+    push #f2
+    dive abs
+    pop
+    push #f-1
+    dive abs
+    pop
+    push %r1         ; sum = sum + rv
+    push %rv
+    fadd
+    pop %r1
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    mov %rv, %r1
+    halt
@@ -0,0 +1,56 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; fib.bas
+;;
+
+;; Recursive Fibonacci benchmark (calls and integer arithmetic).
+
+.entry start
+fib:
+    push [%ab]       ; if (n < 2)
+    push #2
+    icmp
+    jl fib-small
+    
+    push [%ab]       ; return fib(n - 1) + fib(n - 2)
+    push #1
+    isub
+    call fib
+    pop
+    push %rv
+    push [%ab]
+    push #2
+    isub
+    call fib
+    pop
+    push %rv
+    iadd
+    pop %rv
+    ret
+    
+fib-small:
+    mov %rv, [%ab]   ; return n
+    ret
+    
+start:
+    push #25
+    call fib
+    pop
+    halt
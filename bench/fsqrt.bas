@@ -0,0 +1,50 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; fsqrt.bas
+;;
+
+;; Benchmark of the fsqrt function from samples/math.bas.
+
+.extern fsqrt
+
+.entry start
+start:
+    mov %r1, #f2
+    mov %r9, #20000
+    
+loop:
+    push %r1         ; fsqrt(x), x += 1
+    call fsqrt
+    pop
+    push %r1
+    push #f1
+    fadd
+    pop %r1
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    halt
@@ -0,0 +1,79 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; jcc.bas
+;;
+
+;; Benchmark of the compare and conditional jump instructions.
+
+.entry start
+start:
+    mov %r1, #0
+    mov %r9, #1000000
+    
+loop:
+    push %r9         ; never taken
+    push #0
+    icmp
+    jl jcc-fail
+    
+    push %r9         ; taken every other time
+    push #1
+    uand
+    push #0
+    ucmp
+    je jcc-l1
+    push %r1         ; (count the odd ones)
+    push #1
+    uadd
+    pop %r1
+    
+jcc-l1:
+    push %r9         ; unfused compare, never taken
+    dup
+    ucmp
+    jne jcc-fail
+    
+    push #f1         ; always taken
+    push #f0
+    fcmp
+    jg jcc-l2
+    jmp jcc-fail
+    
+jcc-l2:
+    push %r9         ; never taken
+    push #0
+    ucmp
+    jz jcc-fail
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    mov %rv, %r1     ; return the odd ones' count
+    halt
+    
+jcc-fail:
+    mov %rv, #0
+    halt
@@ -0,0 +1,66 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; mov.bas
+;;
+
+;; Benchmark of MOV, with each addressing mode.
+
+.entry start
+start:
+    push #0              ; locals ~ [%r0-2], [%r0-1]
+    push #0
+    mov %r0, %sp
+    push %r0
+    push #1
+    usub
+    pop %r5              ; r5 ~ &[%r0-1]
+    mov %r9, #1000000
+    
+loop:
+    mov %r1, #7          ; register <- immediate
+    mov %r2, %r1         ; register <- register
+    mov [%r5], %r2       ; indirection <- register
+    mov [%r0-2], [%r5]   ; offset indirection <- indirection
+    mov %r3, [%r0-2]     ; register <- offset indirection
+    mov [#0], #9         ; absolute <- immediate
+    mov %r4, [#0]        ; register <- absolute
+    mov [%r0-1], #3      ; offset indirection <- immediate
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    push %r3             ; return r3 + r4 + locals
+    push %r4
+    uadd
+    push [%r0-1]
+    uadd
+    push [%r0-2]
+    uadd
+    pop %rv
+    
+    pop                  ; clean up locals
+    pop
+    halt
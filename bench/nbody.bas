@@ -0,0 +1,188 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; nbody.bas
+;;
+
+;; N-body simulation benchmark (floating-point arithmetic and memory accesses).
+
+;; The bodies are stored on the heap as (x, y, vx, vy, m), and integrated
+;;   with a time step of 0.001.
+
+.entry start
+start:
+    mov [%hb+0], #f0     ; body 0
+    mov [%hb+1], #f0
+    mov [%hb+2], #f0
+    mov [%hb+3], #f0
+    mov [%hb+4], #f10
+    mov [%hb+5], #f1     ; body 1
+    mov [%hb+6], #f0
+    mov [%hb+7], #f0
+    mov [%hb+8], #f3
+    mov [%hb+9], #f0.1
+    mov [%hb+10], #f0    ; body 2
+    mov [%hb+11], #f2
+    mov [%hb+12], #f-2
+    mov [%hb+13], #f0
+    mov [%hb+14], #f0.2
+    mov [%hb+15], #f-3   ; body 3
+    mov [%hb+16], #f0
+    mov [%hb+17], #f0
+    mov [%hb+18], #f-1.5
+    mov [%hb+19], #f0.3
+    
+    push %hb             ; r4 ~ end of the bodies
+    push #20
+    uadd
+    pop %r4
+    mov %r9, #20000
+    
+step:
+    mov %r1, %hb         ; for each body i
+    
+step-i:
+    push %r1             ; for each body j > i
+    push #5
+    uadd
+    pop %r2
+    
+step-j:
+    push %r2
+    push %r4
+    ucmp
+    jge step-next
+    
+    push [%r2]           ; dx = xj - xi
+    push [%r1]
+    fsub
+    pop %r5
+    push [%r2+1]         ; dy = yj - yi
+    push [%r1+1]
+    fsub
+    pop %r6
+    
+    push %r5             ; d2 = dx * dx + dy * dy + 0.01
+    push %r5
+    fmul
+    push %r6
+    push %r6
+    fmul
+    fadd
+    push #f0.01
+    fadd
+    pop %r7
+    
+    push %r7             ; mag = dt / (d2 * sqrt(d2))
+    dive sqrt
+    pop
+    push %rv
+    push %r7
+    fmul
+    pop %r7
+    push #f0.001
+    push %r7
+    fdiv
+    pop %r7
+    
+    push [%r2+4]         ; r8 = mj * mag
+    push %r7
+    fmul
+    pop %r8
+    push [%r1+4]         ; r3 = mi * mag
+    push %r7
+    fmul
+    pop %r3
+    
+    push [%r1+2]
+    push %r5
+    push %r8
+    fmul
+    fadd
+    pop [%r1+2]
+    push [%r1+3]
+    push %r6
+    push %r8
+    fmul
+    fadd
+    pop [%r1+3]
+    push [%r2+2]
+    push %r5
+    push %r3
+    fmul
+    fsub
+    pop [%r2+2]
+    push [%r2+3]
+    push %r6
+    push %r3
+    fmul
+    fsub
+    pop [%r2+3]
+    
+    push %r2
+    push #5
+    uadd
+    pop %r2
+    jmp step-j
+    
+step-next:
+    push %r1
+    push #5
+    uadd
+    pop %r1
+    push %r1
+    push %r4
+    ucmp
+    jl step-i
+    
+    mov %r1, %hb         ; for each body, move it
+    
+step-move:
+    push [%r1]           ; x += vx * dt
+    push [%r1+2]
+    push #f0.001
+    fmul
+    fadd
+    pop [%r1]
+    push [%r1+1]         ; y += vy * dt
+    push [%r1+3]
+    push #f0.001
+    fmul
+    fadd
+    pop [%r1+1]
+    push %r1
+    push #5
+    uadd
+    pop %r1
+    push %r1
+    push %r4
+    ucmp
+    jl step-move
+    
+    push %r9             ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne step
+    
+    mov %rv, [%hb+5]     ; return body 1's x
+    halt
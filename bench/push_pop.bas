@@ -0,0 +1,62 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; push_pop.bas
+;;
+
+;; Benchmark of the stack instructions (PUSH, POP and DUP).
+
+.entry start
+start:
+    mov %r1, #0      ; sum = 0
+    mov %r9, #1000000
+    
+loop:
+    push #1
+    push %r9
+    dup
+    pop %r2          ; r2 = n
+    pop
+    pop %r3          ; r3 = 1
+    push #2
+    push #3
+    pop
+    pop %r4          ; r4 = 2
+    
+    push %r1         ; sum = sum + r2
+    push %r2
+    uadd
+    pop %r1
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    push %r1         ; return sum + r3 + r4
+    push %r3
+    uadd
+    push %r4
+    uadd
+    pop %rv
+    halt
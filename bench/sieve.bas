@@ -0,0 +1,107 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; sieve.bas
+;;
+
+;; Sieve of Eratosthenes benchmark (memory accesses and loops).
+
+.heap #8192
+
+.entry start
+start:
+    mov %r9, #20
+    
+sieve:
+    mov %r1, #0      ; for (i = 0; i < 8192; ++i) hb[i] = 1
+    
+sieve-clear:
+    push #1
+    push %hb
+    push %r1
+    uadd
+    stor
+    push %r1
+    push #1
+    uadd
+    pop %r1
+    push %r1
+    push #8192
+    ucmp
+    jl sieve-clear
+    
+    mov %r2, #0      ; count = 0
+    mov %r1, #2      ; for (i = 2; i < 8192; ++i)
+    
+sieve-outer:
+    push %hb         ; if (hb[i])
+    push %r1
+    uadd
+    load
+    push #0
+    ucmp
+    je sieve-next
+    
+    push %r2         ; ++count
+    push #1
+    uadd
+    pop %r2
+    
+    push %r1         ; for (j = i + i; j < 8192; j += i) hb[j] = 0
+    dup
+    uadd
+    pop %r3
+    
+sieve-inner:
+    push %r3
+    push #8192
+    ucmp
+    jge sieve-next
+    push #0
+    push %hb
+    push %r3
+    uadd
+    stor
+    push %r3
+    push %r1
+    uadd
+    pop %r3
+    jmp sieve-inner
+    
+sieve-next:
+    push %r1
+    push #1
+    uadd
+    pop %r1
+    push %r1
+    push #8192
+    ucmp
+    jl sieve-outer
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne sieve
+    
+    mov %rv, %r2     ; return count
+    halt
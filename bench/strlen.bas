@@ -0,0 +1,68 @@
+; This file is part of bolt.
+;    
+; Copyright (c) 2015 Alexandre Monti
+;
+; bolt is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+; 
+; bolt is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+; 
+; You should have received a copy of the GNU General Public License
+; along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+
+
+;;
+;; strlen.bas
+;;
+
+;; Benchmark of the strlen function from samples/string.bas.
+
+.extern strlen
+
+.entry start
+start:
+    mov %r1, #0      ; for (i = 0; i < 1000; ++i) hb[i] = 'a'
+    
+fill:
+    push #97
+    push %hb
+    push %r1
+    uadd
+    stor
+    push %r1
+    push #1
+    uadd
+    pop %r1
+    push %r1
+    push #1000
+    ucmp
+    jl fill
+    
+    push #0          ; hb[1000] = 0
+    push %hb
+    push #1000
+    uadd
+    stor
+    
+    mov %r9, #200
+    
+loop:
+    push %hb
+    call strlen
+    pop
+    
+    push %r9         ; while (--n)
+    push #1
+    usub
+    pop %r9
+    push %r9
+    push #0
+    ucmp
+    jne loop
+    
+    halt
@@ -37,6 +37,8 @@
 //!   .entry  (label): specify the entry point of this module
 //!   .extern (label): specifies that the given label is to be found in another object
 //!   .global (label): exports the given label so it can be found in another object
+//!   .stack  (imm): the number of stack words the program needs (see as_linker.h)
+//!   .heap   (imm): the number of heap words the program needs (see as_linker.h)
 //!
 //! Instructions are of the form :
 //!   mnemonic [operandA [operandB]]
@@ -21,6 +21,7 @@
 
 #include "bolt/as_module.h"
 #include "bolt/vm_core.h"
+#include "bolt/vm_symbols.h"
 
 //!
 //! as_linker
@@ -35,8 +36,11 @@
 //!   discarding unused objects.
 //! Hatch references (i.e, host calls) are resolved.
 //! The virtual core is created, code is copied to its segment memory.
-//! Lastly, all solutions are applied (and so the relocations + dive instructions are fixed),
-//!   and the core is ready !
+//! Then, all solutions are applied (and so the relocations + dive instructions are fixed).
+//! Then, each segment is translated into its pre-decoded form (see vm_decoder.h),
+//!   where each call gets the registers its callee may write to (so that only
+//!   those are saved in its frame).
+//! Lastly, the core's memory is sized (see linker), and the core is ready !
 //!
 //! All those steps in the assembling of multiple modules into a final core
 //!   add a lot of algorithmic complexity to the system, but it ensures
@@ -102,6 +106,22 @@ namespace bolt { namespace as
         uint32_t segments_count;
         //! Number of used hatches.
         uint32_t hatches_count;
+        //! Link the segments as read-only code (see vm::segment).
+        bool read_only;
+        //! Stack and heap sizes of the production core (in words), or 0 to
+        //!   size them automatically.
+        //! The stack size is the largest one stated by a .stack directive in
+        //!   the used modules, or else the bound computed by the verifier
+        //!   from the base segment's entry (see verifier_stack_bound) and from
+        //!   the exported functions, which the host may call (see core_call) :
+        //!   for those, room is left for a CALL frame and 16 argument words.
+        //! When there is no such bound (recursive or unverifiable code), and
+        //!   for the heap (whose use can't be known statically) without a
+        //!   .heap directive, 1024 words are used.
+        //! Functions called from the host with more arguments need a .stack
+        //!   directive (or an explicit size).
+        uint32_t stack_size;
+        uint32_t heap_size;
         //! Production core.
         vm::core vco;
     };
@@ -127,6 +147,11 @@ namespace bolt { namespace as
     //! Of base < 0, the linker will search for the default entry point,
     //!   and a single module must use a .entry directive.
     vm::core linker_link(linker& ln, int base = -1);
+    
+    //! Add the labels of all the modules used by the last linked core to
+    //!   a symbol table, at their segments' locations (see vm_symbols.h).
+    //! This must be done before freeing the linker's modules.
+    void linker_debug_symbols(linker const& ln, vm::debug_symbols& symbols);
 } }
 
 #endif // BOLT_AS_LINKER_H
@@ -82,6 +82,11 @@ namespace bolt { namespace as
         uint32_t symbols_size;
         symbol* symbols;
         
+        //! All the labels defined in the module (exported or not), which are
+        //!   only kept to name locations when debugging or profiling.
+        uint32_t labels_size;
+        symbol* labels;
+        
         uint32_t relocations_size;
         relocation* relocations;
         
@@ -93,6 +98,11 @@ namespace bolt { namespace as
         
         bool has_entry;
         uint32_t entry;
+        
+        //! Memory requirements from the .stack and .heap directives (in words),
+        //!   or 0 when unspecified.
+        uint32_t stack_size;
+        uint32_t heap_size;
     };
     
     //! Create an empty relocation.
@@ -126,6 +136,9 @@ namespace bolt { namespace as
     //! Returns 0 if not found.
     symbol* module_find_symbol(module& mod, std::string const& name);
     
+    //! Add a label to a module, returning a reference to it.
+    symbol& module_add_label(module& mod, symbol const& label);
+    
     //! Add a relocation to a module, returning a reference to it.
     relocation& module_add_relocation(module& mod, relocation const& reloc);
     
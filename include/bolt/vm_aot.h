@@ -0,0 +1,72 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOLT_VM_AOT_H
+#define BOLT_VM_AOT_H
+
+#include "bolt/vm_core.h"
+
+//!
+//! vm_aot
+//!
+
+//! This module is an ahead-of-time translator, that writes the program memory
+//!   of a linked virtual core as a C++ translation unit.
+//! Once compiled (for example as a shared object, with
+//!   g++ -std=gnu++11 -O2 -fPIC -shared -I<bolt>/include),
+//!   the generated code exports :
+//!
+//!     extern "C" void bolt_aot_run(bolt::vm::core& vco);
+//!
+//!   which runs a core like core_run does. The core must be linked from the
+//!   same modules (checked at run time), and is left to the host as usual :
+//!   hatches are called through the core's hatch table, so the hatch ABI is
+//!   the same as with the interpreter.
+//!
+//! The generated code works directly on the core's registers and stack, and
+//!   keeps IR and PC up to date, so that faults are raised exactly as with
+//!   the interpreter. Its structure follows the program's flow :
+//!   - there is one function per CALL target (and per segment entry point),
+//!     holding the instructions that can be reached from it without calling,
+//!     with a label per instruction,
+//!   - constant jumps are gotos, constant calls are native calls (up to a
+//!     depth limit) and RET is a native return,
+//!   - anything else (computed jumps, a callee returning somewhere unexpected,
+//!     deep calls...) goes through the function's dispatch switch, or back
+//!     to bolt_aot_run's driver loop.
+//! Locations that were not reached by following the program's flow are
+//!   left to the interpreter, one instruction at a time (see core_step), as
+//!   are the DMO instruction, the bulk MEM instructions and the VEC group
+//!   instructions (which run the interpreter's memory and SIMD kernels) and
+//!   faulty instructions.
+//!
+//! Immediate values are translated as constants. Segments that may write to
+//!   their own immediates (POP or MOV with an immediate destination) are not
+//!   translated at all : they are left to the interpreter, which decodes
+//!   their changed words again (see decoder_patch).
+
+namespace bolt { namespace vm
+{
+    //! The type of the bolt_aot_run entry point of the generated code.
+    typedef void(*aot_entry)(core& vco);
+    
+    //! Write the C++ translation of a linked virtual core's program memory.
+    void aot_emit(core const& vco, std::ostream& os);
+} }
+
+#endif // BOLT_VM_AOT_H
@@ -0,0 +1,77 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOLT_VM_BATCH_H
+#define BOLT_VM_BATCH_H
+
+#include "bolt/vm_core.h"
+
+//!
+//! vm_batch
+//!
+
+//! This module runs the same function of a linked program over many inputs,
+//!   BATCH_LANES calls at a time, in lockstep : each register and each stack
+//!   word holds a vector of one word per lane, so that the arithmetic of all
+//!   the lanes is done at once with SIMD instructions (through GCC's vector
+//!   extensions).
+//!
+//! The lanes share their control flow (PC, SEG and SP), which works as long
+//!   as they take the same path through the program. When a conditional
+//!   jump goes both ways, the lanes that jumped wait in a pending group
+//!   while the others go on, masked so that the waiting lanes are left
+//!   unchanged. The groups take turns, the one deepest in the stack (then
+//!   at the lowest SEG and PC) first, so that they meet again where their
+//!   paths join and go on together from there.
+//! A group of less than 3 lanes is not worth running in lockstep : its lanes
+//!   are run apart, one by one, by the interpreter (see core_run), from
+//!   where they left.
+//! The active lanes are run apart in the same way when they reach anything
+//!   that isn't plain stack and register work, or that would need distinct
+//!   addresses or flows per lane :
+//!   - the SYS group instructions, CST and DIVE (as they call into the host),
+//!   - the bulk MEM instructions and the VEC group instructions (which work
+//!     on runs of memory),
+//!   - writes to PC, SP, SEG, PSR, IR, to immediates and to the heap,
+//!   - memory accesses and jumps whose address differs between lanes,
+//!   - faulty instructions, and instructions that would fault (stack
+//!     overflow, out of bounds memory access...), so that errors are
+//!     raised exactly as with the interpreter.
+//! The heap can be read from in lockstep (it is the same for all lanes).
+
+namespace bolt { namespace vm
+{
+    //! The number of lanes of a batch.
+    enum : uint32_t
+    {
+        BATCH_LANES = 8
+    };
+    
+    //! Call the function at the given entry of the given segment count times,
+    //!   with args_size arguments per call (args[i * args_size] being the
+    //!   first argument of the i-th call), and store the result (RV) of the
+    //!   i-th call in results[i].
+    //! Each call runs as if on its own copy of the core (see core_call), the
+    //!   core itself is left unchanged, save for its segments being decoded
+    //!   and its hatches bound if needed.
+    //! Errors (such as faults) are thrown, as with core_run, and a suspended
+    //!   call (see core_suspend) is an error.
+    void batch_call(core& vco, uint32_t seg, uint32_t entry, uint32_t const* args, uint32_t args_size, uint32_t count, uint32_t* results);
+} }
+
+#endif // BOLT_VM_BATCH_H
@@ -78,6 +78,13 @@ namespace bolt { namespace vm
     //!            CST [<A>, [<B>]]:  push the word at the address A in program memory,
     //!                                 taking it from from the segment B if specified (if no operands,
     //!                                 address is taken from the stack and considered in the current segment).
+    //!            MCPY <A>, <B>:     pop N from the stack, and copy the N words at the address B to the
+    //!                                 address A (the runs may overlap)
+    //!            MCST <A>, <B>:     " ", and copy the N words at the address B in program memory (in the
+    //!                                 current segment) to the address A
+    //!            MSET <A>, <B>:     " ", and set the N words at the address A to B's value
+    //!            MCMP <A>, <B>:     " ", and compare the N words at the addresses A and B (as unsigneds),
+    //!                                 updating PSR as UCMP does with their first distinct words
     //!
     //!   FLOW:  the program flow control group:
     //!            CALL <A>:      call the function starting at A's address
@@ -99,6 +106,20 @@ namespace bolt { namespace vm
     //!
     //!            IADD, ISUB, ... behaves similarly for signed integers
     //!            FADD, FSUB, ...    "        "      "  single-precision floatings
+    //!
+    //!   VEC:   the vector group, working on runs of N words in memory (the stack
+    //!            or the heap), N being popped off the stack, A and B being the
+    //!            addresses of the runs :
+    //!            VIADD <A>, <B>: adds B to A, element-wise (as integers)
+    //!            VISUB, VIMUL, VAND: " " subtraction, multiplication, bitwise and
+    //!            VICMP <A>, <B>: sets each element of A to all ones if it is less than
+    //!                              B's (as signed integers), to zero otherwise
+    //!            VFADD, VFSUB, VFMUL, VFCMP behaves similarly for single-precision floatings
+    //!            VFMA <A>, <B>:  pops a floating S after N, and adds S times B to A
+    //!            VFDOT <A>, <B>: pushes the dot product of A and B (as floatings)
+    //!            VISUM <A>:      pushes the sum of A's elements (as integers)
+    //!            VIMIN, VIMAX:   " " minimum, maximum (as signed integers)
+    //!            VFSUM, VFMIN, VFMAX behaves similarly for single-precision floatings
     
     //! To get the operand code from an encoded instruction, do :
     //!   opcode = (instr & OP_x_CODE) >> OP_x_CODE_SHIFT
@@ -160,6 +181,7 @@ namespace bolt { namespace vm
         I_GROUP_MEM   = 0x02,
         I_GROUP_FLOW  = 0x03,
         I_GROUP_ARITH = 0x04,
+        I_GROUP_VEC   = 0x05,
         
         //! Instruction group mask.
         I_GROUP_MASK  = 0x0380,
@@ -66,42 +66,97 @@ namespace bolt { namespace vm
     
     //! PSR register flags.
     //!
-    //! HALT: set to 1 if VM halted
-    //! Z:    zero flag
-    //! N:    negative (or less) flag
+    //! HALT:  set to 1 if VM halted
+    //! WAIT:  set to 1 if a hatch suspended the core (see core_suspend)
+    //! STOP:  any of the flags that stop running the core
+    //! Z:     zero flag
+    //! N:     negative (or less) flag
+    //! FRAME: only used in the PSR word saved by CALL, holds the R0-R9
+    //!          registers that were not saved (see the calling convention in
+    //!          vm_handlers.inc), and is always cleared in PSR itself
     enum : uint32_t
     {
         PSR_FLAG_NONE = 0x00000000,
         
         PSR_FLAG_HALT = 0x80000000,
+        PSR_FLAG_WAIT = 0x40000000,
+        PSR_FLAG_STOP = PSR_FLAG_HALT | PSR_FLAG_WAIT,
         PSR_FLAG_Z    = 0x00000001,
         PSR_FLAG_N    = 0x00000002,
         
-        PSR_FLAG_CLR  = ~(PSR_FLAG_Z | PSR_FLAG_N)
+        PSR_FLAG_CLR  = ~(PSR_FLAG_Z | PSR_FLAG_N),
+        
+        PSR_FRAME       = 0x03FF0000,
+        PSR_FRAME_SHIFT = 16
+    };
+    
+    //! The status of a budgeted run (see core_run_for).
+    //!
+    //! HALTED:    the core halted (or its flow ran past the end of the segment)
+    //! EXHAUSTED: the budget was exhausted before, the run can go on
+    //! FAULTED:   the run stopped on an error
+    //! SUSPENDED: a hatch suspended the core, the run can go on once the
+    //!              hatch call is completed (see core_resume)
+    enum : uint32_t
+    {
+        CORE_HALTED,
+        CORE_EXHAUSTED,
+        CORE_FAULTED,
+        CORE_SUSPENDED
     };
     
+    //! The pre-decoded form of a segment's program memory, see vm_decoder.h.
+    struct decoded_instruction;
+    
+    //! The native form of a segment's program memory, see vm_jit.h.
+    struct jit_code;
+    
+    //! A profile of a program's runs, see vm_profiler.h.
+    struct profile;
+    
+    //! An execution trace, see vm_trace.h.
+    struct trace_buffer;
+    
     //! This structure represents a program to be run on a virtual core.
     //! It holds a buffer containing the instructions (buffer),
     //!   plus its size (in uint32_t increments).
     //! The entry point specifies the initial PC value (if applicable).
+    //! The code field holds the decoded instruction stream that is
+    //!   actually run by the interpreter (built by the linker, or lazily
+    //!   on the first run if null).
+    //! The native field holds the segment's native code, if it was
+    //!   compiled (see vm_jit.h), null otherwise.
+    //! A read-only segment can't write to its own immediates : such writes
+    //!   fault when decoding it, so that its code never changes and can be
+    //!   shared by many cores (see vm_pool.h).
     struct segment
     {
         uint32_t* buffer;
         uint32_t size;
         uint32_t entry;
+        bool read_only;
+        
+        decoded_instruction* code;
+        jit_code* native;
     };
     
     //! A hatch is a structure which links the
     //!   virtual code to a host C function.
     struct core;
+    typedef void(*hatch_function)(core& vco);
     struct hatch
     {
         std::string name;
-        void(*entry)(core& vco);
+        hatch_function entry;
     };
     
     //! The base field is the index of the initial segment (it inits the SEG
     //!   register upon reset).
+    //! The hatch_entries field holds the entry points of the hatches in a
+    //!   contiguous table, so that DIVE reaches them with a single indirection
+    //!   (see core_bind_hatches).
+    //! The trace field is the execution trace the core records its runs in,
+    //!   if any (it is owned by the caller, see vm_trace.h).
     struct core
     {
         uint32_t stack_size;
@@ -115,6 +170,32 @@ namespace bolt { namespace vm
         uint32_t* stack;
         segment** segments;
         hatch** hatches;
+        hatch_function* hatch_entries;
+        trace_buffer* trace;
+    };
+    
+    //! A snapshot of the state of a core (see core_snapshot), from which
+    //!   other cores may start, instead of running the program again up
+    //!   to that point (typically, its initialization).
+    //! It holds a copy of the registers, of the used part of the stack (below
+    //!   SP) and of the heap, in memory, and refers to the segments and the
+    //!   hatches of the core, which must outlive it.
+    //! As the program memory is not copied, the segments must not be
+    //!   self-modifying (see decoder_is_self_modifying).
+    struct snapshot
+    {
+        uint32_t stack_size;
+        uint32_t heap_size;
+        uint32_t segments_size;
+        uint32_t hatches_size;
+        uint32_t base;
+        
+        uint32_t registers[REG_COUNT];
+        
+        uint32_t stack_used;
+        uint32_t* memory;
+        segment** segments;
+        hatch** hatches;
     };
     
     //! Create a virtual core.
@@ -128,15 +209,107 @@ namespace bolt { namespace vm
     //! Free all hatches in the virtual core.
     void core_free_hatches(core& vco);
     
+    //! Fill the hatch entry table from the hatches field.
+    //! This is done by the linker, and when starting to run (core_run,
+    //!   core_run_trusted, jit_run), but must be done manually before
+    //!   using core_step on a core whose hatches were changed.
+    //! Entries that are already up to date are left untouched, so that cores
+    //!   sharing a table (see vm_pool.h) only read it.
+    void core_bind_hatches(core& vco);
+    
     //! Delete a virtual core (does *not* frees segments, nor hatches).
     void core_free(core& vco);
     
     //! Reset a virtual core.
     void core_reset(core& vco);
     
-    //! Run until the end of the program (or the core halted).
+    //! Take a snapshot of a virtual core (see snapshot).
+    //! Throws std::logic_error if a segment is self-modifying.
+    snapshot core_snapshot(core const& vco);
+    
+    //! Create a virtual core in the state of a snapshot, which shares the
+    //!   segments and hatches of the snapshot's core (core_free leaves them
+    //!   alone).
+    core core_clone(snapshot const& snap);
+    
+    //! Put a virtual core back in the state of a snapshot, the core must have
+    //!   the same stack and heap sizes as the snapshot's core.
+    //! This only copies the registers, the used part of the stack and the
+    //!   heap, and is the cheap way to run many requests from the same state.
+    void core_restore(core& vco, snapshot const& snap);
+    
+    //! Free a snapshot.
+    void core_free_snapshot(snapshot& snap);
+    
+    //! Reset a virtual core so that running it calls the function at the
+    //!   given entry of the given segment, with the given arguments (args[0]
+    //!   being the first one, see the calling convention in vm_handlers.inc).
+    //! The run stops when the function returns, leaving its result in RV.
+    void core_call(core& vco, uint32_t seg, uint32_t entry, uint32_t const* args, uint32_t args_size);
+
+    //! Run until the end of the program (or the core halted), or until a hatch
+    //!   suspended the core (see core_suspend).
     void core_run(core& vco);
     
+    //! Run like core_run, skipping the stack and memory bounds checks in the
+    //!   code that was verified (see vm_verifier.h), the rest of the program
+    //!   is run by the checked interpreter.
+    //! The program must be verified first (after linking, and after any
+    //!   change to the program memory), otherwise this is core_run.
+    //! A core recording a trace is always run by the checked interpreter.
+    void core_run_trusted(core& vco);
+    
+    //! Run like core_run, for a budget of program words (that is about one
+    //!   per instruction, operand words counting as well).
+    //! The budget is only checked when the program's flow jumps backward, so
+    //!   that it may be slightly exceeded.
+    //! Returns the status of the run (see CORE_*) :
+    //!   - when the budget was exhausted, the whole state of the run is in the
+    //!     core's registers and stack, and it goes on where it stopped when
+    //!     called again,
+    //!   - when the run faulted, the error's message is stored in fault (if
+    //!     not null), and the core is halted.
+    uint32_t core_run_for(core& vco, uint64_t budget, std::string* fault = 0);
+    
+    //! Run like core_run_trusted, for a budget of program words (see core_run_for).
+    uint32_t core_run_trusted_for(core& vco, uint64_t budget, std::string* fault = 0);
+    
+    //! Run like core_run_for, for a budget of dispatches (a fused sequence
+    //!   counting as one, see vm_fusions.inc) which is checked on each one,
+    //!   also stopping right before a DIVE unless it is the first instruction
+    //!   run (so that hatch calls can be run, and timed, alone) : this is how
+    //!   the sampler slices a run (see vm_sampler.h). It doesn't record
+    //!   anything in the core's trace.
+    //! The budget is left to what remains of it.
+    uint32_t core_run_sampled(core& vco, uint64_t& budget, std::string* fault = 0);
+    
+    //! Run like core_run, recording the run in a profile (see vm_profiler.h).
+    void core_run_profiled(core& vco, profile& prof);
+    
+    //! Run like core_run, until the program's flow jumps to a location that
+    //!   was compiled to native code (see vm_jit.h), or until the budget is
+    //!   exhausted (see core_run_for, it is left to what remains of it) : this
+    //!   is how jit_run runs the code it could not compile.
+    //! Like core_step, this does not check nor set the HALT flag.
+    void core_run_to_native(core& vco, int64_t& budget);
+    
+    //! Suspend a core, from within a hatch : the run stops right after the
+    //!   DIVE (as if it halted, the state of the run being saved in the core),
+    //!   and the core won't run again until the hatch call is completed.
+    //! The hatch typically hands the core to something that completes the
+    //!   call later on (when some input is available...), so that the host
+    //!   thread doesn't wait for it and can run other cores meanwhile.
+    void core_suspend(core& vco);
+    
+    //! Complete the hatch call a core is suspended at, with the given return
+    //!   value (in RV), so that running it again goes on after the DIVE.
+    void core_resume(core& vco, uint32_t rv);
+    
+    //! Execute a single instruction, at PC (does nothing if PC is past the end
+    //!   of the current segment).
+    //! Unlike core_run, this does not check nor set the HALT flag.
+    void core_step(core& vco);
+    
     //! Print a register dump of the core.
     void core_register_dump(core& vco, std::ostream& os = std::cout);
     
@@ -0,0 +1,225 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOLT_VM_DECODER_H
+#define BOLT_VM_DECODER_H
+
+#include "bolt/vm_bytes.h"
+#include "bolt/vm_core.h"
+
+//!
+//! vm_decoder
+//!
+
+//! This module translates the program memory of a segment into
+//!   a pre-decoded instruction stream, so that the interpreter never
+//!   has to parse the 32-bit encoding (see vm_bytes.h) at run time.
+//!
+//! The decoded stream has exactly one entry per word of the segment
+//!   (plus a terminating one), so that it can be indexed directly by PC.
+//! Each entry holds the instruction decoded as if it started at this location, which
+//!   keeps jumps to arbitrary addresses (even into data) behaving exactly
+//!   as with the raw encoding.
+//!
+//! Immediate operands are not copied into the stream : we keep a pointer
+//!   to their word in program memory, as they are writable (see resolve_operand
+//!   in vm_core.cpp) and a program may modify them.
+//! Offset words are inlined. As any other word, an immediate may also be run
+//!   as an instruction, or as the offset of one : when a program writes to an
+//!   immediate, the entries depending on its word are decoded again (see
+//!   decoder_patch).
+//!
+//! Common instruction sequences (see vm_fusions.inc) are fused into
+//!   superinstructions : the entry of the first instruction of the sequence
+//!   gets the fused handler, which executes the whole sequence in one dispatch.
+//!   The entries of the other instructions are left alone, so that jumping
+//!   in the middle of a sequence still works.
+//!
+//! Encoding errors (invalid group, invalid code, missing operand, truncated
+//!   instruction...) are not reported at decode time, they are recorded in the
+//!   stream and raised only if the faulty instruction is actually executed.
+
+namespace bolt { namespace vm
+{
+    //! These macros define the behavior of the declarations in
+    //!   vm_instructions.inc and vm_fusions.inc, here they define the dense
+    //!   handler codes H_CODE_* used to index the interpreter's dispatch.
+    #define DECL_INSTR(group, name, offset, f, a, b) \
+        H_CODE_ ## name,
+    #define DECL_FUSION(name, shape, i0, i1, i2, i3) \
+        H_CODE_ ## name,
+        
+    //! END:   the terminating entry of a decoded stream (one past the end
+    //!          of the segment)
+    //! BAD:   the entry is not a valid instruction, executing it throws
+    //!          std::logic_error(fault)
+    //! FETCH: the instruction's operands lie past the end of the segment,
+    //!          executing it throws std::runtime_error(fault)
+    enum : uint32_t
+    {
+        H_CODE_END,
+        H_CODE_BAD,
+        H_CODE_FETCH,
+        
+        #include "bolt/vm_instructions.inc"
+        #include "bolt/vm_fusions.inc"
+        
+        H_CODE_COUNT
+    };
+    
+    #undef DECL_INSTR
+    #undef DECL_FUSION
+    
+    //! The handler codes of the fusions come after those of the instructions,
+    //!   from H_CODE_FUSED on (counting the instructions here).
+    #define DECL_INSTR(group, name, offset, f, a, b) \
+        + 1
+        
+    enum : uint32_t
+    {
+        H_CODE_FUSED = H_CODE_FETCH + 1
+        
+        #include "bolt/vm_instructions.inc"
+    };
+    
+    #undef DECL_INSTR
+    
+    //! Decoded operand kinds.
+    //!
+    //! NONE:    no operand
+    //! REG:     register value (reg)
+    //! IMM:     immediate value (#imm)
+    //! REG_IND: register addressing ([reg] or [reg+#off])
+    //! IMM_IND: immediate addressing ([#imm] or [#imm+#off])
+    //!
+    //! Offsets are always present in the decoded form (zero if the
+    //!   offset bit was not set).
+    enum : uint32_t
+    {
+        OPK_NONE,
+        OPK_REG,
+        OPK_IMM,
+        OPK_REG_IND,
+        OPK_IMM_IND
+    };
+    
+    //! A decoded operand.
+    //! The proven field is set by the verifier (see vm_verifier.h) on memory
+    //!   operands that it proved to be in bounds, so that the trusted interpreter
+    //!   can skip their bounds check.
+    struct decoded_operand
+    {
+        uint32_t kind;
+        uint32_t reg;
+        int32_t offset;
+        uint32_t proven;
+        uint32_t* imm;
+    };
+    
+    //! The room of the locations where the trusted interpreter can't run.
+    enum : uint32_t
+    {
+        ROOM_UNTRUSTED = 0xFFFFFFFF
+    };
+    
+    //! The save mask of a CALL that saves all the R0-R9 registers (bit n
+    //!   stands for Rn).
+    enum : uint32_t
+    {
+        SAVE_ALL = (1 << (REG_CODE_R9 - REG_CODE_R0 + 1)) - 1
+    };
+    
+    //! The number of words pushed by CALL (and popped by RET), see the
+    //!   calling convention in vm_handlers.inc.
+    enum : uint32_t
+    {
+        CALL_FRAME_SIZE = REG_CODE_R9 - REG_CODE_R0 + 5
+    };
+    
+    //! A decoded instruction.
+    //! The instr field holds the raw instruction word (as loaded into IR),
+    //!   next is the PC value after fetching the instruction and its operands,
+    //!   and size the number of words it spans (so that the entry of the
+    //!   following instruction is this + size).
+    //! The depth and room fields are set by the verifier (see vm_verifier.h) on
+    //!   the locations where the trusted interpreter can start (or resume)
+    //!   running : it needs at least depth words on the stack, and room free
+    //!   words above SP. Elsewhere, room is ROOM_UNTRUSTED.
+    //! The saves field is the mask of the R0-R9 registers a CALL saves in its
+    //!   frame : SAVE_ALL, unless decoder_frames found out which registers
+    //!   the callee may write to (it shares a word with size, so that an
+    //!   entry stays 80 bytes wide, which matters for the dispatch).
+    struct decoded_instruction
+    {
+        uint32_t handler;
+        uint32_t instr;
+        uint32_t next;
+        uint16_t size;
+        uint16_t saves;
+        
+        uint32_t depth;
+        uint32_t room;
+        
+        decoded_operand a;
+        decoded_operand b;
+        
+        char const* fault;
+    };
+    
+    //! Get the instruction code of a decoded instruction (its handler may
+    //!   be a fused one, see vm_fusions.inc).
+    static inline uint32_t decoder_icode(decoded_instruction const& ins)
+    {
+        return (ins.instr & I_CODE_MASK) >> I_CODE_SHIFT;
+    }
+    
+    //! Decode a whole segment, returning its instruction stream (of seg.size entries,
+    //!   plus a terminating H_CODE_END entry, so that running sequentially
+    //!   past the last instruction needs no bounds check).
+    //! Note that you must free it with decoder_free.
+    decoded_instruction* decoder_decode(segment const& seg);
+    
+    //! Free a decoded instruction stream.
+    void decoder_free(decoded_instruction* code);
+    
+    //! Get the handler of a decoded instruction as it was before fusion, that
+    //!   is, of its first instruction only if it starts a fused sequence.
+    uint32_t decoder_base_handler(decoded_instruction const& ins);
+    
+    //! Bring a segment's decoded stream up to date after the given word of
+    //!   its program memory changed : the entries spanning the word are
+    //!   decoded again (losing what the verifier recorded there), and the
+    //!   fusions of the sequences going through them are matched again.
+    void decoder_patch(segment const& seg, uint32_t word);
+    
+    //! Check if a decoded segment may write to its own immediates (with POP
+    //!   or MOV), that is, if its code may change at run time. A read-only
+    //!   segment never is (see vm::segment).
+    bool decoder_is_self_modifying(segment const& seg);
+    
+    //! Compute the save masks of the constant CALLs of a linked core, whose
+    //!   segments must all be decoded.
+    //! A function's mask holds the R0-R9 registers that may be written to
+    //!   from its entry, following its flow without following calls (the
+    //!   callees save the registers they write to themselves). Functions
+    //!   whose flow can't be followed (computed jumps, writes to PC, SEG or
+    //!   SP, hatches, RST) and self-modifying segments keep SAVE_ALL.
+    void decoder_frames(core& vco);
+} }
+
+#endif // BOLT_VM_DECODER_H
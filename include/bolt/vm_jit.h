@@ -0,0 +1,85 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOLT_VM_JIT_H
+#define BOLT_VM_JIT_H
+
+#include "bolt/vm_core.h"
+
+//!
+//! vm_jit
+//!
+
+//! This module is a template JIT compiler, that translates the program memory
+//!   of a segment into native x86-64 code (each instruction is translated to a
+//!   fixed snippet of machine code, with no register allocation across
+//!   instructions).
+//!
+//! The native code works directly on the core's registers and stack, so that
+//!   everything else (hatches, dumps, core_reset...) is left unchanged.
+//! A segment is compiled by following the program's flow from its entry
+//!   point, its first word and the constant long CALLs to it, the other
+//!   locations (such as the entries of core_call, or the targets of dynamic
+//!   jumps) being compiled in additional chunks as the program's flow
+//!   reaches them.
+//!
+//! Whatever the native code does not handle is left to the interpreter, one
+//!   instruction at a time (see core_step) :
+//!   - the SYS group instructions, CST and DIVE (as they call into the host),
+//!   - the bulk MEM instructions (MCPY, MCST, MSET and MCMP) and the VEC group
+//!     instructions (which run the interpreter's memory and SIMD kernels),
+//!   - faulty instructions, and instructions that would fault (stack overflow,
+//!     out of bounds memory access...), so that errors are raised exactly
+//!     as with the interpreter.
+//!
+//! Immediate values are compiled as constants, so segments that may write
+//!   to their own immediates (POP or MOV with an immediate destination)
+//!   are not compiled at all : they are run by the interpreter, until the
+//!   program's flow reaches native code (see core_run_to_native), as are
+//!   the locations left once a segment has too many chunks.
+//!
+//! On other platforms than x86-64, jit_compile always fails, and jit_run
+//!   is equivalent to core_run.
+
+namespace bolt { namespace vm
+{
+    //! Compile a segment of a linked core to native code.
+    //! The core's segments must all be decoded (see vm_decoder.h).
+    //! Returns null if the segment can't be compiled.
+    //! Note that you must free it with jit_free.
+    jit_code* jit_compile(core const& vco, uint32_t seg);
+    
+    //! Free a segment's native code.
+    void jit_free(jit_code* native);
+    
+    //! Check if a location of a segment was compiled to native code.
+    bool jit_is_compiled(segment const& seg, uint32_t pc);
+    
+    //! Run until the end of the program (or the core halted), like core_run,
+    //!   compiling the segments to native code first (if not already done).
+    void jit_run(core& vco);
+    
+    //! Run like jit_run, for a budget of program words (see core_run_for).
+    //! The native code charges the budget when the program's flow goes
+    //!   backward : backward constant jumps charge the words they loop over,
+    //!   and computed jumps and returns charge one word, so that the budget
+    //!   is only roughly followed.
+    uint32_t jit_run_for(core& vco, uint64_t budget, std::string* fault = 0);
+} }
+
+#endif // BOLT_VM_JIT_H
@@ -0,0 +1,120 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BOLT_VM_POOL_H
+#define BOLT_VM_POOL_H
+
+#include "bolt/vm_core.h"
+#include <future>
+#include <vector>
+
+//!
+//! vm_pool
+//!
+
+//! This module runs many independent jobs over a linked program, on a pool
+//!   of host threads.
+//! Each job runs on its own virtual core (its registers, stack and heap),
+//!   while the linked image (the segments, their decoded and native code,
+//!   and the hatch tables) is shared read-only by all of them, so that
+//!   memory stays flat as the pool grows. The cores of the jobs that are
+//!   done are reused for the next ones, their memory being cleared first.
+//!
+//! Jobs are time-sliced : each worker thread has a deque of runnable jobs,
+//!   it runs the one at the front for a slice (see core_run_for), and puts
+//!   it back at the end if it is not done, so that short jobs don't wait
+//!   behind long ones. Submitted jobs are spread over the workers' deques,
+//!   and a worker whose deque is empty steals jobs from the end of the
+//!   others'.
+//! The JIT compiled code only roughly follows the slices (see jit_run_for).
+//!   The locations the image was not compiled from (such as the jobs'
+//!   entries) are compiled by the first job reaching them, while the others
+//!   wait for it (see vm_jit.h).
+//!
+//! A hatch may suspend a job's core (see core_suspend), so that the worker
+//!   goes on with other jobs meanwhile : the job is set aside until the
+//!   hatch call is completed with pool_resume (from any thread).
+//!
+//! This is why the image must not be self-modifying (link it as read-only
+//!   code, see linker::read_only), and why it is fully
+//!   prepared (decoded, verified or compiled, and its hatches bound) when
+//!   creating the pool : it must not be changed, nor run by anything else,
+//!   until the pool is freed.
+//! The hatches are run concurrently, by different worker threads (but
+//!   always on their own core).
+//!
+//! A job calls a function of the image (see core_call), and its result
+//!   is the value of RV when it returns. Errors (such as faults) are
+//!   reported through the job's future.
+
+namespace bolt { namespace vm
+{
+    //! The way the workers run the jobs.
+    //!
+    //! CHECKED: core_run
+    //! TRUSTED: core_run_trusted (the image is verified first)
+    //! JIT:     jit_run (the image is compiled first)
+    enum : uint32_t
+    {
+        POOL_CHECKED,
+        POOL_TRUSTED,
+        POOL_JIT
+    };
+    
+    //! A job, that calls the function at the given entry of the given
+    //!   segment, with the given arguments (arguments[0] being the first one).
+    struct pool_job
+    {
+        uint32_t segment;
+        uint32_t entry;
+        std::vector<uint32_t> arguments;
+    };
+    
+    //! The pool structure (see vm_pool.cpp).
+    struct pool;
+    
+    //! Create a pool of workers running jobs over a linked image (whose
+    //!   stack and heap sizes are used for the jobs' cores), in slices of
+    //!   the given budget (see core_run_for).
+    //! Note that you must free it with pool_free, before freeing the image.
+    pool* pool_create(core& image, uint32_t workers, uint32_t mode = POOL_CHECKED, uint64_t slice = 100000);
+    
+    //! Create a pool like above, whose jobs start from a snapshot of the
+    //!   image (see core_snapshot), typically taken after running its
+    //!   initialization : each job's core gets the snapshot's heap (and HB)
+    //!   back before the call, instead of the image's.
+    //! Note that you must free it with pool_free, before freeing the snapshot.
+    pool* pool_create(core& image, snapshot const& warm, uint32_t workers, uint32_t mode = POOL_CHECKED, uint64_t slice = 100000);
+    
+    //! Free a pool, once all the submitted jobs are done (including the
+    //!   suspended ones, which must be resumed).
+    void pool_free(pool* pl);
+    
+    //! Submit a job to a pool.
+    //! The returned future holds the job's result (RV), or the error that
+    //!   stopped it.
+    std::future<uint32_t> pool_submit(pool& pl, pool_job const& job);
+    
+    //! Complete the hatch call a job's core was suspended at, with the given
+    //!   return value, and queue the job again.
+    //! The core is the one the hatch was given, it must have been suspended.
+    void pool_resume(pool& pl, core& vco, uint32_t rv);
+} }
+
+#endif // BOLT_VM_POOL_H
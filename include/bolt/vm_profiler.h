@@ -0,0 +1,122 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BOLT_VM_PROFILER_H
+#define BOLT_VM_PROFILER_H
+
+#include "bolt/vm_core.h"
+#include "bolt/vm_decoder.h"
+#include "bolt/vm_symbols.h"
+#include <map>
+#include <ostream>
+#include <vector>
+
+//!
+//! vm_profiler
+//!
+
+//! This module is an exact profiler for the checked interpreter : a run with
+//!   core_run_profiled counts the instructions executed at each location of
+//!   the program, and the time they took, in host cycles (the time stamp
+//!   counter on x86, or else nanoseconds).
+//! The time between two dispatches is charged to the first instruction, the
+//!   profiler's own bookkeeping excluded. Fused sequences (see vm_fusions.inc)
+//!   are run one instruction at a time, so that each one is counted.
+//!
+//! The profiler follows the program's calls and returns, and charges each
+//!   instruction to the function it runs in (a function being named after
+//!   its entry location, see vm_symbols.h). The time of a function's
+//!   callees is included in its total time, but not in its self time.
+//!
+//! Profiling is a distinct variant of the interpreter's dispatch loop, so
+//!   that the other ones don't pay anything for it.
+
+namespace bolt { namespace vm
+{
+    //! The instructions executed at a location, and their time.
+    struct profile_counter
+    {
+        uint64_t count;
+        uint64_t cycles;
+    };
+    
+    //! A function of the program, with its self and total (callees included)
+    //!   counts and times. The active field counts its frames on the call
+    //!   stack, so that recursive calls are only charged once to its total.
+    struct profile_function
+    {
+        uint32_t segment;
+        uint32_t entry;
+        
+        uint64_t calls;
+        uint64_t self_count;
+        uint64_t self_cycles;
+        uint64_t total_count;
+        uint64_t total_cycles;
+        
+        uint32_t active;
+    };
+    
+    //! A frame of the profiler's call stack : the running function, and the
+    //!   profile's totals when it was called.
+    struct profile_frame
+    {
+        uint32_t function;
+        uint64_t count;
+        uint64_t cycles;
+    };
+    
+    //! The profiler's state.
+    //! The counters hold an entry per location of each segment. The last
+    //!   instruction dispatched (and its location) is charged at the next
+    //!   dispatch, for the time elapsed since stamp.
+    struct profile
+    {
+        std::vector<std::vector<profile_counter> > counters;
+        std::vector<profile_function> functions;
+        std::map<uint64_t, uint32_t> function_ids;
+        std::vector<profile_frame> frames;
+        
+        decoded_instruction const* last;
+        uint32_t last_segment;
+        uint32_t last_pc;
+        uint64_t stamp;
+        
+        uint64_t count;
+        uint64_t cycles;
+    };
+    
+    //! Create an empty profile for a core's program.
+    profile profile_create(core const& vco);
+    
+    //! Record the dispatch of a decoded instruction, from the current segment
+    //!   of a core (this is done by the profiling interpreter).
+    void profile_step(profile& prof, core const& vco, decoded_instruction const* ins);
+    
+    //! Charge the last instruction dispatched, and leave all the functions
+    //!   on the profiler's call stack (this is done at the end of a run).
+    void profile_stop(profile& prof);
+    
+    //! Print a profile's report : a flat profile of the program's locations,
+    //!   then the function breakdown, both sorted by time, naming locations
+    //!   and functions with the given symbol table.
+    void profile_report(profile const& prof, debug_symbols const& symbols, std::ostream& os);
+} }
+
+#endif // BOLT_VM_PROFILER_H
@@ -38,6 +38,8 @@ namespace bolt { namespace vm
     //!   runtime_generate_hatch<int(*)(int), &foo>("foo");
     //! Note that S is a function *pointer* type, so
     //!   using S = int(int) will *not* work.
+    //! A function whose first parameter is a core& gets the calling core
+    //!   there, the other parameters being its arguments.
     template <typename S, S function_ptr>
     hatch runtime_generate_hatch(std::string const& name)
     {
@@ -47,8 +49,31 @@ namespace bolt { namespace vm
         return htc;
     }
     
+    //! Statistics of a core's heap allocator (see the alloc, free, realloc and
+    //!   arena_reset hatches), in words.
+    //! The arena is the part of the heap that blocks were carved from since
+    //!   the last arena_reset, peak is its largest size (the high-water mark).
+    //! Live blocks span live words (including their header word and the
+    //!   rounding to their size class), for requested words :
+    //!   - arena - live is the free words held by the free lists (the external
+    //!     fragmentation),
+    //!   - live - requested is the words lost to the headers and the rounding
+    //!     (the internal fragmentation).
+    struct heap_stats
+    {
+        uint32_t capacity;
+        uint32_t arena;
+        uint32_t peak;
+        uint32_t live;
+        uint32_t requested;
+    };
+    
     //! Expose the Bolt's runtime library to a linker.
     void runtime_expose(as::linker& ln);
+    
+    //! Get the statistics of a core's heap allocator (all zeros but the
+    //!   capacity if the program never allocated from its heap).
+    heap_stats runtime_heap_stats(core const& vco);
 } }
 
 #endif // BOLT_VM_RUNTIME_H
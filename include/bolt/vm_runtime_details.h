@@ -20,7 +20,8 @@
 #define BOLT_VM_RUNTIME_DETAILS_H
 
 #include "bolt/vm_core.h"
-#include <functional>
+#include <type_traits>
+#include <utility>
 
 //!
 //! vm_runtime_details
@@ -41,18 +42,56 @@ namespace bolt { namespace vm
         struct type_size
         { enum { value = (sizeof(T) + sizeof(uint32_t) - 1U) / sizeof(uint32_t) }; };
         
-        //! A core wrapper used to keep track of actual position in the stack.
-        struct core_wrapper
-        {
-            core& vco;
-            int position;
-        };
+        //! Used to get the size of an argument on the stack.
+        //! Pointers are always 1 word (they are addresses in the core's memory).
+        template <typename T>
+        struct argument_size
+        { enum { value = type_size<T>::value }; };
         
-        //! Used to extract arguments from a vm::core stack.
         template <typename T>
+        struct argument_size<T*>
+        { enum { value = 1 }; };
+        
+        //! Used to get the total size of arguments on the stack.
+        template <typename... Args>
+        struct arguments_size
+        { enum { value = 0 }; };
+        
+        template <typename T, typename... Rest>
+        struct arguments_size<T, Rest...>
+        { enum { value = argument_size<T>::value + arguments_size<Rest...>::value }; };
+        
+        //! Used to get the offset (below SP) of the K-th argument.
+        //! Hatch arguments are pushed left to right, so that the last one is
+        //!   on the top of the stack.
+        template <unsigned int K, typename... Args>
+        struct argument_offset;
+        
+        template <typename T, typename... Rest>
+        struct argument_offset<0, T, Rest...>
+        { enum { value = arguments_size<T, Rest...>::value }; };
+        
+        template <unsigned int K, typename T, typename... Rest>
+        struct argument_offset<K, T, Rest...>
+        { enum { value = argument_offset<K - 1, Rest...>::value }; };
+        
+        //! A compile-time sequence of argument indices (std::index_sequence
+        //!   is C++14).
+        template <unsigned int... I>
+        struct index_sequence {};
+        
+        template <unsigned int N, unsigned int... I>
+        struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+        
+        template <unsigned int... I>
+        struct make_index_sequence<0, I...>
+        { typedef index_sequence<I...> type; };
+        
+        //! Used to extract an argument from a vm::core stack, given its offset.
+        template <typename T, unsigned int OFFSET>
         struct argument_extractor
         {
-            static T work(core_wrapper& cwr)
+            static T work(core& vco)
             {
                 // We use an union to fool GCC about pointer aliasing
                 union
@@ -61,31 +100,20 @@ namespace bolt { namespace vm
                     T* arg_ptr;
                 };
                 
-                // Compute the offset for this argument
-                unsigned int offset = cwr.vco.registers[REG_CODE_SP] - type_size<T>::value;
-                offset -= cwr.position;
-                // Get the corresponding argument's location in the stack
-                raw_ptr = cwr.vco.stack + offset;
-                // Advance the core wrapper's position for the next argument extraction
-                cwr.position += type_size<T>::value;
-                
+                // Get the argument's location in the stack
+                raw_ptr = vco.stack + (vco.registers[REG_CODE_SP] - OFFSET);
                 return *arg_ptr;
             }
         };
         
         //! Specialization for pointers, that must be redirected to the core's stack/heap.
-        template <typename T>
-        struct argument_extractor<T*>
+        template <typename T, unsigned int OFFSET>
+        struct argument_extractor<T*, OFFSET>
         {
-            static T* work(core_wrapper& cwr)
+            static T* work(core& vco)
             {
-                // Compute the offset for the argument (pointers are always 1 word)
-                unsigned int offset = cwr.vco.registers[REG_CODE_SP] - 1;
-                offset -= cwr.position;
-                // Get its location on the stack
-                uint32_t* address = cwr.vco.stack + offset;
-                // Advance position
-                cwr.position += 1;
+                // Get the address on the stack
+                uint32_t address = vco.stack[vco.registers[REG_CODE_SP] - OFFSET];
                 
                 // Fool GCC about pointer aliasing
                 union
@@ -95,7 +123,7 @@ namespace bolt { namespace vm
                 };
                 
                 // Follow the indirection
-                raw_ptr = cwr.vco.stack + *address;
+                raw_ptr = vco.stack + address;
                 return arg_ptr;
             }
         };
@@ -114,40 +142,68 @@ namespace bolt { namespace vm
         { static_assert(dependent_bool<false, S>::value, "run::detail::exposer: invalid function signature"); };
         
         //! The invoker structure for non-void returns.
-        //! H is decltype from a std::bind.
-        template <typename R, typename H>
+        //! Values are forwarded, so that the core itself can be passed by reference.
+        template <typename R>
         struct invoker
         {
-            static void work(H handler, core& vco)
-            { vco.registers[REG_CODE_RV] = handler(); }
+            template <typename F, typename... Values>
+            static void work(core& vco, F function_ptr, Values&&... values)
+            { vco.registers[REG_CODE_RV] = function_ptr(std::forward<Values>(values)...); }
+        };
+        
+        //! The invoker structure for float returns, whose bits go to %rv (the
+        //!   way float arguments are taken from the stack).
+        template <>
+        struct invoker<float>
+        {
+            template <typename F, typename... Values>
+            static void work(core& vco, F function_ptr, Values&&... values)
+            {
+                union
+                {
+                    float value;
+                    uint32_t raw;
+                };
+                
+                value = function_ptr(std::forward<Values>(values)...);
+                vco.registers[REG_CODE_RV] = raw;
+            }
         };
         
         //! The invoker structure for void returns (that does not
         //!   overwrites the %rv register.
-        template <typename H>
-        struct invoker<void, H>
+        template <>
+        struct invoker<void>
         {
-            static void work(H handler, core&)
-            { handler(); }
+            template <typename F, typename... Values>
+            static void work(core&, F function_ptr, Values&&... values)
+            { function_ptr(std::forward<Values>(values)...); }
         };
         
-        //! Defines a static function that invokes a generic function pointer
-        //!   extracting arguments from the vm::core's stack.
+        //! Defines a static function that invokes a function pointer (known at
+        //!   compile time), extracting arguments from the vm::core's stack.
+        //! The argument offsets are compile-time constants, so that this boils
+        //!   down to a few loads and a direct call.
         template <typename R, typename... Args>
         struct exposer<R(*)(Args...)>
         {
-            static void work(core& vco, R(*function_ptr)(Args...))
-            {
-                // The unused attribute silents the warning for functions
-                //   with no arguments.
-                core_wrapper __attribute__((unused)) cwr = { vco, 0 };
-                
-                // Bind the extracted arguments to the function pointer
-                auto handler = std::bind(*function_ptr, argument_extractor<Args>::work(cwr)...);
-                
-                // Invoke the bound function, taking care of the return value
-                invoker<R, decltype(handler)>::work(handler, vco);
-            }
+            typedef typename make_index_sequence<sizeof...(Args)>::type indices;
+            
+            template <R(*function_ptr)(Args...), unsigned int... I>
+            static void work(core& vco, index_sequence<I...>)
+            { invoker<R>::work(vco, function_ptr, argument_extractor<Args, argument_offset<I, Args...>::value>::work(vco)...); }
+        };
+        
+        //! Specialization for functions taking the calling core first (which
+        //!   is not an argument on the stack).
+        template <typename R, typename... Args>
+        struct exposer<R(*)(core&, Args...)>
+        {
+            typedef typename make_index_sequence<sizeof...(Args)>::type indices;
+            
+            template <R(*function_ptr)(core&, Args...), unsigned int... I>
+            static void work(core& vco, index_sequence<I...>)
+            { invoker<R>::work(vco, function_ptr, vco, argument_extractor<Args, argument_offset<I, Args...>::value>::work(vco)...); }
         };
         
         //! An exposer bound to a function pointer.
@@ -155,7 +211,7 @@ namespace bolt { namespace vm
         struct bound_exposer
         {
             static void work(core& vco)
-            { exposer<S>::work(vco, function_ptr); }
+            { exposer<S>::template work<function_ptr>(vco, typename exposer<S>::indices()); }
         };
     }
 } }
@@ -0,0 +1,94 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BOLT_VM_SAMPLER_H
+#define BOLT_VM_SAMPLER_H
+
+#include "bolt/vm_core.h"
+#include "bolt/vm_symbols.h"
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//!
+//! vm_sampler
+//!
+
+//! This module is a sampling profiler, cheap enough to profile cores running
+//!   real traffic : instead of recording each dispatch (see vm_profiler.h),
+//!   it runs the core in slices of a number of dispatches (see core_run_sampled),
+//!   and takes a sample of its call stack between two slices, wherever the
+//!   run stands. The interpreter itself only counts the dispatches down.
+//!
+//! The call stack is walked through the frames pushed by CALL (see the calling
+//!   convention in vm_handlers.inc) : AB points just below the running
+//!   function's frame, which holds the caller's AB, and the SEG and PC to
+//!   return to. A return location is only trusted if it follows a CALL
+//!   instruction, so that the walk stops at the bottom of the stack, or at
+//!   anything the program may have overwritten.
+//! Each location is charged to the function it belongs to, that is the last
+//!   function entry (a CALL target, or a segment's entry point) at or before
+//!   it, named after its label (see vm_symbols.h).
+//!
+//! Samples are weighted by the host time (in nanoseconds) their slice took.
+//!   Hatch calls are run apart from the slices, and timed on their own : their
+//!   time is sampled whenever it adds up to as much as the last slice's, with
+//!   the called hatch as the innermost frame (the time of very short hatches
+//!   includes the cost of running them apart). A core suspended in a hatch
+//!   (see core_suspend) has the hatch as its innermost frame as well.
+//!
+//! The samples are written as folded stacks, one line per distinct stack
+//!   (the functions from the outermost one, separated by semicolons, then
+//!   the total weight), which is what flame graph tools take as input.
+
+namespace bolt { namespace vm
+{
+    //! The sampler's state.
+    //! The entries hold the sorted function entries of each segment, and
+    //!   stacks the total weight of each folded stack.
+    struct sampler
+    {
+        std::vector<std::vector<uint32_t> > entries;
+        std::map<std::string, uint64_t> stacks;
+        
+        uint64_t samples;
+        uint64_t weight;
+    };
+    
+    //! Create a sampler for a core's program, finding its functions in
+    //!   the decoded segments (decoding them first if needed).
+    sampler sampler_create(core& vco);
+    
+    //! Take a sample of a core's call stack, with the given weight.
+    //! Its innermost frame is the hatch it is suspended in, if any.
+    void sampler_sample(sampler& smp, core const& vco, debug_symbols const& symbols, uint64_t weight = 1);
+    
+    //! Run a core like core_run_for (with an unlimited budget), in slices
+    //!   of the given period (in dispatches), taking a sample after each, and
+    //!   running hatch calls apart to sample their time (see above).
+    //! Returns the status of the run (see CORE_*).
+    uint32_t sampler_run(sampler& smp, core& vco, debug_symbols const& symbols,
+                         uint64_t period = 1000, std::string* fault = 0);
+                         
+    //! Write the samples as folded stacks.
+    void sampler_write(sampler const& smp, std::ostream& os);
+} }
+
+#endif // BOLT_VM_SAMPLER_H
@@ -0,0 +1,66 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BOLT_VM_SYMBOLS_H
+#define BOLT_VM_SYMBOLS_H
+
+#include "bolt/common.h"
+#include <string>
+#include <vector>
+
+//!
+//! vm_symbols
+//!
+
+//! This module defines a symbol table for linked programs, which maps the
+//!   labels of the assembled modules to their final locations, so that the
+//!   debugging and profiling tools can name the program's locations.
+//! It is filled by the linker (see linker_debug_symbols), as the virtual core
+//!   itself only knows segments and offsets.
+
+namespace bolt { namespace vm
+{
+    //! A label, at the given location of the given segment.
+    struct debug_label
+    {
+        std::string name;
+        uint32_t segment;
+        uint32_t location;
+    };
+    
+    //! The symbol table, its labels are sorted by segment, then location.
+    struct debug_symbols
+    {
+        std::vector<debug_label> labels;
+    };
+    
+    //! Add a label to a symbol table.
+    void symbols_add(debug_symbols& symbols, std::string const& name, uint32_t segment, uint32_t location);
+    
+    //! Find the label closest to a location (the last one at or before it,
+    //!   in the same segment).
+    //! Returns 0 if there is none.
+    debug_label const* symbols_find(debug_symbols const& symbols, uint32_t segment, uint32_t location);
+    
+    //! Name a location after the label closest to it, as "label" or "label+offset",
+    //!   or as "segment:location" if there is none.
+    std::string symbols_name(debug_symbols const& symbols, uint32_t segment, uint32_t location);
+} }
+
+#endif // BOLT_VM_SYMBOLS_H
@@ -0,0 +1,99 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BOLT_VM_TRACE_H
+#define BOLT_VM_TRACE_H
+
+#include "bolt/vm_core.h"
+#include "bolt/vm_symbols.h"
+#include <istream>
+#include <ostream>
+
+//!
+//! vm_trace
+//!
+
+//! This module defines execution traces, for post-mortem debugging : a trace
+//!   is a fixed-size ring buffer that holds the last instructions run by
+//!   a core (their SEG, PC, IR and SP, before running them).
+//!
+//! A trace is attached to a core through its trace field, and then records
+//!   its runs by the checked interpreter (core_run, core_run_for, and
+//!   core_run_trusted which runs traced cores checked). Recording is a variant
+//!   of the dispatch loop, which only adds a single store per instruction
+//!   to a preallocated buffer, so that it is cheap enough to leave enabled.
+//! Fused sequences (see vm_fusions.inc) are run one instruction at a time,
+//!   so that each one is recorded. The JIT compiled code doesn't record anything.
+//!
+//! A trace can be written to a file once the run stopped (typically, when
+//!   it faulted), and read back to be dumped with the program's symbols
+//!   (see bolt --decode-trace).
+
+namespace bolt { namespace vm
+{
+    //! A recorded instruction.
+    struct trace_entry
+    {
+        uint32_t seg;
+        uint32_t pc;
+        uint32_t ir;
+        uint32_t sp;
+    };
+    
+    //! The ring buffer, its size is a power of two. The position is the
+    //!   number of instructions recorded so far, the last ones being in
+    //!   the buffer.
+    struct trace_buffer
+    {
+        uint32_t size;
+        uint64_t position;
+        trace_entry* entries;
+    };
+    
+    //! Create a trace of (at least) the given number of entries.
+    trace_buffer trace_create(uint32_t size);
+    
+    //! Free a trace.
+    void trace_free(trace_buffer& trace);
+    
+    //! Record an instruction in a trace.
+    static inline void trace_record(trace_buffer& trace, uint32_t seg, uint32_t pc, uint32_t ir, uint32_t sp)
+    {
+        trace_entry entry = { seg, pc, ir, sp };
+        trace.entries[trace.position++ & (trace.size - 1)] = entry;
+    }
+    
+    //! Get the number of instructions held by a trace.
+    uint32_t trace_count(trace_buffer const& trace);
+    
+    //! Get the instructions held by a trace, from the oldest (0) one.
+    trace_entry const& trace_get(trace_buffer const& trace, uint32_t i);
+    
+    //! Write a trace to a binary stream (only the instructions it holds).
+    void trace_write(trace_buffer const& trace, std::ostream& os);
+    
+    //! Read a trace from a binary stream.
+    trace_buffer trace_read(std::istream& is);
+    
+    //! Print the instructions held by a trace, from the oldest one, naming
+    //!   their locations with the given symbol table.
+    void trace_dump(trace_buffer const& trace, debug_symbols const& symbols, std::ostream& os = std::cout);
+} }
+
+#endif // BOLT_VM_TRACE_H
@@ -0,0 +1,77 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOLT_VM_VERIFIER_H
+#define BOLT_VM_VERIFIER_H
+
+#include "bolt/vm_core.h"
+#include <vector>
+
+//!
+//! vm_verifier
+//!
+
+//! This module is a static verifier for the decoded program of a linked
+//!   virtual core, which lets the trusted interpreter (see core_run_trusted)
+//!   skip the stack and memory bounds checks on the code it could verify.
+//!
+//! The program is verified function by function, a function being the
+//!   instructions that can be reached from a CALL target (or from the entry
+//!   point of the base segment) without calling. A function is verified if :
+//!   - all its instructions are valid, and decode consistently (no jump lands
+//!     in the middle of another instruction's operands),
+//!   - all its jumps and calls have constant targets (and its segment never
+//!     writes to its own immediates),
+//!   - it never writes to PC, SEG nor SP,
+//!   - the stack depth (relative to the function's entry) is the same on all
+//!     paths to each instruction, never goes below zero, and is zero at RET.
+//! A CALL is assumed to leave the stack unchanged (the callee returns to
+//!   the same depth), which is checked at run time when needed.
+//!
+//! Verified functions get their maximum stack depth, which is checked once
+//!   when entering them instead of on each push, and their stack accesses
+//!   ([%sp-#n] within the function's own stack words) and constant memory
+//!   accesses are marked as proven (see vm_decoder.h).
+//! The other functions (and memory accesses) keep using the checked
+//!   interpreter.
+
+namespace bolt { namespace vm
+{
+    //! Verify the program of a linked virtual core, decoding its segments
+    //!   first if needed. The results are recorded in the decoded streams.
+    //! Returns the number of functions that could not be verified.
+    uint32_t verifier_verify(core& vco);
+    
+    //! Compute the number of stack words the program of a linked virtual core
+    //!   can use, when run from its entry point (see core_reset), decoding its
+    //!   segments first if needed.
+    //! This is the largest depth its functions reach, each call adding its
+    //!   frame and the callee's own bound, following the call graph from the
+    //!   base segment's entry.
+    //! Returns false if there is no such bound : when a reachable function can't
+    //!   be verified, or is (directly or not) recursive.
+    bool verifier_stack_bound(core& vco, uint32_t& bound);
+    
+    //! Compute the number of stack words the functions starting at the given
+    //!   locations (as pairs of segment and location) can use, like
+    //!   verifier_stack_bound does from the entry point : this is the largest
+    //!   of their bounds, without the frame and arguments of their caller.
+    bool verifier_functions_bound(core& vco, std::vector<uint32_t> const& functions, uint32_t& bound);
+} }
+
+#endif // BOLT_VM_VERIFIER_H
@@ -295,6 +295,21 @@ namespace bolt { namespace as
                 }
             }
         }
+        else if (directive == "stack" || directive == "heap")
+        {
+            // Get the requested size, in words
+            assembler_expect(ass, TOKEN_IMMEDIATE, "." + directive + " directive expects an immediate");
+            tok = lexer_get(ass.lex);
+            uint32_t size = assembler_parse_immediate(tok.value);
+            
+            if (!size)
+                assembler_parse_error(tok, "." + directive + " size must be positive");
+                
+            if (directive == "stack")
+                ass.mod.stack_size = size;
+            else
+                ass.mod.heap_size = size;
+        }
         else
             assembler_parse_error(tok, "unknown directive \"" + directive + "\"");
     }
@@ -665,6 +680,15 @@ namespace bolt { namespace as
             // Fix the location
             sym->location = l->location;
         }
+        
+        // Keep all labels, to name locations when debugging
+        for (uint32_t i = 0; i < ass.labels_size; ++i)
+        {
+            symbol label;
+            label.name = ass.labels[i].name;
+            label.location = ass.labels[i].location;
+            module_add_label(ass.mod, label);
+        }
     }
     
     /*************************/
@@ -17,6 +17,8 @@
  */
 
 #include "bolt/as_linker.h"
+#include "bolt/vm_decoder.h"
+#include "bolt/vm_verifier.h"
 #include <stdexcept>
 #include <algorithm>
 
@@ -65,6 +67,8 @@ namespace bolt { namespace as
     }
     
     //! Free temporary stuff from the linker (tables, ...).
+    //! The objects keep their used flags and segment ids, so that
+    //!   linker_debug_symbols can map their labels.
     void linker_temps_free(linker& ln)
     {
         for (uint32_t i = 0; i < ln.hatch_entries_size; ++i)
@@ -84,7 +88,6 @@ namespace bolt { namespace as
             
             ln.objects[i].solutions = 0;
             ln.objects[i].solutions_size = 0;
-            ln.objects[i].used = false;
         }
     }
     
@@ -207,6 +210,9 @@ namespace bolt { namespace as
             seg->size = obj.mod.segment_size;
             seg->buffer = new uint32_t[seg->size];
             seg->entry = obj.mod.entry;
+            seg->read_only = ln.read_only;
+            seg->code = 0;
+            seg->native = 0;
             
             // Copy program code
             std::copy_n(obj.mod.segment, seg->size, seg->buffer);
@@ -336,6 +342,115 @@ namespace bolt { namespace as
             ln.vco.hatches[hte.hatch_id]->name = hte.hatch.name;
             ln.vco.hatches[hte.hatch_id]->entry = hte.hatch.entry;
         }
+        
+        vm::core_bind_hatches(ln.vco);
+    }
+    
+    //! Translate each segment's program memory into its pre-decoded
+    //!   instruction stream (see vm_decoder.h), and find out which registers
+    //!   each constant CALL has to save.
+    //! This must be done last, once every word of the segments was fixed.
+    void linker_decode_segments(linker& ln)
+    {
+        for (uint32_t i = 0; i < ln.segments_count; ++i)
+        {
+            vm::segment* seg = ln.vco.segments[i];
+            seg->code = vm::decoder_decode(*seg);
+        }
+        
+        vm::decoder_frames(ln.vco);
+    }
+    
+    //! The memory sizes used when nothing else is known (in words).
+    enum : uint32_t
+    {
+        LINKER_DEFAULT_STACK_SIZE = 1024,
+        LINKER_DEFAULT_HEAP_SIZE  = 1024
+    };
+    
+    //! The number of argument words the computed stack leaves room for, below
+    //!   the frame of a call from the host (see core_call).
+    enum : uint32_t
+    {
+        LINKER_CALL_ARGS_SIZE = 16
+    };
+    
+    //! Compute the stack bound of the linked program (see verifier_stack_bound),
+    //!   returning false if there is none.
+    //! The exported functions may also be called from the host, with their
+    //!   arguments and a CALL frame below their own bound.
+    bool linker_stack_bound(linker& ln, uint32_t& bound)
+    {
+        if (!vm::verifier_stack_bound(ln.vco, bound))
+            return false;
+            
+        std::vector<uint32_t> functions;
+        for (uint32_t i = 0; i < ln.objects_size; ++i)
+        {
+            object& obj = ln.objects[i];
+            if (!obj.used)
+                continue;
+                
+            for (uint32_t j = 0; j < obj.mod.symbols_size; ++j)
+            {
+                functions.push_back(obj.segment_id);
+                functions.push_back(obj.mod.symbols[j].location);
+            }
+        }
+        
+        uint32_t exported;
+        if (functions.size())
+        {
+            if (!vm::verifier_functions_bound(ln.vco, functions, exported))
+                return false;
+                
+            uint64_t words = (uint64_t) exported + vm::CALL_FRAME_SIZE + LINKER_CALL_ARGS_SIZE;
+            if (words > UINT32_MAX)
+                return false;
+                
+            bound = std::max(bound, (uint32_t) words);
+        }
+        
+        return true;
+    }
+    
+    //! Size and allocate the VCO's memory (see linker for the rules).
+    //! The stack bound is computed from the decoded segments, so this
+    //!   must be done once the program is decoded, and its base segment set.
+    void linker_size_memory(linker& ln)
+    {
+        uint32_t stack_size = 0;
+        uint32_t heap_size = 0;
+        
+        // Modules may state their requirements, the largest ones win
+        for (uint32_t i = 0; i < ln.objects_size; ++i)
+        {
+            object& obj = ln.objects[i];
+            if (!obj.used)
+                continue;
+                
+            stack_size = std::max(stack_size, obj.mod.stack_size);
+            heap_size = std::max(heap_size, obj.mod.heap_size);
+        }
+        
+        if (ln.stack_size)
+            stack_size = ln.stack_size;
+        else if (!stack_size && linker_stack_bound(ln, stack_size))
+            stack_size = std::max(stack_size, 1u);
+        else if (!stack_size)
+            stack_size = LINKER_DEFAULT_STACK_SIZE;
+            
+        if (ln.heap_size)
+            heap_size = ln.heap_size;
+        else if (!heap_size)
+            heap_size = LINKER_DEFAULT_HEAP_SIZE;
+            
+        if ((uint64_t) stack_size + heap_size > UINT32_MAX)
+            throw std::logic_error("as::linker_size_memory: memory too large");
+            
+        ln.vco.stack_size = stack_size;
+        ln.vco.heap_size = heap_size;
+        ln.vco.stack = new uint32_t[stack_size + heap_size];
     }
     
     //! Find the default entry module.
@@ -380,6 +495,11 @@ namespace bolt { namespace as
         ln.hatch_entries_size = 0;
         ln.hatch_entries = 0;
         
+        ln.read_only = false;
+        
+        ln.stack_size = 0;
+        ln.heap_size = 0;
+        
         return ln;
     }
     
@@ -441,10 +561,9 @@ namespace bolt { namespace as
         // Resolt hatch references
         linker_resolve_hatch_references(ln);
         
-        // Create the output virtual core
-        //FIXME: determine stack size automatically !
-        //FIXME: determine heap size automatically !
-        ln.vco = vm::core_create(1024, 1024, ln.segments_count, ln.hatches_count);
+        // Create the output virtual core, its memory is allocated
+        //   once the program is known
+        ln.vco = vm::core_create(0, 0, ln.segments_count, ln.hatches_count);
         
         // Copy all code segments in virtual core's segment memory
         linker_copy_segments(ln);
@@ -458,12 +577,31 @@ namespace bolt { namespace as
         // Apply hatch solutions to segment memory
         linker_apply_hatch_solutions(ln);
         
+        // Pre-decode the linked program
+        linker_decode_segments(ln);
+        
         // Set VCO's base segment
         ln.vco.base = ln.objects[ln.base_object].segment_id;
         
+        // Size the VCO's stack and heap
+        linker_size_memory(ln);
+        
         // Release temporaries
         linker_temps_free(ln);
         
         return ln.vco;
     }
+    
+    void linker_debug_symbols(linker const& ln, vm::debug_symbols& symbols)
+    {
+        for (uint32_t i = 0; i < ln.objects_size; ++i)
+        {
+            object const& obj = ln.objects[i];
+            if (!obj.used)
+                continue;
+                
+            for (uint32_t j = 0; j < obj.mod.labels_size; ++j)
+                vm::symbols_add(symbols, obj.mod.labels[j].name, obj.segment_id, obj.mod.labels[j].location);
+        }
+    }
 } }
@@ -111,6 +111,9 @@ namespace bolt { namespace as
         mod.symbols_size = 0;
         mod.symbols = 0;
         
+        mod.labels_size = 0;
+        mod.labels = 0;
+        
         mod.hatch_references_size = 0;
         mod.hatch_references = 0;
         
@@ -123,6 +126,9 @@ namespace bolt { namespace as
         mod.has_entry = false;
         mod.entry = 0;
         
+        mod.stack_size = 0;
+        mod.heap_size = 0;
+        
         return mod;
     }
     
@@ -155,6 +161,11 @@ namespace bolt { namespace as
             delete[] mod.symbols;
         mod.symbols = 0;
         mod.symbols_size = 0;
+        
+        if (mod.labels)
+            delete[] mod.labels;
+        mod.labels = 0;
+        mod.labels_size = 0;
     }
     
     symbol& module_add_symbol(module& mod, symbol const& sym)
@@ -171,6 +182,11 @@ namespace bolt { namespace as
         return 0;
     }
     
+    symbol& module_add_label(module& mod, symbol const& label)
+    {
+        return (grow_array(mod.labels_size++, mod.labels) = label);
+    }
+    
     relocation& module_add_relocation(module& mod, std::string const& name)
     {
         relocation& reloc = grow_array(mod.relocations_size++, mod.relocations);
@@ -18,11 +18,65 @@
 
 #include "bolt/as_assembler.h"
 #include "bolt/as_linker.h"
+#include "bolt/vm_aot.h"
 #include "bolt/vm_core.h"
+#include "bolt/vm_jit.h"
+#include "bolt/vm_profiler.h"
 #include "bolt/vm_runtime.h"
+#include "bolt/vm_sampler.h"
+#include "bolt/vm_trace.h"
+#include "bolt/vm_verifier.h"
 
 #include <lconf/cli.h>
 #include <fstream>
+#include <stdexcept>
+
+//! Parse a size option (a positive number of words or instructions).
+static uint32_t parse_size(std::string const& value)
+{
+    std::size_t end;
+    unsigned long size = std::stoul(value, &end, 0);
+    
+    if (end != value.size() || !size || size > UINT32_MAX)
+        throw std::out_of_range(value);
+        
+    return size;
+}
+
+//! Parse a size option if it was given, reporting it if it is invalid.
+static bool parse_size_option(lconf::cli::Parser const& options, std::string const& name, uint32_t& size)
+{
+    if (!options.has(name))
+        return true;
+        
+    try
+    {
+        size = parse_size(options.get(name));
+    }
+    catch (std::exception const&)
+    {
+        std::cerr << "Error: Invalid --" << name << " value \"" << options.get(name) << "\"." << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+//! Write an execution trace to a file.
+static bool write_trace(std::string const& fn, bolt::vm::trace_buffer const& trace)
+{
+    std::ofstream fs(fn, std::ios::out | std::ios::binary);
+    if (fs)
+        bolt::vm::trace_write(trace, fs);
+        
+    if (!fs)
+    {
+        std::cerr << "Error: Unable to write the trace to \"" << fn << "\"." << std::endl;
+        return false;
+    }
+    
+    return true;
+}
 
 int main(int argc, char** argv)
 {
@@ -49,7 +103,43 @@ int main(int argc, char** argv)
            
     options.addSwitch('l', "link-only")
            .setDescription("Only assemble and link the input modules, do not run them");
-    
+           
+    options.addSwitch('j', "jit")
+           .setDescription("Compile the program to native code before running it (x86-64 only)");
+           
+    options.addSwitch('t', "trusted")
+           .setDescription("Verify the program, and prove the bounds checks of the verified code instead of doing them at run time");
+           
+    options.addSwitch('r', "read-only")
+           .setDescription("Link the program as read-only code, which can't write to its immediates");
+           
+    options.addSwitch('c', "emit-c")
+           .setDescription("Translate the linked program to C++ on the standard output, do not run it");
+           
+    options.addSwitch('p', "profile")
+           .setDescription("Profile the program while running it, and print the report on the standard error");
+           
+    options.addOption('s', "sample")
+           .setDescription("Sample the program's call stack while running it, and write the folded stacks to the given file");
+           
+    options.addOption('P', "sample-period")
+           .setDescription("Sample every given number of instructions dispatched (1000 by default)");
+           
+    options.addOption('T', "trace")
+           .setDescription("Record the last instructions run in a trace, and write it to the given file");
+           
+    options.addOption('N', "trace-size")
+           .setDescription("Record the given number of instructions in the trace (4096 by default)");
+           
+    options.addOption('D', "decode-trace")
+           .setDescription("Print the trace in the given file, named after the linked modules, do not run them");
+           
+    options.addOption('S', "stack")
+           .setDescription("Use a stack of the given number of words, instead of computing it");
+           
+    options.addOption('H', "heap")
+           .setDescription("Use a heap of the given number of words, instead of the program's .heap size");
+           
     /************************************/
     /*** Options parsing and checking ***/
     /************************************/
@@ -88,6 +178,34 @@ int main(int argc, char** argv)
         std::cerr << "Warning: --no-std-lib has no effect while assembling only" << std::endl;
     }
     
+    if ((options.has("profile") || options.has("sample")) && (options.has("jit") || options.has("trusted")))
+    {
+        std::cerr << "Warning: The profilers only run the checked interpreter." << std::endl;
+        std::cerr << "         I will ignore --jit and --trusted." << std::endl;
+    }
+    
+    if (options.has("profile") && options.has("sample"))
+    {
+        std::cerr << "Warning: Both --profile and --sample were specified." << std::endl;
+        std::cerr << "         I will only profile." << std::endl;
+    }
+    
+    if (options.has("trace") && (options.has("jit") || options.has("profile")))
+    {
+        std::cerr << "Warning: --trace has no effect with --jit nor --profile." << std::endl;
+    }
+    
+    uint32_t stack_size = 0;
+    uint32_t heap_size = 0;
+    uint32_t sample_period = 1000;
+    uint32_t trace_size = 4096;
+    
+    if (!parse_size_option(options, "stack", stack_size) ||
+        !parse_size_option(options, "heap", heap_size) ||
+        !parse_size_option(options, "sample-period", sample_period) ||
+        !parse_size_option(options, "trace-size", trace_size))
+        return -1;
+    
     /******************/
     /*** Assembling ***/
     /******************/
@@ -132,6 +250,7 @@ int main(int argc, char** argv)
     /***************/
     
     core vco;
+    debug_symbols symbols;
     
     try
     {
@@ -146,8 +265,15 @@ int main(int argc, char** argv)
             runtime_expose(ln);
         
         //! Link the virtual core.
+        ln.read_only = options.has("read-only");
+        ln.stack_size = stack_size;
+        ln.heap_size = heap_size;
         vco = linker_link(ln);
         
+        //! Keep the labels to name the profiled or traced locations.
+        if (options.has("profile") || options.has("sample") || options.has("decode-trace"))
+            linker_debug_symbols(ln, symbols);
+            
         //! Release all linking stuff.
         linker_free_modules(ln);
         linker_free(ln);
@@ -158,7 +284,39 @@ int main(int argc, char** argv)
         return -1;
     }
     
-    if (options.has("link-only"))
+    if (options.has("emit-c"))
+    {
+        try
+        {
+            aot_emit(vco, std::cout);
+        }
+        catch (std::exception const& exc)
+        {
+            std::cerr << "Error: " << exc.what() << std::endl;
+            return -1;
+        }
+    }
+    
+    if (options.has("decode-trace"))
+    {
+        try
+        {
+            std::ifstream fs(options.get("decode-trace"), std::ios::in | std::ios::binary);
+            if (!fs)
+                throw std::logic_error("Unable to open the trace file");
+                
+            trace_buffer trace = trace_read(fs);
+            trace_dump(trace, symbols);
+            trace_free(trace);
+        }
+        catch (std::exception const& exc)
+        {
+            std::cerr << "Error: " << exc.what() << std::endl;
+            return -1;
+        }
+    }
+    
+    if (options.has("link-only") || options.has("emit-c") || options.has("decode-trace"))
     {
         core_free_hatches(vco);
         core_free_segments(vco);
@@ -171,20 +329,65 @@ int main(int argc, char** argv)
     /*** Execution ***/
     /*****************/
     
+    trace_buffer trace = trace_create(options.has("trace") ? trace_size : 1);
+    if (options.has("trace"))
+        vco.trace = &trace;
+        
     try
     {
         core_reset(vco);
-        core_run(vco);
+        if (options.has("profile"))
+        {
+            profile prof = profile_create(vco);
+            try
+            {
+                core_run_profiled(vco, prof);
+            }
+            catch (...)
+            {
+                profile_report(prof, symbols, std::cerr);
+                throw;
+            }
+            profile_report(prof, symbols, std::cerr);
+        }
+        else if (options.has("sample"))
+        {
+            std::ofstream fs(options.get("sample"), std::ios::out);
+            if (!fs)
+                throw std::logic_error("Unable to open the samples file");
+                
+            sampler smp = sampler_create(vco);
+            std::string fault;
+            uint32_t status = sampler_run(smp, vco, symbols, sample_period, &fault);
+            sampler_write(smp, fs);
+            
+            if (status == CORE_FAULTED)
+                throw std::runtime_error(fault);
+        }
+        else if (options.has("jit"))
+            jit_run(vco);
+        else if (options.has("trusted"))
+        {
+            verifier_verify(vco);
+            core_run_trusted(vco);
+        }
+        else
+            core_run(vco);
     }
     catch (std::exception const& exc)
     {
         std::cerr << "Error: " << exc.what() << std::endl;
+        if (options.has("trace"))
+            write_trace(options.get("trace"), trace);
         return -1;
     }
     
+    bool traced = !options.has("trace") || write_trace(options.get("trace"), trace);
+    trace_free(trace);
+    
     core_free_hatches(vco);
     core_free_segments(vco);
     core_free(vco);
     
-    return 0;
+    return traced ? 0 : -1;
 }
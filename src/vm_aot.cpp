@@ -0,0 +1,1038 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bolt/vm_aot.h"
+#include "bolt/vm_decoder.h"
+#include <vector>
+#include <sstream>
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! This macro defines the behavior of the declarations in vm_registers.inc,
+    //!   here we build the table of the register names, as used in the
+    //!   generated code.
+    #define DECL_REGISTER(name, value) \
+        "REG_CODE_" #name,
+        
+    static char const* const aot_registers[REG_COUNT] =
+    {
+        #include "bolt/vm_registers.inc"
+    };
+    
+    #undef DECL_REGISTER
+    
+    //! A function of the generated code.
+    //! The body array tells which locations are part of it.
+    struct aot_function
+    {
+        uint32_t seg;
+        uint32_t entry;
+        
+        std::vector<bool> body;
+    };
+    
+    //! Translation state.
+    //! The code array holds the decoded stream of each segment.
+    //! The entries array holds the index of the function starting at
+    //!   each location of each segment (or -1).
+    //! The pending array is the list of functions that are still to be walked.
+    struct aot_translator
+    {
+        core const* vco;
+        std::vector<decoded_instruction*> code;
+        std::vector<bool> decoded;
+        std::vector<bool> self_modifying;
+        
+        std::vector<std::vector<int64_t> > entries;
+        std::vector<aot_function> functions;
+        std::vector<size_t> pending;
+    };
+    
+    //! The state of a function's translation.
+    //! The dispatch, depth and imm flags tell if the function's dispatch label,
+    //!   depth parameter and immediates pointer are used.
+    struct aot_context
+    {
+        aot_translator const* at;
+        aot_function const* fn;
+        segment const* seg;
+        
+        bool dispatch;
+        bool depth;
+        bool imm;
+    };
+    
+    //! Check if an instruction is a conditional jump.
+    static bool aot_is_jump_if(uint32_t icode)
+    {
+        return icode == I_CODE_JZ || icode == I_CODE_JNZ || icode == I_CODE_JE || icode == I_CODE_JNE ||
+               icode == I_CODE_JL || icode == I_CODE_JLE || icode == I_CODE_JG || icode == I_CODE_JGE;
+    }
+    
+    //! Check if an operand is known at translation time.
+    static bool aot_is_constant(aot_translator const& at, uint32_t seg, decoded_operand const& op)
+    {
+        return op.kind == OPK_IMM && !at.self_modifying[seg];
+    }
+    
+    //! Get (creating it if needed) the function starting at the given location.
+    static size_t aot_function_at(aot_translator& at, uint32_t seg, uint32_t entry)
+    {
+        if (at.entries[seg][entry] >= 0)
+            return at.entries[seg][entry];
+            
+        aot_function fn;
+        fn.seg = seg;
+        fn.entry = entry;
+        fn.body.assign(at.vco->segments[seg]->size, false);
+        
+        at.entries[seg][entry] = at.functions.size();
+        at.pending.push_back(at.functions.size());
+        at.functions.push_back(fn);
+        
+        return at.entries[seg][entry];
+    }
+    
+    //! Get the target of a constant CALL (in its segment), returning false if
+    //!   the target is computed, out of bounds or in a self-modifying segment
+    //!   (which is left to the interpreter).
+    static bool aot_call_target(aot_translator const& at, uint32_t seg, decoded_instruction const& ins,
+                                uint32_t& target_seg, uint32_t& target)
+    {
+        if (!aot_is_constant(at, seg, ins.a))
+            return false;
+            
+        if (ins.b.kind == OPK_NONE)
+        {
+            target_seg = seg;
+            target = *ins.a.imm;
+        }
+        else
+        {
+            if (!aot_is_constant(at, seg, ins.b))
+                return false;
+                
+            target_seg = *ins.a.imm;
+            target = *ins.b.imm;
+        }
+        
+        return target_seg < at.vco->segments_size && target < at.vco->segments[target_seg]->size &&
+               !at.self_modifying[target_seg];
+    }
+    
+    //! Find the body of a function, by following the program's flow from
+    //!   its entry (stepping over calls), and collect its call targets.
+    static void aot_walk(aot_translator& at, size_t index)
+    {
+        uint32_t seg = at.functions[index].seg;
+        uint32_t size = at.vco->segments[seg]->size;
+        decoded_instruction const* code = at.code[seg];
+        
+        std::vector<bool> body(size, false);
+        std::vector<uint32_t> pending(1, at.functions[index].entry);
+        std::vector<uint32_t> calls;
+        
+        while (pending.size())
+        {
+            uint32_t pc = pending.back();
+            pending.pop_back();
+            
+            while (pc < size && !body[pc])
+            {
+                decoded_instruction const& ins = code[pc];
+                uint32_t icode = decoder_icode(ins);
+                body[pc] = true;
+                
+                if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+                    break;
+                    
+                if (icode == I_CODE_JMP || aot_is_jump_if(icode))
+                {
+                    if (aot_is_constant(at, seg, ins.a))
+                        pending.push_back(*ins.a.imm);
+                    if (icode == I_CODE_JMP)
+                        break;
+                }
+                else if (icode == I_CODE_CALL)
+                {
+                    uint32_t target_seg, target;
+                    if (aot_call_target(at, seg, ins, target_seg, target))
+                    {
+                        calls.push_back(target_seg);
+                        calls.push_back(target);
+                    }
+                }
+                else if (icode == I_CODE_RET || icode == I_CODE_HALT || icode == I_CODE_RST)
+                    break;
+                else if ((icode == I_CODE_POP || icode == I_CODE_MOV) && ins.a.kind == OPK_REG &&
+                         (ins.a.reg == REG_CODE_PC || ins.a.reg == REG_CODE_SEG || ins.a.reg == REG_CODE_PSR))
+                    break;
+                    
+                pc = ins.next;
+            }
+        }
+        
+        at.functions[index].body = body;
+        for (size_t i = 0; i < calls.size(); i += 2)
+            aot_function_at(at, calls[i], calls[i + 1]);
+    }
+    
+    //! Get the name of a function of the generated code.
+    static std::string aot_function_name(aot_function const& fn)
+    {
+        std::ostringstream ss;
+        ss << "seg" << fn.seg << "_" << fn.entry;
+        return ss.str();
+    }
+    
+    //! Write a word as a C++ literal.
+    static std::string aot_literal(uint32_t value)
+    {
+        std::ostringstream ss;
+        ss << "0x" << std::hex << value << "u";
+        return ss.str();
+    }
+    
+    //! Get the value of an immediate operand (as an expression of the generated code).
+    static std::string aot_immediate(aot_context& ctx, decoded_operand const& op)
+    {
+        if (aot_is_constant(*ctx.at, ctx.fn->seg, op))
+            return aot_literal(*op.imm);
+            
+        std::ostringstream ss;
+        ss << "imm[" << op.imm - ctx.seg->buffer << "]";
+        ctx.imm = true;
+        return ss.str();
+    }
+    
+    //! Get a register (as an expression of the generated code).
+    //! SP is kept in a local variable, see aot_sync.
+    static std::string aot_register(uint32_t reg)
+    {
+        if (reg == REG_CODE_SP)
+            return "sp";
+            
+        return std::string("r[") + aot_registers[reg] + "]";
+    }
+    
+    //! Get the address of an operand (as an expression of the generated code).
+    //! Constant immediates have no address, see aot_bind.
+    static std::string aot_address(aot_context& ctx, decoded_operand const& op)
+    {
+        std::ostringstream ss;
+        switch (op.kind)
+        {
+            case OPK_REG:
+                ss << "&" << aot_register(op.reg);
+                break;
+                
+            case OPK_IMM:
+                ss << "&" << aot_immediate(ctx, op);
+                break;
+                
+            default:
+                ss << "aot_mem(m, sp, ";
+                if (op.kind == OPK_REG_IND)
+                    ss << aot_register(op.reg);
+                else
+                    ss << aot_immediate(ctx, op);
+                    
+                if (op.offset < 0)
+                    ss << " - " << (uint32_t) -(int64_t) op.offset << "u";
+                else if (op.offset > 0)
+                    ss << " + " << op.offset << "u";
+                ss << ")";
+                break;
+        }
+        
+        return ss.str();
+    }
+    
+    //! Resolve an operand, like resolve_operand does, declaring a pointer
+    //!   named after the operand.
+    //! Returns the operand's value (as an expression of the generated code),
+    //!   which must only be used after the instruction's other operands
+    //!   were resolved.
+    static std::string aot_bind(aot_context& ctx, std::ostream& os, char const* name, decoded_operand const& op)
+    {
+        if (op.kind == OPK_IMM)
+            return aot_immediate(ctx, op);
+            
+        os << "            uint32_t* " << name << " = " << aot_address(ctx, op) << ";\n";
+        return std::string("*") + name;
+    }
+    
+    //! Write SP back to the core.
+    //! The generated code keeps SP in a local variable, that must be written
+    //!   back before leaving the function or calling out of it (and reloaded
+    //!   after such calls, see aot_reload).
+    static void aot_sync(std::ostream& os, char const* indent)
+    {
+        os << indent << "r[REG_CODE_SP] = sp;\n";
+    }
+    
+    //! Reload SP from the core.
+    static void aot_reload(std::ostream& os, char const* indent)
+    {
+        os << indent << "sp = r[REG_CODE_SP];\n";
+    }
+    
+    //! Leave the function, with the given exit code.
+    static void aot_leave(std::ostream& os, char const* indent, char const* code)
+    {
+        aot_sync(os, indent);
+        os << indent << "return " << code << ";\n";
+    }
+    
+    //! Go on at a constant PC.
+    static void aot_goto(aot_context& ctx, std::ostream& os, char const* indent, uint32_t pc)
+    {
+        if (pc < ctx.seg->size)
+            os << indent << "goto L" << pc << ";\n";
+        else
+        {
+            os << indent << "r[REG_CODE_PC] = " << pc << ";\n";
+            aot_leave(os, indent, "AOT_EXIT");
+        }
+    }
+    
+    //! Go on at the PC value in the PC register, through the dispatch switch.
+    static void aot_dispatch(aot_context& ctx, std::ostream& os, char const* indent)
+    {
+        os << indent << "goto dispatch;\n";
+        ctx.dispatch = true;
+    }
+    
+    //! Go on after an instruction that may have changed PC, SEG or PSR
+    //!   (like the interpreter's JUMP).
+    //! This is only used right after calling out of the function, so SP
+    //!   needs no write back.
+    //! Returns true if the flow goes on in sequence.
+    static bool aot_jump(aot_context& ctx, std::ostream& os, decoded_instruction const& ins)
+    {
+        os << "        if (r[REG_CODE_SEG] != " << ctx.fn->seg << " || r[REG_CODE_PSR] & PSR_FLAG_STOP)\n";
+        os << "            return AOT_EXIT;\n";
+        os << "        if (r[REG_CODE_PC] != " << ins.next << ")\n";
+        aot_dispatch(ctx, os, "            ");
+        return true;
+    }
+    
+    //! Leave the instruction at pc to the interpreter.
+    static void aot_step(std::ostream& os, uint32_t pc)
+    {
+        os << "        r[REG_CODE_PC] = " << pc << ";\n";
+        aot_sync(os, "        ");
+        os << "        core_step(vco);\n";
+        aot_reload(os, "        ");
+    }
+    
+    //! Translate a CALL.
+    static bool aot_call(aot_context& ctx, std::ostream& os, decoded_instruction const& ins)
+    {
+        os << "        {\n";
+        std::string a = aot_bind(ctx, os, "a", ins.a);
+        std::string b = ins.b.kind != OPK_NONE ? aot_bind(ctx, os, "b", ins.b) : "";
+        os << "            uint32_t args_base = sp - 1;\n";
+        
+        // Only save the registers the callee may write to, see the calling
+        //   convention in vm_handlers.inc
+        uint32_t skips = ~ins.saves & SAVE_ALL;
+        if (!skips)
+        {
+            os << "            for (int i = (int) REG_CODE_R0; i <= (int) REG_CODE_R9; ++i)\n";
+            os << "                aot_push(m, sp, r[i]);\n";
+        }
+        else
+        {
+            for (uint32_t i = REG_CODE_R0; i <= REG_CODE_R9; ++i)
+            {
+                if (skips & 1 << (i - REG_CODE_R0))
+                    os << "            aot_reserve(m, sp);\n";
+                else
+                    os << "            aot_push(m, sp, r[REG_CODE_R" << i - REG_CODE_R0 << "]);\n";
+            }
+        }
+        os << "            aot_push(m, sp, r[REG_CODE_AB]);\n";
+        os << "            aot_push(m, sp, (r[REG_CODE_PSR] & ~PSR_FRAME) | " << skips << "u << PSR_FRAME_SHIFT);\n";
+        os << "            aot_push(m, sp, r[REG_CODE_PC]);\n";
+        os << "            aot_push(m, sp, r[REG_CODE_SEG]);\n";
+        os << "            r[REG_CODE_AB] = args_base;\n";
+        if (ins.b.kind != OPK_NONE)
+        {
+            os << "            if (" << a << " >= vco.segments_size)\n";
+            os << "                aot_error(m, sp, \"vm::execute_flow: invalid segment address in long CALL\");\n";
+            os << "            r[REG_CODE_SEG] = " << a << ";\n";
+            os << "            r[REG_CODE_PC] = " << b << ";\n";
+        }
+        else
+            os << "            r[REG_CODE_PC] = " << a << ";\n";
+        os << "        }\n";
+        
+        uint32_t target_seg, target;
+        if (!aot_call_target(*ctx.at, ctx.fn->seg, ins, target_seg, target))
+        {
+            if (ins.b.kind != OPK_NONE)
+                aot_leave(os, "        ", "AOT_EXIT");
+            else
+                aot_dispatch(ctx, os, "        ");
+            return false;
+        }
+        
+        // Constant call : run the callee natively, and go on if it
+        //   returned where we expect it to
+        aot_function const& callee = ctx.at->functions[ctx.at->entries[target_seg][target]];
+        aot_sync(os, "        ");
+        os << "        if (depth >= aot_max_depth || " << aot_function_name(callee) << "(vco, depth + 1) == AOT_EXIT)\n";
+        os << "            return AOT_EXIT;\n";
+        aot_reload(os, "        ");
+        ctx.depth = true;
+        return aot_jump(ctx, os, ins);
+    }
+    
+    //! Translate a conditional jump.
+    static bool aot_jump_if(aot_context& ctx, std::ostream& os, decoded_instruction const& ins, uint32_t icode)
+    {
+        char const* condition;
+        switch (icode)
+        {
+            case I_CODE_JZ:
+            case I_CODE_JE:  condition = "psr & PSR_FLAG_Z"; break;
+            case I_CODE_JNZ:
+            case I_CODE_JNE: condition = "!(psr & PSR_FLAG_Z)"; break;
+            case I_CODE_JL:  condition = "psr & PSR_FLAG_N"; break;
+            case I_CODE_JLE: condition = "psr & PSR_FLAG_N || psr & PSR_FLAG_Z"; break;
+            case I_CODE_JG:  condition = "!(psr & PSR_FLAG_N)"; break;
+            default:         condition = "!(psr & PSR_FLAG_N) || psr & PSR_FLAG_Z"; break;
+        }
+        
+        os << "        {\n";
+        std::string a = aot_bind(ctx, os, "a", ins.a);
+        os << "            uint32_t psr = r[REG_CODE_PSR];\n";
+        os << "            r[REG_CODE_PSR] = psr & PSR_FLAG_CLR;\n";
+        os << "            if (" << condition << ")\n";
+        os << "            {\n";
+        if (aot_is_constant(*ctx.at, ctx.fn->seg, ins.a))
+            aot_goto(ctx, os, "                ", *ins.a.imm);
+        else
+        {
+            os << "                r[REG_CODE_PC] = " << a << ";\n";
+            aot_dispatch(ctx, os, "                ");
+        }
+        os << "            }\n";
+        os << "        }\n";
+        return true;
+    }
+    
+    //! Translate an arithmetic operation, or a comparison.
+    static bool aot_arith(std::ostream& os, uint32_t icode)
+    {
+        char const* field = "u";
+        if (icode == I_CODE_IADD || icode == I_CODE_ISUB || icode == I_CODE_IMUL ||
+            icode == I_CODE_IDIV || icode == I_CODE_ICMP)
+            field = "i";
+        else if (icode == I_CODE_FADD || icode == I_CODE_FSUB || icode == I_CODE_FMUL ||
+                 icode == I_CODE_FDIV || icode == I_CODE_FCMP)
+            field = "f";
+            
+        char const* op;
+        switch (icode)
+        {
+            case I_CODE_UADD: case I_CODE_IADD: case I_CODE_FADD: op = "+"; break;
+            case I_CODE_USUB: case I_CODE_ISUB: case I_CODE_FSUB: op = "-"; break;
+            case I_CODE_UMUL: case I_CODE_IMUL: case I_CODE_FMUL: op = "*"; break;
+            case I_CODE_UDIV: case I_CODE_IDIV: case I_CODE_FDIV: op = "/"; break;
+            case I_CODE_UAND: op = "&"; break;
+            case I_CODE_UOR:  op = "|"; break;
+            case I_CODE_UXOR: op = "^"; break;
+            default:          op = 0; break;
+        }
+        
+        os << "        {\n";
+        os << "            aot_word lhs, rhs;\n";
+        os << "            rhs.u = aot_pop(m, sp);\n";
+        os << "            lhs.u = aot_pop(m, sp);\n";
+        if (op)
+        {
+            os << "            aot_word ret;\n";
+            os << "            ret." << field << " = lhs." << field << " " << op << " rhs." << field << ";\n";
+            os << "            aot_push(m, sp, ret.u);\n";
+        }
+        else
+        {
+            os << "            if (lhs." << field << " < rhs." << field << ")\n";
+            os << "                r[REG_CODE_PSR] |= PSR_FLAG_N;\n";
+            os << "            if (lhs." << field << " == rhs." << field << ")\n";
+            os << "                r[REG_CODE_PSR] |= PSR_FLAG_Z;\n";
+        }
+        os << "        }\n";
+        return true;
+    }
+    
+    //! Translate the instruction at pc.
+    //! The semantics are the same as in vm_handlers.inc.
+    //! Returns true if the flow may go on in sequence.
+    static bool aot_translate(aot_context& ctx, std::ostream& os, uint32_t pc)
+    {
+        decoded_instruction const& ins = ctx.at->code[ctx.fn->seg][pc];
+        uint32_t icode = decoder_icode(ins);
+        
+        if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+        {
+            aot_step(os, pc);
+            aot_leave(os, "        ", "AOT_EXIT");
+            return false;
+        }
+        
+        os << "        r[REG_CODE_IR] = " << aot_literal(ins.instr) << ";\n";
+        os << "        r[REG_CODE_PC] = " << ins.next << ";\n";
+        
+        if (aot_is_jump_if(icode))
+            return aot_jump_if(ctx, os, ins, icode);
+            
+        switch (icode)
+        {
+            case I_CODE_HALT:
+                os << "        r[REG_CODE_PSR] |= PSR_FLAG_HALT;\n";
+                aot_leave(os, "        ", "AOT_EXIT");
+                return false;
+                
+            case I_CODE_RST:
+                aot_sync(os, "        ");
+                os << "        core_reset(vco);\n";
+                os << "        return AOT_EXIT;\n";
+                return false;
+                
+            case I_CODE_DMS:
+                aot_sync(os, "        ");
+                os << "        core_stack_dump(vco);\n";
+                return true;
+                
+            case I_CODE_DMR:
+                aot_sync(os, "        ");
+                os << "        core_register_dump(vco);\n";
+                return true;
+                
+            case I_CODE_PUSH:
+            {
+                os << "        {\n";
+                std::string a = aot_bind(ctx, os, "a", ins.a);
+                os << "            aot_push(m, sp, " << a << ");\n";
+                os << "        }\n";
+                return true;
+            }
+            
+            case I_CODE_POP:
+            case I_CODE_MOV:
+                if (ins.a.kind == OPK_NONE)
+                {
+                    os << "        aot_pop(m, sp);\n";
+                    return true;
+                }
+                
+                os << "        {\n";
+                os << "            uint32_t* a = " << aot_address(ctx, ins.a) << ";\n";
+                if (icode == I_CODE_POP)
+                    os << "            *a = aot_pop(m, sp);\n";
+                else
+                {
+                    std::string b = aot_bind(ctx, os, "b", ins.b);
+                    os << "            *a = " << b << ";\n";
+                }
+                os << "        }\n";
+                
+                // Writing to a register may change the program flow
+                if (ins.a.kind == OPK_REG && ins.a.reg == REG_CODE_PC)
+                {
+                    aot_dispatch(ctx, os, "        ");
+                    return false;
+                }
+                if (ins.a.kind == OPK_REG && (ins.a.reg == REG_CODE_SEG || ins.a.reg == REG_CODE_PSR))
+                {
+                    aot_leave(os, "        ", "AOT_EXIT");
+                    return false;
+                }
+                return true;
+                
+            case I_CODE_DUP:
+                os << "        {\n";
+                os << "            uint32_t top = aot_pop(m, sp);\n";
+                os << "            aot_push(m, sp, top);\n";
+                os << "            aot_push(m, sp, top);\n";
+                os << "        }\n";
+                return true;
+                
+            case I_CODE_LOAD:
+                os << "        {\n";
+                os << "            uint32_t addr = aot_pop(m, sp);\n";
+                os << "            aot_push(m, sp, *aot_mem(m, sp, addr));\n";
+                os << "        }\n";
+                return true;
+                
+            case I_CODE_STOR:
+                os << "        {\n";
+                os << "            uint32_t addr = aot_pop(m, sp);\n";
+                os << "            uint32_t* p = aot_mem(m, sp, addr);\n";
+                os << "            *p = aot_pop(m, sp);\n";
+                os << "        }\n";
+                return true;
+                
+            case I_CODE_CST:
+            {
+                os << "        {\n";
+                std::string a = ins.a.kind != OPK_NONE ? aot_bind(ctx, os, "a", ins.a) : "aot_pop(m, sp)";
+                std::string b = ins.b.kind != OPK_NONE ? aot_bind(ctx, os, "b", ins.b) : "r[REG_CODE_SEG]";
+                os << "            uint32_t addr = " << a << ";\n";
+                os << "            uint32_t seg = " << b << ";\n";
+                os << "            if (seg >= vco.segments_size)\n";
+                os << "                aot_error(m, sp, \"vm::execute_mem: bad segment in CST\");\n";
+                os << "            if (addr >= vco.segments[seg]->size)\n";
+                os << "                aot_error(m, sp, \"vm::execute_mem: bad program address in CST\");\n";
+                os << "            aot_push(m, sp, vco.segments[seg]->buffer[addr]);\n";
+                os << "        }\n";
+                return true;
+            }
+            
+            case I_CODE_CALL:
+                return aot_call(ctx, os, ins);
+                
+            case I_CODE_DIVE:
+            {
+                os << "        {\n";
+                std::string a = aot_bind(ctx, os, "a", ins.a);
+                
+                // The hatch table is checked against the translated one (see aot_check),
+                //   so constant hatch addresses are checked right now
+                if (!aot_is_constant(*ctx.at, ctx.fn->seg, ins.a))
+                    os << "            if (" << a << " >= vco.hatches_size)\n";
+                if (!aot_is_constant(*ctx.at, ctx.fn->seg, ins.a) || *ins.a.imm >= ctx.at->vco->hatches_size)
+                    os << "                aot_error(m, sp, \"vm::execute_flow: invalid hatch address in DIVE\");\n";
+                aot_sync(os, "            ");
+                os << "            vco.hatch_entries[" << a << "](vco);\n";
+                aot_reload(os, "            ");
+                os << "        }\n";
+                return aot_jump(ctx, os, ins);
+            }
+            
+            case I_CODE_RET:
+                os << "        {\n";
+                os << "            r[REG_CODE_SEG] = aot_pop(m, sp);\n";
+                os << "            r[REG_CODE_PC] = aot_pop(m, sp);\n";
+                os << "            uint32_t psr = aot_pop(m, sp);\n";
+                os << "            r[REG_CODE_PSR] = psr & ~PSR_FRAME;\n";
+                os << "            r[REG_CODE_AB] = aot_pop(m, sp);\n";
+                os << "            for (int i = (int) REG_CODE_R9; i >= (int) REG_CODE_R0; --i)\n";
+                os << "            {\n";
+                os << "                uint32_t value = aot_pop(m, sp);\n";
+                os << "                if (!(psr & 1 << (i - REG_CODE_R0 + PSR_FRAME_SHIFT)))\n";
+                os << "                    r[i] = value;\n";
+                os << "            }\n";
+                os << "        }\n";
+                aot_leave(os, "        ", "AOT_RETURN");
+                return false;
+                
+            case I_CODE_JMP:
+                if (aot_is_constant(*ctx.at, ctx.fn->seg, ins.a))
+                {
+                    aot_goto(ctx, os, "        ", *ins.a.imm);
+                    return false;
+                }
+                
+                {
+                    os << "        {\n";
+                    std::string a = aot_bind(ctx, os, "a", ins.a);
+                    os << "            r[REG_CODE_PC] = " << a << ";\n";
+                    os << "        }\n";
+                    aot_dispatch(ctx, os, "        ");
+                    return false;
+                }
+                
+            case I_CODE_UCMP:
+            case I_CODE_ICMP:
+            case I_CODE_FCMP:
+                return aot_arith(os, icode);
+                
+            default:
+                if (((icode & I_GROUP_MASK) >> I_GROUP_SHIFT) == I_GROUP_ARITH)
+                    return aot_arith(os, icode);
+                    
+                // DMO, the bulk MEM instructions and VEC
+                aot_step(os, pc);
+                return true;
+        }
+    }
+    
+    //! Write a function of the generated code.
+    //! The body is translated first, as the function's prologue depends on it.
+    static void aot_emit_function(aot_translator const& at, aot_function const& fn, std::ostream& os)
+    {
+        aot_context ctx;
+        ctx.at = &at;
+        ctx.fn = &fn;
+        ctx.seg = at.vco->segments[fn.seg];
+        ctx.dispatch = false;
+        ctx.depth = false;
+        ctx.imm = false;
+        
+        std::vector<uint32_t> labels;
+        for (uint32_t pc = 0; pc < ctx.seg->size; ++pc)
+        {
+            if (fn.body[pc])
+                labels.push_back(pc);
+        }
+        
+        std::ostringstream body;
+        for (size_t i = 0; i < labels.size(); ++i)
+        {
+            uint32_t pc = labels[i];
+            body << "    L" << pc << ":\n";
+            
+            if (!aot_translate(ctx, body, pc))
+                continue;
+                
+            // Go on in sequence, unless the next instruction follows
+            uint32_t next = at.code[fn.seg][pc].next;
+            if (i + 1 == labels.size() || labels[i + 1] != next)
+                aot_goto(ctx, body, "        ", next);
+        }
+        
+        os << "    int " << aot_function_name(fn) << "(core& vco, uint32_t" << (ctx.depth ? " depth" : "") << ")\n";
+        os << "    {\n";
+        // Functions that only call out to the interpreter or the host
+        //   never touch the memory themselves
+        std::string code = body.str();
+        os << "        uint32_t* r = vco.registers;\n";
+        if (code.find("(m, ") != std::string::npos)
+            os << "        aot_memory m = aot_memory_of(vco);\n";
+        os << "        uint32_t sp = r[REG_CODE_SP];\n";
+        if (ctx.imm)
+            os << "        uint32_t* imm = vco.segments[" << fn.seg << "]->buffer;\n";
+        os << "        \n";
+        if (ctx.dispatch)
+            os << "    dispatch:\n";
+        os << "        switch (r[REG_CODE_PC])\n";
+        os << "        {\n";
+        for (size_t i = 0; i < labels.size(); ++i)
+            os << "            case " << labels[i] << ": goto L" << labels[i] << ";\n";
+        os << "            default:\n";
+        aot_leave(os, "                ", "AOT_EXIT");
+        os << "        }\n";
+        os << "        \n";
+        os << code;
+        os << "    }\n";
+        os << "    \n";
+    }
+    
+    //! Hash a segment's program memory (32-bit FNV-1a over its words).
+    static uint32_t aot_hash(segment const& seg)
+    {
+        uint32_t hash = 2166136261u;
+        for (uint32_t i = 0; i < seg.size; ++i)
+        {
+            hash ^= seg.buffer[i];
+            hash *= 16777619u;
+        }
+        
+        return hash;
+    }
+    
+    //! Write the generated code's support functions, that mirror the ones
+    //!   of vm_core.cpp.
+    static void aot_emit_prologue(std::ostream& os)
+    {
+        os << "// This file was generated by bolt --emit-c, do not edit.\n";
+        os << "// See vm_aot.h for how to build and run it.\n";
+        os << "\n";
+        os << "#include \"bolt/vm_core.h\"\n";
+        os << "#include <stdexcept>\n";
+        os << "\n";
+        os << "namespace\n";
+        os << "{\n";
+        os << "    using namespace bolt::vm;\n";
+        os << "    \n";
+        os << "    //! Function exit codes.\n";
+        os << "    //!\n";
+        os << "    //! RETURN: the function ran a RET instruction\n";
+        os << "    //! EXIT:   go on at PC from the driver loop\n";
+        os << "    enum : int\n";
+        os << "    {\n";
+        os << "        AOT_RETURN,\n";
+        os << "        AOT_EXIT\n";
+        os << "    };\n";
+        os << "    \n";
+        os << "    //! Native calls deeper than this go through the driver loop.\n";
+        os << "    uint32_t const aot_max_depth = 1024;\n";
+        os << "    \n";
+        os << "    union aot_word\n";
+        os << "    {\n";
+        os << "        uint32_t u;\n";
+        os << "        int32_t i;\n";
+        os << "        float f;\n";
+        os << "    };\n";
+        os << "    \n";
+        os << "    typedef int(*aot_function)(core& vco, uint32_t depth);\n";
+        os << "    \n";
+        os << "    struct aot_segment\n";
+        os << "    {\n";
+        os << "        uint32_t size;\n";
+        os << "        bool checked;\n";
+        os << "        uint32_t hash;\n";
+        os << "        aot_function const* table;\n";
+        os << "    };\n";
+        os << "    \n";
+        os << "    //! A copy of the core's memory layout, kept in a local variable so that\n";
+        os << "    //!   stores to the stack don't force the compiler to reload it\n";
+        os << "    //!   (hatches must not move the core's stack).\n";
+        os << "    struct aot_memory\n";
+        os << "    {\n";
+        os << "        uint32_t* registers;\n";
+        os << "        uint32_t* stack;\n";
+        os << "        uint32_t stack_size;\n";
+        os << "        uint32_t size;\n";
+        os << "    };\n";
+        os << "    \n";
+        os << "    inline aot_memory aot_memory_of(core& vco)\n";
+        os << "    {\n";
+        os << "        aot_memory m = { vco.registers, vco.stack, vco.stack_size, vco.stack_size + vco.heap_size };\n";
+        os << "        return m;\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    //! Faults write SP back to the core before throwing, as the\n";
+        os << "    //!   generated code keeps it in a local variable.\n";
+        os << "    #ifdef __GNUC__\n";
+        os << "    __attribute__((noinline, noreturn, cold))\n";
+        os << "    #endif\n";
+        os << "    inline void aot_fault(aot_memory const& m, uint32_t sp, char const* what)\n";
+        os << "    {\n";
+        os << "        m.registers[REG_CODE_SP] = sp;\n";
+        os << "        throw std::runtime_error(what);\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    #ifdef __GNUC__\n";
+        os << "    __attribute__((noinline, noreturn, cold))\n";
+        os << "    #endif\n";
+        os << "    inline void aot_error(aot_memory const& m, uint32_t sp, char const* what)\n";
+        os << "    {\n";
+        os << "        m.registers[REG_CODE_SP] = sp;\n";
+        os << "        throw std::logic_error(what);\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    inline uint32_t* aot_mem(aot_memory const& m, uint32_t sp, uint32_t addr)\n";
+        os << "    {\n";
+        os << "        if (addr > m.size)\n";
+        os << "            aot_fault(m, sp, \"vm::mem_access: address out of bounds\");\n";
+        os << "        \n";
+        os << "        return m.stack + addr;\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    inline void aot_push(aot_memory const& m, uint32_t& sp, uint32_t value)\n";
+        os << "    {\n";
+        os << "        if (sp >= m.stack_size)\n";
+        os << "            aot_fault(m, sp, \"vm::stack_push: stack overflow :(\");\n";
+        os << "        \n";
+        os << "        m.stack[sp++] = value;\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    inline void aot_reserve(aot_memory const& m, uint32_t& sp)\n";
+        os << "    {\n";
+        os << "        if (sp >= m.stack_size)\n";
+        os << "            aot_fault(m, sp, \"vm::stack_push: stack overflow :(\");\n";
+        os << "        \n";
+        os << "        ++sp;\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    inline uint32_t aot_pop(aot_memory const& m, uint32_t& sp)\n";
+        os << "    {\n";
+        os << "        if (sp == 0)\n";
+        os << "            aot_fault(m, sp, \"vm::stack_pop: stack underflow :(\");\n";
+        os << "        \n";
+        os << "        return m.stack[--sp];\n";
+        os << "    }\n";
+        os << "    \n";
+    }
+    
+    //! Write the dispatch tables, the image check and the driver loop.
+    static void aot_emit_epilogue(aot_translator const& at, std::ostream& os)
+    {
+        core const& vco = *at.vco;
+        
+        // Each location maps to the function starting there, or else to
+        //   the first function that holds it
+        for (uint32_t s = 0; s < vco.segments_size; ++s)
+        {
+            uint32_t size = vco.segments[s]->size;
+            os << "    aot_function const seg" << s << "_table[" << size + 1 << "] =\n";
+            os << "    {\n";
+            for (uint32_t pc = 0; pc < size; ++pc)
+            {
+                int64_t index = at.entries[s][pc];
+                for (size_t i = 0; index < 0 && i < at.functions.size(); ++i)
+                {
+                    if (at.functions[i].seg == s && at.functions[i].body[pc])
+                        index = i;
+                }
+                
+                os << "        " << (index >= 0 ? aot_function_name(at.functions[index]) : "0") << ",\n";
+            }
+            os << "        0\n";
+            os << "    };\n";
+            os << "    \n";
+        }
+        
+        os << "    uint32_t const aot_segments_size = " << vco.segments_size << ";\n";
+        os << "    aot_segment const aot_segments[" << vco.segments_size + 1 << "] =\n";
+        os << "    {\n";
+        for (uint32_t s = 0; s < vco.segments_size; ++s)
+        {
+            os << "        { " << vco.segments[s]->size << ", " << (at.self_modifying[s] ? "false" : "true") << ", "
+               << aot_literal(aot_hash(*vco.segments[s])) << ", seg" << s << "_table },\n";
+        }
+        os << "        { 0, false, 0, 0 }\n";
+        os << "    };\n";
+        os << "    \n";
+        
+        os << "    uint32_t const aot_hatches_size = " << vco.hatches_size << ";\n";
+        os << "    char const* const aot_hatches[" << vco.hatches_size + 1 << "] =\n";
+        os << "    {\n";
+        for (uint32_t h = 0; h < vco.hatches_size; ++h)
+            os << "        \"" << vco.hatches[h]->name << "\",\n";
+        os << "        0\n";
+        os << "    };\n";
+        os << "    \n";
+        
+        os << "    //! Check that a core was linked from the same modules as the translated one.\n";
+        os << "    //! Self-modifying segments can't be hashed, only their size is checked.\n";
+        os << "    void aot_check(core const& vco)\n";
+        os << "    {\n";
+        os << "        bool ok = vco.segments_size == aot_segments_size && vco.hatches_size == aot_hatches_size;\n";
+        os << "        \n";
+        os << "        for (uint32_t s = 0; ok && s < aot_segments_size; ++s)\n";
+        os << "        {\n";
+        os << "            segment const* seg = vco.segments[s];\n";
+        os << "            ok = seg->size == aot_segments[s].size;\n";
+        os << "            \n";
+        os << "            uint32_t hash = 2166136261u;\n";
+        os << "            for (uint32_t i = 0; ok && aot_segments[s].checked && i < seg->size; ++i)\n";
+        os << "            {\n";
+        os << "                hash ^= seg->buffer[i];\n";
+        os << "                hash *= 16777619u;\n";
+        os << "            }\n";
+        os << "            if (ok && aot_segments[s].checked)\n";
+        os << "                ok = hash == aot_segments[s].hash;\n";
+        os << "        }\n";
+        os << "        \n";
+        os << "        for (uint32_t h = 0; ok && h < aot_hatches_size; ++h)\n";
+        os << "            ok = vco.hatches[h]->name == aot_hatches[h];\n";
+        os << "            \n";
+        os << "        if (!ok)\n";
+        os << "            throw std::logic_error(\"vm::aot_run: the core does not match the translated program\");\n";
+        os << "    }\n";
+        os << "}\n";
+        os << "\n";
+        
+        os << "extern \"C\" void bolt_aot_run(bolt::vm::core& vco)\n";
+        os << "{\n";
+        os << "    aot_check(vco);\n";
+        os << "    core_bind_hatches(vco);\n";
+        os << "    \n";
+        os << "    for (;;)\n";
+        os << "    {\n";
+        os << "        uint32_t s = vco.registers[REG_CODE_SEG];\n";
+        os << "        if (vco.registers[REG_CODE_PC] >= vco.segments[s]->size ||\n";
+        os << "            vco.registers[REG_CODE_PSR] & PSR_FLAG_STOP)\n";
+        os << "            break;\n";
+        os << "            \n";
+        os << "        // Run the generated code if possible, falling back to the interpreter\n";
+        os << "        aot_function function = aot_segments[s].table[vco.registers[REG_CODE_PC]];\n";
+        os << "        if (function)\n";
+        os << "            function(vco, 0);\n";
+        os << "        else\n";
+        os << "            core_step(vco);\n";
+        os << "    }\n";
+        os << "    \n";
+        os << "    if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT))\n";
+        os << "        vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;\n";
+        os << "}\n";
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    void aot_emit(core const& vco, std::ostream& os)
+    {
+        aot_translator at;
+        at.vco = &vco;
+        at.entries.resize(vco.segments_size);
+        
+        for (uint32_t s = 0; s < vco.segments_size; ++s)
+        {
+            segment const& seg = *vco.segments[s];
+            at.decoded.push_back(!seg.code);
+            at.code.push_back(seg.code ? seg.code : decoder_decode(seg));
+            
+            // The segment itself may not be decoded, so look at our stream
+            segment view = seg;
+            view.code = at.code[s];
+            at.self_modifying.push_back(decoder_is_self_modifying(view));
+            at.entries[s].assign(seg.size, -1);
+        }
+        
+        // Walk the program from the entry points, and then from
+        //   the call targets as they are found
+        // The generated code would not see the changes of a self-modifying
+        //   segment's code, so those run entirely in the interpreter
+        for (uint32_t s = 0; s < vco.segments_size; ++s)
+        {
+            if (at.self_modifying[s])
+                continue;
+                
+            if (vco.segments[s]->size)
+                aot_function_at(at, s, 0);
+            if (vco.segments[s]->entry < vco.segments[s]->size)
+                aot_function_at(at, s, vco.segments[s]->entry);
+        }
+        
+        while (at.pending.size())
+        {
+            size_t index = at.pending.back();
+            at.pending.pop_back();
+            aot_walk(at, index);
+        }
+        
+        aot_emit_prologue(os);
+        
+        for (size_t i = 0; i < at.functions.size(); ++i)
+            os << "    int " << aot_function_name(at.functions[i]) << "(core& vco, uint32_t depth);\n";
+        os << "    \n";
+        
+        for (size_t i = 0; i < at.functions.size(); ++i)
+            aot_emit_function(at, at.functions[i], os);
+            
+        aot_emit_epilogue(at, os);
+        
+        for (uint32_t s = 0; s < vco.segments_size; ++s)
+        {
+            if (at.decoded[s])
+                decoder_free(at.code[s]);
+        }
+    }
+} }
@@ -0,0 +1,821 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bolt/vm_batch.h"
+#include "bolt/vm_bytes.h"
+#include "bolt/vm_decoder.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace bolt { namespace vm
+{
+    //! A word of each lane, and its signed and float views (casting between
+    //!   them keeps the bits).
+    //! They are only aligned as words, so that the stack can be a plain array.
+    typedef uint32_t lanes __attribute__((vector_size(4 * BATCH_LANES), aligned(4)));
+    typedef int32_t lanes_int __attribute__((vector_size(4 * BATCH_LANES), aligned(4)));
+    typedef float lanes_float __attribute__((vector_size(4 * BATCH_LANES), aligned(4)));
+    
+    //! A group of lanes that share their flow, with a bit per lane in active.
+    struct batch_group
+    {
+        uint32_t pc;
+        uint32_t seg;
+        uint32_t sp;
+        uint32_t active;
+    };
+    
+    //! The state of a batch.
+    //! The lanes that run in lockstep share PC, SEG and SP (their entries in
+    //!   registers are unused). The active field has a bit per such lane, mask
+    //!   holds the same as a vector (all ones in active lanes), and lead is
+    //!   the first active lane.
+    //! The lanes that went another way at a conditional jump wait in the
+    //!   pending groups (see batch_schedule), the writes of the active lanes
+    //!   being masked so that their registers and stack are left alone.
+    //! The uniform field has a bit per register that holds the same value in
+    //!   all the lanes that are not done, so that it can be used as an address
+    //!   without checking it.
+    //! The lanes that are run apart use the scalar core, which shares the
+    //!   tables of the batch's core.
+    //! The temps hold the values of the operands that are neither in the
+    //!   lanes' registers nor in their stack (immediates, heap words...).
+    struct batch
+    {
+        core* vco;
+        uint32_t* results;
+        
+        uint32_t pc;
+        uint32_t seg;
+        uint32_t sp;
+        lanes registers[REG_COUNT];
+        lanes* stack;
+        uint32_t uniform;
+        
+        uint32_t active;
+        lanes mask;
+        uint32_t lead;
+        
+        uint32_t pending_size;
+        batch_group pending[BATCH_LANES];
+        
+        core scalar;
+        lanes temps[2];
+    };
+    
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Set all the lanes of a vector to the same value.
+    //! Vectors are never passed by value, as their ABI depends on the
+    //!   instruction set the program is compiled for.
+    static inline void batch_splat(lanes& v, uint32_t value)
+    {
+        lanes zero = { };
+        v = zero + value;
+    }
+    
+    //! Write a vector to the active lanes of a register or stack word.
+    static inline void batch_store(batch const& b, lanes& dst, lanes const& value)
+    {
+        dst = (value & b.mask) | (dst & ~b.mask);
+    }
+    
+    //! Set the lanes that run in lockstep.
+    static void batch_activate(batch& b, uint32_t active)
+    {
+        b.active = active;
+        b.lead = active ? __builtin_ctz(active) : 0;
+        for (uint32_t i = 0; i < BATCH_LANES; ++i)
+            b.mask[i] = active >> i & 1 ? 0xFFFFFFFF : 0;
+    }
+    
+    //! Get the active lanes where a condition (all ones or zeros per lane) holds.
+    static inline uint32_t batch_bits(batch const& b, lanes const& cond)
+    {
+        uint32_t bits = 0;
+        for (uint32_t i = 0; i < BATCH_LANES; ++i)
+            bits |= (cond[i] & 1) << i;
+        return bits & b.active;
+    }
+    
+    //! Check if a vector holds the same value in all the active lanes, and get it.
+    static inline bool batch_uniform(batch const& b, lanes const& v, uint32_t& value)
+    {
+        value = v[b.lead];
+        lanes differ = (v ^ value) & b.mask;
+        uint32_t any = 0;
+        for (uint32_t i = 0; i < BATCH_LANES; ++i)
+            any |= differ[i];
+        return !any;
+    }
+    
+    //! Record a write to a register, whose value is the same in all the
+    //!   active lanes if same is true.
+    static inline void batch_written(batch& b, uint32_t reg, bool same)
+    {
+        if (same && !b.pending_size)
+            b.uniform |= 1 << reg;
+        else
+            b.uniform &= ~(1 << reg);
+    }
+    
+    //! Check if an operand's value is known to be the same in all the lanes.
+    static inline bool batch_known(batch const& b, decoded_operand const& op)
+    {
+        if (op.kind == OPK_IMM)
+            return true;
+        if (op.kind != OPK_REG || op.reg >= REG_COUNT)
+            return false;
+            
+        return op.reg == REG_CODE_PC || op.reg == REG_CODE_SEG || op.reg == REG_CODE_SP ||
+               op.reg == REG_CODE_IR || b.uniform >> op.reg & 1;
+    }
+    
+    //! Access the lanes' memory at the given address (see mem_access in
+    //!   vm_core.cpp), given the index of the temp that holds heap words.
+    //! Returns null if the lanes can't access it in lockstep.
+    static inline lanes* batch_memory(batch& b, uint32_t addr, uint32_t temp, bool write)
+    {
+        core const& vco = *b.vco;
+        if (addr < vco.stack_size)
+            return b.stack + addr;
+        if (write || addr >= vco.stack_size + vco.heap_size)
+            return 0;
+            
+        batch_splat(b.temps[temp], vco.stack[addr]);
+        return b.temps + temp;
+    }
+    
+    //! Resolve a decoded operand for all the lanes (see resolve_operand in
+    //!   vm_core.cpp), given the index of the temp it may use.
+    //! Returns null if the lanes can't access it in lockstep, or if there is
+    //!   no operand.
+    __attribute__((always_inline))
+    static inline lanes* batch_operand(batch& b, decoded_instruction const* ins, decoded_operand const& op, uint32_t temp, bool write)
+    {
+        uint32_t base;
+        switch (op.kind)
+        {
+            case OPK_REG:
+                if (op.reg <= REG_CODE_R9 || op.reg == REG_CODE_RV || op.reg == REG_CODE_AB || op.reg == REG_CODE_HB)
+                    return b.registers + op.reg;
+                if (write || op.reg >= REG_COUNT)
+                    return 0;
+                if (op.reg == REG_CODE_PSR)
+                    return b.registers + op.reg;
+                    
+                switch (op.reg)
+                {
+                    case REG_CODE_PC:  base = ins->next; break;
+                    case REG_CODE_SEG: base = b.seg; break;
+                    case REG_CODE_SP:  base = b.sp; break;
+                    default:           base = ins->instr; break;
+                }
+                batch_splat(b.temps[temp], base);
+                return b.temps + temp;
+                
+            case OPK_IMM:
+                if (write)
+                    return 0;
+                    
+                batch_splat(b.temps[temp], *op.imm);
+                return b.temps + temp;
+                
+            case OPK_REG_IND:
+                if (op.reg == REG_CODE_SP)
+                    base = b.sp;
+                else if (op.reg == REG_CODE_PC)
+                    base = ins->next;
+                else if (op.reg == REG_CODE_SEG)
+                    base = b.seg;
+                else if (op.reg == REG_CODE_IR)
+                    base = ins->instr;
+                else if (op.reg >= REG_COUNT)
+                    return 0;
+                else if (b.uniform >> op.reg & 1)
+                    base = b.registers[op.reg][b.lead];
+                else if (!batch_uniform(b, b.registers[op.reg], base))
+                    return 0;
+                    
+                return batch_memory(b, base + op.offset, temp, write);
+                
+            case OPK_IMM_IND:
+                return batch_memory(b, *op.imm + op.offset, temp, write);
+                
+            default:
+                return 0;
+        }
+    }
+    
+    //! Resolve an operand whose value must be the same in all the active
+    //!   lanes (a jump target...), returns false if it isn't.
+    static inline bool batch_scalar(batch& b, decoded_instruction const* ins, decoded_operand const& op, uint32_t& value)
+    {
+        if (op.kind == OPK_IMM)
+        {
+            value = *op.imm;
+            return true;
+        }
+        
+        lanes* v = batch_operand(b, ins, op, 0, false);
+        return v && batch_uniform(b, *v, value);
+    }
+    
+    //! Apply an arithmetic instruction (given by its instruction code) to two
+    //!   operands, in all the lanes (see arith_apply in vm_core.cpp).
+    //! The result is stored in lhs.
+    //! The divisors of the inactive lanes are replaced, as their values may
+    //!   be anything (they are not written back anyway).
+    static inline void batch_apply(batch const& b, uint32_t icode, lanes& lhs, lanes const& rhs)
+    {
+        lanes r = rhs;
+        if (icode == I_CODE_UDIV || icode == I_CODE_IDIV)
+            r = (r & b.mask) | (~b.mask & 1);
+            
+        switch (icode)
+        {
+            case I_CODE_UADD:
+            case I_CODE_IADD: lhs += r; break;
+            case I_CODE_USUB:
+            case I_CODE_ISUB: lhs -= r; break;
+            case I_CODE_UMUL:
+            case I_CODE_IMUL: lhs *= r; break;
+            case I_CODE_UDIV: lhs /= r; break;
+            case I_CODE_IDIV: lhs = (lanes) ((lanes_int) lhs / (lanes_int) r); break;
+            case I_CODE_UAND: lhs &= r; break;
+            case I_CODE_UOR:  lhs |= r; break;
+            case I_CODE_UXOR: lhs ^= r; break;
+            case I_CODE_FADD: lhs = (lanes) ((lanes_float) lhs + (lanes_float) r); break;
+            case I_CODE_FSUB: lhs = (lanes) ((lanes_float) lhs - (lanes_float) r); break;
+            case I_CODE_FMUL: lhs = (lanes) ((lanes_float) lhs * (lanes_float) r); break;
+            case I_CODE_FDIV: lhs = (lanes) ((lanes_float) lhs / (lanes_float) r); break;
+            default:          lhs ^= lhs; break;
+        }
+    }
+    
+    //! Compare two operands with a comparison instruction (given by its
+    //!   instruction code) in all the lanes, returning the PSR flags to set
+    //!   in flags (see arith_compare in vm_core.cpp).
+    static inline void batch_compare(uint32_t icode, lanes const& lhs, lanes const& rhs, lanes& flags)
+    {
+        lanes lt, eq;
+        switch (icode)
+        {
+            case I_CODE_UCMP:
+                lt = (lanes) (lhs < rhs);
+                eq = (lanes) (lhs == rhs);
+                break;
+            case I_CODE_ICMP:
+                lt = (lanes) ((lanes_int) lhs < (lanes_int) rhs);
+                eq = (lanes) (lhs == rhs);
+                break;
+            default:
+                lt = (lanes) ((lanes_float) lhs < (lanes_float) rhs);
+                eq = (lanes) ((lanes_float) lhs == (lanes_float) rhs);
+                break;
+        }
+        
+        flags = (lt & (uint32_t) PSR_FLAG_N) | (eq & (uint32_t) PSR_FLAG_Z);
+    }
+    
+    //! Evaluate the condition of a conditional jump (given by its instruction
+    //!   code) against the PSR of all the lanes (see flow_condition in
+    //!   vm_core.cpp), returning the lanes where it holds.
+    static inline uint32_t batch_condition(batch const& b, uint32_t icode, lanes const& psr)
+    {
+        lanes z = (lanes) ((psr & (uint32_t) PSR_FLAG_Z) != 0);
+        lanes n = (lanes) ((psr & (uint32_t) PSR_FLAG_N) != 0);
+        lanes cond;
+        
+        switch (icode)
+        {
+            case I_CODE_JZ:
+            case I_CODE_JE:  cond = z; break;
+            case I_CODE_JNZ:
+            case I_CODE_JNE: cond = ~z; break;
+            case I_CODE_JL:  cond = n; break;
+            case I_CODE_JLE: cond = n | z; break;
+            case I_CODE_JG:  cond = ~n; break;
+            default:         cond = ~n | z; break;
+        }
+        
+        return batch_bits(b, cond);
+    }
+    
+    //! Store the results of the active lanes, that are done.
+    static void batch_finish(batch& b)
+    {
+        for (uint32_t i = 0; i < BATCH_LANES; ++i)
+        {
+            if (b.active >> i & 1)
+                b.results[i] = b.registers[REG_CODE_RV][i];
+        }
+        
+        batch_activate(b, 0);
+    }
+    
+    //! Run the given lanes apart until they are done, from the given PC (the
+    //!   rest of their state being in the batch), storing their results.
+    //! Each of them gets the batch's core heap, which the lanes never write to.
+    static void batch_apart(batch& b, uint32_t apart, uint32_t pc)
+    {
+        core const& vco = *b.vco;
+        core& scalar = b.scalar;
+        
+        for (uint32_t i = 0; i < BATCH_LANES; ++i)
+        {
+            if (!(apart >> i & 1))
+                continue;
+                
+            for (uint32_t r = 0; r < REG_COUNT; ++r)
+                scalar.registers[r] = b.registers[r][i];
+            scalar.registers[REG_CODE_PC] = pc;
+            scalar.registers[REG_CODE_SEG] = b.seg;
+            scalar.registers[REG_CODE_SP] = b.sp;
+            
+            for (uint32_t addr = 0; addr < b.sp; ++addr)
+                scalar.stack[addr] = b.stack[addr][i];
+            std::copy_n(vco.stack + vco.stack_size, vco.heap_size, scalar.stack + scalar.stack_size);
+            
+            core_run(scalar);
+            if (scalar.registers[REG_CODE_PSR] & PSR_FLAG_WAIT)
+                throw std::logic_error("vm::batch_call: a hatch suspended a call");
+            b.results[i] = scalar.registers[REG_CODE_RV];
+        }
+        
+        batch_activate(b, b.active & ~apart);
+    }
+    
+    //! Check if a group of lanes must run before another one : the deepest
+    //!   in the stack first, then the one at the lowest address, so that the
+    //!   lanes that lag behind catch up with the others where the flows join.
+    static inline bool batch_before(batch_group const& g, batch_group const& other)
+    {
+        if (g.sp != other.sp)
+            return g.sp > other.sp;
+        if (g.seg != other.seg)
+            return g.seg < other.seg;
+        return g.pc < other.pc;
+    }
+    
+    //! Check if a group of lanes is at the same place as another one.
+    static inline bool batch_joins(batch_group const& g, batch_group const& other)
+    {
+        return g.sp == other.sp && g.seg == other.seg && g.pc == other.pc;
+    }
+    
+    //! Check if the lanes that run in lockstep must give way to a pending group.
+    static inline bool batch_yields(batch const& b)
+    {
+        batch_group running = { b.pc, b.seg, b.sp, b.active };
+        for (uint32_t i = 0; i < b.pending_size; ++i)
+        {
+            if (!batch_before(running, b.pending[i]))
+                return true;
+        }
+        
+        return false;
+    }
+    
+    //! Pick the lanes that run in lockstep, among the running and the pending
+    //!   groups (see batch_before), merging the groups at the same place.
+    //! A single lane is run apart, as lockstep would not help.
+    static void batch_schedule(batch& b)
+    {
+        for (;;)
+        {
+            if (b.active)
+            {
+                batch_group& running = b.pending[b.pending_size++];
+                running.pc = b.pc;
+                running.seg = b.seg;
+                running.sp = b.sp;
+                running.active = b.active;
+            }
+            if (!b.pending_size)
+                return;
+                
+            uint32_t first = 0;
+            for (uint32_t i = 1; i < b.pending_size; ++i)
+            {
+                if (batch_before(b.pending[i], b.pending[first]))
+                    first = i;
+            }
+            batch_group g = b.pending[first];
+            b.pending[first] = b.pending[--b.pending_size];
+            
+            for (uint32_t i = 0; i < b.pending_size;)
+            {
+                if (batch_joins(b.pending[i], g))
+                {
+                    g.active |= b.pending[i].active;
+                    b.pending[i] = b.pending[--b.pending_size];
+                }
+                else
+                    ++i;
+            }
+            
+            b.pc = g.pc;
+            b.seg = g.seg;
+            b.sp = g.sp;
+            batch_activate(b, g.active);
+            if (__builtin_popcount(g.active) >= 3)
+                return;
+                
+            batch_apart(b, g.active, g.pc);
+        }
+    }
+    
+    //! Run an instruction in lockstep.
+    //! Returns false if the lanes can't run it in lockstep, in which case
+    //!   nothing was changed.
+    static bool batch_step(batch& b, decoded_instruction const* ins)
+    {
+        core const& vco = *b.vco;
+        uint32_t stack_size = vco.stack_size;
+        
+        if (ins->handler == H_CODE_END || ins->handler == H_CODE_BAD || ins->handler == H_CODE_FETCH)
+            return false;
+            
+        uint32_t icode = decoder_icode(*ins);
+        switch (icode)
+        {
+            case I_CODE_HALT:
+                batch_finish(b);
+                return true;
+                
+            case I_CODE_PUSH:
+            {
+                lanes* a = batch_operand(b, ins, ins->a, 0, false);
+                if (!a || b.sp >= stack_size)
+                    return false;
+                    
+                batch_store(b, b.stack[b.sp++], *a);
+                break;
+            }
+            
+            case I_CODE_POP:
+            {
+                // POP's operand is optional
+                lanes* a = batch_operand(b, ins, ins->a, 0, true);
+                if ((!a && ins->a.kind != OPK_NONE) || !b.sp)
+                    return false;
+                    
+                --b.sp;
+                if (a)
+                    batch_store(b, *a, b.stack[b.sp]);
+                if (ins->a.kind == OPK_REG)
+                    batch_written(b, ins->a.reg, false);
+                break;
+            }
+            
+            case I_CODE_DUP:
+                if (!b.sp || b.sp >= stack_size)
+                    return false;
+                    
+                batch_store(b, b.stack[b.sp], b.stack[b.sp - 1]);
+                ++b.sp;
+                break;
+                
+            case I_CODE_MOV:
+            {
+                lanes* a = batch_operand(b, ins, ins->a, 0, true);
+                lanes* src = batch_operand(b, ins, ins->b, 1, false);
+                if (!a || !src)
+                    return false;
+                    
+                batch_store(b, *a, *src);
+                if (ins->a.kind == OPK_REG)
+                    batch_written(b, ins->a.reg, batch_known(b, ins->b));
+                break;
+            }
+            
+            case I_CODE_LOAD:
+            {
+                uint32_t addr;
+                if (!b.sp || !batch_uniform(b, b.stack[b.sp - 1], addr))
+                    return false;
+                lanes* m = batch_memory(b, addr, 0, false);
+                if (!m)
+                    return false;
+                    
+                batch_store(b, b.stack[b.sp - 1], *m);
+                break;
+            }
+            
+            case I_CODE_STOR:
+            {
+                uint32_t addr;
+                if (b.sp < 2 || !batch_uniform(b, b.stack[b.sp - 1], addr))
+                    return false;
+                lanes* m = batch_memory(b, addr, 0, true);
+                if (!m)
+                    return false;
+                    
+                batch_store(b, *m, b.stack[b.sp - 2]);
+                b.sp -= 2;
+                break;
+            }
+            
+            case I_CODE_CALL:
+            {
+                // Two operands, A (segment) and B (offset), for a long call
+                uint32_t seg = b.seg;
+                uint32_t pc;
+                if (!batch_scalar(b, ins, ins->a, pc))
+                    return false;
+                if (ins->b.kind != OPK_NONE)
+                {
+                    seg = pc;
+                    if (!batch_scalar(b, ins, ins->b, pc) || seg >= vco.segments_size)
+                        return false;
+                }
+                if (b.sp > stack_size || stack_size - b.sp < CALL_FRAME_SIZE)
+                    return false;
+                    
+                uint32_t saves = ins->saves;
+                uint32_t frame = b.sp;
+                for (int i = 0; saves; ++i, saves >>= 1)
+                {
+                    if (saves & 1)
+                        batch_store(b, b.stack[frame + i], b.registers[REG_CODE_R0 + i]);
+                }
+                frame += REG_CODE_R9 - REG_CODE_R0 + 1;
+                
+                lanes word = (b.registers[REG_CODE_PSR] & (uint32_t) ~PSR_FRAME) | (~ins->saves & SAVE_ALL) << PSR_FRAME_SHIFT;
+                batch_store(b, b.stack[frame++], b.registers[REG_CODE_AB]);
+                batch_store(b, b.stack[frame++], word);
+                batch_splat(word, ins->next);
+                batch_store(b, b.stack[frame++], word);
+                batch_splat(word, b.seg);
+                batch_store(b, b.stack[frame++], word);
+                
+                batch_splat(word, b.sp - 1);
+                batch_store(b, b.registers[REG_CODE_AB], word);
+                batch_written(b, REG_CODE_AB, true);
+                b.sp = frame;
+                b.seg = seg;
+                b.pc = pc;
+                return true;
+            }
+            
+            case I_CODE_RET:
+            {
+                uint32_t seg, pc, saved;
+                if (b.sp < CALL_FRAME_SIZE)
+                    return false;
+                lanes frame = b.stack[b.sp - 3] & (uint32_t) PSR_FRAME;
+                if (!batch_uniform(b, b.stack[b.sp - 1], seg) || seg >= vco.segments_size ||
+                    !batch_uniform(b, b.stack[b.sp - 2], pc) || !batch_uniform(b, frame, saved))
+                    return false;
+                    
+                batch_store(b, b.registers[REG_CODE_PSR], b.stack[b.sp - 3] & (uint32_t) ~PSR_FRAME);
+                uint32_t value;
+                batch_store(b, b.registers[REG_CODE_AB], b.stack[b.sp - 4]);
+                batch_written(b, REG_CODE_AB, batch_uniform(b, b.registers[REG_CODE_AB], value));
+                b.sp -= CALL_FRAME_SIZE;
+                
+                // Only restore the registers CALL saved
+                uint32_t saves = ~saved >> PSR_FRAME_SHIFT & SAVE_ALL;
+                for (uint32_t i = 0; saves; ++i, saves >>= 1)
+                {
+                    if (!(saves & 1))
+                        continue;
+                        
+                    batch_store(b, b.registers[REG_CODE_R0 + i], b.stack[b.sp + i]);
+                    batch_written(b, REG_CODE_R0 + i, batch_uniform(b, b.registers[REG_CODE_R0 + i], value));
+                }
+                
+                b.seg = seg;
+                b.pc = pc;
+                return true;
+            }
+            
+            case I_CODE_JMP:
+            {
+                uint32_t pc;
+                if (!batch_scalar(b, ins, ins->a, pc))
+                    return false;
+                    
+                b.pc = pc;
+                return true;
+            }
+            
+            case I_CODE_JZ:
+            case I_CODE_JNZ:
+            case I_CODE_JE:
+            case I_CODE_JNE:
+            case I_CODE_JL:
+            case I_CODE_JLE:
+            case I_CODE_JG:
+            case I_CODE_JGE:
+            {
+                uint32_t pc;
+                if (!batch_scalar(b, ins, ins->a, pc))
+                    return false;
+                    
+                lanes psr = b.registers[REG_CODE_PSR];
+                batch_store(b, b.registers[REG_CODE_PSR], psr & (uint32_t) PSR_FLAG_CLR);
+                
+                uint32_t taken = batch_condition(b, icode, psr);
+                if (taken == b.active)
+                {
+                    b.pc = pc;
+                    return true;
+                }
+                if (!taken)
+                    break;
+                    
+                // The lanes diverge : the ones that jump wait in a new group
+                batch_group& g = b.pending[b.pending_size++];
+                g.pc = pc;
+                g.seg = b.seg;
+                g.sp = b.sp;
+                g.active = taken;
+                batch_activate(b, b.active & ~taken);
+                break;
+            }
+            
+            case I_CODE_UADD:
+            case I_CODE_USUB:
+            case I_CODE_UMUL:
+            case I_CODE_UDIV:
+            case I_CODE_UAND:
+            case I_CODE_UOR:
+            case I_CODE_UXOR:
+            case I_CODE_IADD:
+            case I_CODE_ISUB:
+            case I_CODE_IMUL:
+            case I_CODE_IDIV:
+            case I_CODE_FADD:
+            case I_CODE_FSUB:
+            case I_CODE_FMUL:
+            case I_CODE_FDIV:
+            {
+                if (b.sp < 2)
+                    return false;
+                    
+                lanes result = b.stack[b.sp - 2];
+                batch_apply(b, icode, result, b.stack[b.sp - 1]);
+                batch_store(b, b.stack[b.sp - 2], result);
+                --b.sp;
+                break;
+            }
+            
+            case I_CODE_UCMP:
+            case I_CODE_ICMP:
+            case I_CODE_FCMP:
+            {
+                if (b.sp < 2)
+                    return false;
+                    
+                lanes flags;
+                batch_compare(icode, b.stack[b.sp - 2], b.stack[b.sp - 1], flags);
+                batch_store(b, b.registers[REG_CODE_PSR], b.registers[REG_CODE_PSR] | flags);
+                b.sp -= 2;
+                break;
+            }
+            
+            default:
+                return false;
+        }
+        
+        b.pc = ins->next;
+        return true;
+    }
+    
+    //! Start the calls of a batch, the given number of lanes getting their
+    //!   arguments in turn (see core_call), the others are left inactive.
+    static void batch_start(batch& b, uint32_t seg, uint32_t entry, uint32_t const* args, uint32_t args_size, uint32_t size)
+    {
+        lanes zero = { };
+        for (uint32_t r = 0; r < REG_COUNT; ++r)
+            b.registers[r] = zero;
+        batch_splat(b.registers[REG_CODE_AB], args_size - 1);
+        batch_splat(b.registers[REG_CODE_HB], b.vco->stack_size);
+        
+        // Arguments are pushed right to left
+        lanes* stack = b.stack;
+        for (uint32_t i = args_size; i > 0; --i, ++stack)
+        {
+            *stack = zero;
+            for (uint32_t lane = 0; lane < size; ++lane)
+                (*stack)[lane] = args[lane * args_size + i - 1];
+        }
+        
+        // Then comes a frame returning past the end of the segment
+        for (uint32_t i = REG_CODE_R0; i <= REG_CODE_R9; ++i)
+            *stack++ = zero;
+        *stack++ = zero;
+        batch_splat(*stack++, PSR_FRAME);
+        batch_splat(*stack++, b.vco->segments[seg]->size);
+        batch_splat(*stack++, seg);
+        
+        b.seg = seg;
+        b.pc = entry;
+        b.sp = args_size + CALL_FRAME_SIZE;
+        b.uniform = (1 << REG_COUNT) - 1;
+        b.pending_size = 0;
+        batch_activate(b, (1 << size) - 1);
+    }
+    
+    //! Run the lanes of a batch until they are all done, in lockstep for as
+    //!   long as possible.
+    static void batch_run(batch& b)
+    {
+        core const& vco = *b.vco;
+        
+        batch_schedule(b);
+        while (b.active)
+        {
+            segment const* current = vco.segments[b.seg];
+            if (b.pc >= current->size)
+                batch_finish(b);
+            else if (!batch_step(b, current->code + b.pc))
+                batch_apart(b, b.active, b.pc);
+                
+            if (!b.active || (b.pending_size && batch_yields(b)))
+                batch_schedule(b);
+        }
+    }
+    
+    //! Free a batch, leaving its core's tables alone.
+    static void batch_free(batch& b)
+    {
+        delete[] b.stack;
+        
+        b.scalar.segments_size = 0;
+        b.scalar.segments = 0;
+        b.scalar.hatches_size = 0;
+        b.scalar.hatches = 0;
+        b.scalar.hatch_entries = 0;
+        core_free(b.scalar);
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    void batch_call(core& vco, uint32_t seg, uint32_t entry, uint32_t const* args, uint32_t args_size, uint32_t count, uint32_t* results)
+    {
+        if (seg >= vco.segments_size)
+            throw std::logic_error("vm::batch_call: invalid segment address");
+        if (entry >= vco.segments[seg]->size)
+            throw std::logic_error("vm::batch_call: invalid program address");
+        if (args_size > vco.stack_size || vco.stack_size - args_size < CALL_FRAME_SIZE)
+            throw std::logic_error("vm::batch_call: stack overflow");
+            
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            if (!vco.segments[i]->code)
+                vco.segments[i]->code = decoder_decode(*vco.segments[i]);
+        }
+        core_bind_hatches(vco);
+        
+        batch b;
+        b.vco = &vco;
+        b.stack = new lanes[vco.stack_size];
+        b.scalar = core_create(vco.stack_size, vco.heap_size, 0, 0);
+        b.scalar.base = vco.base;
+        b.scalar.segments_size = vco.segments_size;
+        b.scalar.segments = vco.segments;
+        b.scalar.hatches_size = vco.hatches_size;
+        b.scalar.hatches = vco.hatches;
+        b.scalar.hatch_entries = vco.hatch_entries;
+        
+        try
+        {
+            for (uint32_t first = 0; first < count; first += BATCH_LANES)
+            {
+                b.results = results + first;
+                batch_start(b, seg, entry, args + first * args_size, args_size, std::min<uint32_t>(count - first, BATCH_LANES));
+                batch_run(b);
+            }
+        }
+        catch (...)
+        {
+            batch_free(b);
+            throw;
+        }
+        
+        batch_free(b);
+    }
+} }
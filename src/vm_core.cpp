@@ -17,7 +17,14 @@
  */
 
 #include "bolt/vm_core.h"
+#include "bolt/vm_decoder.h"
+#include "bolt/vm_jit.h"
+#include "bolt/vm_profiler.h"
+#include "bolt/vm_trace.h"
+#include <algorithm>
 #include <stdexcept>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 
@@ -50,43 +57,81 @@ namespace bolt { namespace vm
         }
     }
     
-    //! Fetch a word from the module's program memory.
-    static uint32_t* fetch_word(core& vco)
+    //! Raise a run-time error.
+    //! This is kept out of line so that the (hot) memory and stack accessors
+    //!   below stay small enough to be inlined in the dispatch loop.
+    #ifdef __GNUC__
+    __attribute__((noinline, noreturn, cold))
+    #endif
+    static void core_fault(char const* what)
     {
-        if (vco.registers[REG_CODE_PC] >= vco.segments[vco.registers[REG_CODE_SEG]]->size)
-            throw std::runtime_error("vm::fetch_word: PC out of bounds");
-        
-        return vco.segments[vco.registers[REG_CODE_SEG]]->buffer + vco.registers[REG_CODE_PC]++;
+        throw std::runtime_error(what);
     }
     
     //! Access the module's memory at the given address.
-    static uint32_t* mem_access(core& vco, uint32_t addr)
+    static inline uint32_t* mem_access(core& vco, uint32_t addr)
     {
         if (addr > vco.stack_size + vco.heap_size)
-            throw std::runtime_error("vm::mem_access: address out of bounds");
+            core_fault("vm::mem_access: address out of bounds");
         
         return vco.stack + addr;
     }
     
+    //! Access a run of count words of the module's memory, starting at the
+    //!   given address.
+    static inline uint32_t* mem_range(core& vco, uint32_t addr, uint32_t count)
+    {
+        uint32_t size = vco.stack_size + vco.heap_size;
+        if (addr > size || count > size - addr)
+            core_fault("vm::mem_access: address out of bounds");
+            
+        return vco.stack + addr;
+    }
+    
     //! Push a value onto the module's stack.
-    static void stack_push(core& vco, uint32_t value)
+    //! SP is passed apart, as the threaded loop keeps it in a local variable.
+    //! Trusted code was verified not to overflow the stack (see vm_verifier.h).
+    template <bool TRUSTED>
+    static inline void stack_push(core& vco, uint32_t& sp, uint32_t value)
     {
-        if (vco.registers[REG_CODE_SP] >= vco.stack_size)
-            throw std::runtime_error("vm::stack_push: stack overflow :(");
+        if (!TRUSTED && sp >= vco.stack_size)
+            core_fault("vm::stack_push: stack overflow :(");
         
-        vco.stack[vco.registers[REG_CODE_SP]++] = value;
+        vco.stack[sp++] = value;
+    }
+    
+    //! Push words onto the module's stack, leaving their value undefined.
+    template <bool TRUSTED>
+    static inline void stack_reserve(core& vco, uint32_t& sp, uint32_t count)
+    {
+        if (!TRUSTED && (sp > vco.stack_size || vco.stack_size - sp < count))
+            core_fault("vm::stack_push: stack overflow :(");
+            
+        sp += count;
+    }
+    
+    //! Pop words from the module's stack, leaving them in memory.
+    template <bool TRUSTED>
+    static inline void stack_release(uint32_t& sp, uint32_t count)
+    {
+        if (!TRUSTED && sp < count)
+            core_fault("vm::stack_pop: stack underflow :(");
+            
+        sp -= count;
     }
     
     //! Pop a value from the module's stack.
-    static uint32_t stack_pop(core& vco)
+    //! Trusted code was verified not to underflow the stack (see vm_verifier.h).
+    template <bool TRUSTED>
+    static inline uint32_t stack_pop(core& vco, uint32_t& sp)
     {
-        if (vco.registers[REG_CODE_SP] == 0)
-            throw std::runtime_error("vm::stack_pop: stack underflow :(");
+        if (!TRUSTED && sp == 0)
+            core_fault("vm::stack_pop: stack underflow :(");
             
-        return vco.stack[--vco.registers[REG_CODE_SP]];
+        return vco.stack[--sp];
     }
     
-    //! Resolve an operand based on its code, value and indirection bit.
+    //! Resolve a decoded operand.
     //! Resolving imply following eventual indirections.
     //! An operand can have the following forms :
     //!   reg:          register value
@@ -98,508 +143,882 @@ namespace bolt { namespace vm
     //! Note that immediate offsets are always signed.
     //! All of them (including immediate values) are writable.
     //! Writing to an immediate operand will modify its value in the program memory.
-    //! The offset bit is ignored if the indirection bit is not set.
-    static uint32_t* resolve_operand(core& vco, uint32_t code, uint32_t val, bool ind, bool off)
+    //! The decoder has already folded the offset (see vm_decoder.h), so there
+    //!   is no more encoding work to do here.
+    //! Trusted code skips the bounds check of proven operands (see vm_verifier.h).
+    //! PC and SP are passed apart, as the threaded loop keeps them in local
+    //!   variables : they are written back to the registers when resolving
+    //!   a register operand, as the instruction may read them through it
+    //!   (and the instruction must reload them if it writes to it).
+    template <bool TRUSTED>
+    static inline uint32_t* resolve_operand(core& vco, uint32_t pc, uint32_t sp, decoded_operand const& op)
     {
-        switch (code)
+        uint32_t base;
+        switch (op.kind)
         {
-            case OP_CODE_NONE:
-                return 0;
+            case OPK_REG:
+                vco.registers[REG_CODE_PC] = pc;
+                vco.registers[REG_CODE_SP] = sp;
+                return vco.registers + op.reg;
                 
-            case OP_CODE_REG:
-            {
-                if (val >= REG_COUNT)
-                    return 0;
+            case OPK_IMM:
+                return op.imm;
                 
-                // Get the register address
-                uint32_t* addr = vco.registers + val;
-                // Follow indirection if needed
-                if (ind)
-                {
-                    // Add immediate offset if needed
-                    if (off)
-                        return mem_access(vco, *addr + *((int32_t*) fetch_word(vco)));
-                    return mem_access(vco, *addr);
-                }
-                return addr;
-            }
+            case OPK_REG_IND:
+                if (op.reg == REG_CODE_SP)
+                    base = sp;
+                else if (op.reg == REG_CODE_PC)
+                    base = pc;
+                else
+                    base = vco.registers[op.reg];
+                    
+                if (TRUSTED && op.proven)
+                    return vco.stack + (base + op.offset);
+                return mem_access(vco, base + op.offset);
                 
-            case OP_CODE_IMM:
-            {
-                // Get the immediate operand address
-                uint32_t* addr = fetch_word(vco);
-                // Follow indirection if needed
-                if (ind)
-                {
-                    // Add immediate offset if needed
-                    if (off)
-                        return mem_access(vco, *addr + *((int32_t*) fetch_word(vco)));
-                    return mem_access(vco, *addr);
-                }
-                return addr;
-            }
+            case OPK_IMM_IND:
+                if (TRUSTED && op.proven)
+                    return vco.stack + (*op.imm + op.offset);
+                return mem_access(vco, *op.imm + op.offset);
                 
             default:
-                throw std::logic_error("vm::decode_operand: invalid operand code");
+                return 0;
         }
     }
     
-    //! Decode the A operand.
-    static uint32_t* decode_A(core& vco)
+    //! Write to an immediate operand (in the current segment), bringing the
+    //!   segment's decoded stream up to date if the word changed, as it may be
+    //!   run as an instruction too (see decoder_patch).
+    static inline void imm_write(core& vco, uint32_t* imm, uint32_t value)
+    {
+        if (*imm == value)
+            return;
+            
+        *imm = value;
+        segment const* seg = vco.segments[vco.registers[REG_CODE_SEG]];
+        decoder_patch(*seg, imm - seg->buffer);
+    }
+    
+    //! We use this union to avoid warnings about type-punned pointers
+    //!   in the arithmetic instructions.
+    union word
     {
-        uint32_t instr = vco.registers[REG_CODE_IR];
+        uint32_t u;
+        int32_t i;
+        float f;
+    };
+    
+    //! Apply an arithmetic instruction (given by its handler code) to two operands.
+    //! The handler code is always a constant in vm_handlers.inc, so that
+    //!   this reduces to the single operation once inlined.
+    static inline uint32_t arith_apply(uint32_t handler, uint32_t lhs, uint32_t rhs)
+    {
+        word l, r, ret;
+        l.u = lhs;
+        r.u = rhs;
         
-        // Read in operand code
-        uint32_t code = (instr & OP_A_CODE) >> OP_A_CODE_SHIFT;
-        // Read operand value
-        uint32_t val = (instr & OP_A_VAL) >> OP_A_VAL_SHIFT;
-        // Read indirection bit
-        bool ind = instr & OP_A_IND;
-        // Read offset bit
-        bool off = instr & OP_A_OFF;
+        switch (handler)
+        {
+            case H_CODE_UADD: ret.u = l.u + r.u; break;
+            case H_CODE_USUB: ret.u = l.u - r.u; break;
+            case H_CODE_UMUL: ret.u = l.u * r.u; break;
+            case H_CODE_UDIV: ret.u = l.u / r.u; break;
+            case H_CODE_UAND: ret.u = l.u & r.u; break;
+            case H_CODE_UOR:  ret.u = l.u | r.u; break;
+            case H_CODE_UXOR: ret.u = l.u ^ r.u; break;
+            case H_CODE_IADD: ret.i = l.i + r.i; break;
+            case H_CODE_ISUB: ret.i = l.i - r.i; break;
+            case H_CODE_IMUL: ret.i = l.i * r.i; break;
+            case H_CODE_IDIV: ret.i = l.i / r.i; break;
+            case H_CODE_FADD: ret.f = l.f + r.f; break;
+            case H_CODE_FSUB: ret.f = l.f - r.f; break;
+            case H_CODE_FMUL: ret.f = l.f * r.f; break;
+            case H_CODE_FDIV: ret.f = l.f / r.f; break;
+            default:          ret.u = 0; break;
+        }
         
-        return resolve_operand(vco, code, val, ind, off);
+        return ret.u;
     }
     
-    //! Decode the B operand.
-    static uint32_t* decode_B(core& vco)
+    //! Compare two operands with a comparison instruction (given by its handler code),
+    //!   returning the PSR flags to set.
+    static inline uint32_t arith_compare(uint32_t handler, uint32_t lhs, uint32_t rhs)
     {
-        uint32_t instr = vco.registers[REG_CODE_IR];
+        word l, r;
+        l.u = lhs;
+        r.u = rhs;
         
-        // Read in operand code
-        uint32_t code = (instr & OP_B_CODE) >> OP_B_CODE_SHIFT;
-        // Read operand value
-        uint32_t val = (instr & OP_B_VAL) >> OP_B_VAL_SHIFT;
-        // Read indirection bit
-        bool ind = instr & OP_B_IND;
-        // Read offset bit
-        bool off = instr & OP_B_OFF;
+        bool lt, eq;
+        switch (handler)
+        {
+            case H_CODE_UCMP: lt = l.u < r.u; eq = l.u == r.u; break;
+            case H_CODE_ICMP: lt = l.i < r.i; eq = l.i == r.i; break;
+            case H_CODE_FCMP: lt = l.f < r.f; eq = l.f == r.f; break;
+            default:          lt = false; eq = false; break;
+        }
         
-        return resolve_operand(vco, code, val, ind, off);
+        uint32_t flags = PSR_FLAG_NONE;
+        if (lt)
+            flags |= PSR_FLAG_N;
+        if (eq)
+            flags |= PSR_FLAG_Z;
+        return flags;
     }
     
-    //! Fetch the next instruction form the module's program memory.
-    static uint32_t fetch(core& vco)
+    //! Evaluate the condition of a conditional jump (given by its handler code)
+    //!   against a PSR value.
+    static inline bool flow_condition(uint32_t handler, uint32_t psr)
     {
-        // Instructions are single-word
-        return (vco.registers[REG_CODE_IR] = *fetch_word(vco));
+        switch (handler)
+        {
+            case H_CODE_JZ:
+            case H_CODE_JE:  return psr & PSR_FLAG_Z;
+            case H_CODE_JNZ:
+            case H_CODE_JNE: return !(psr & PSR_FLAG_Z);
+            case H_CODE_JL:  return psr & PSR_FLAG_N;
+            case H_CODE_JLE: return psr & PSR_FLAG_N || psr & PSR_FLAG_Z;
+            case H_CODE_JG:  return !(psr & PSR_FLAG_N);
+            case H_CODE_JGE: return !(psr & PSR_FLAG_N) || psr & PSR_FLAG_Z;
+            default:         return false;
+        }
     }
     
-    //! Execute an instruction from the SYS group.
-    static void execute_sys(core& vco, uint32_t icode)
+    //! The vector kernels of the VEC group work on VEC_LANES words at a time,
+    //!   with GCC's vector extensions (which use the host's SIMD instructions,
+    //!   SSE or AVX, depending on the target flags).
+    //! The vector types may alias any word, and are only aligned as words, so
+    //!   that runs can start anywhere in memory.
+    enum : uint32_t
+    {
+        VEC_LANES = 8
+    };
+    
+    typedef uint32_t vec_uint __attribute__((vector_size(4 * VEC_LANES), aligned(4), may_alias));
+    typedef int32_t vec_int __attribute__((vector_size(4 * VEC_LANES), aligned(4), may_alias));
+    typedef float vec_float __attribute__((vector_size(4 * VEC_LANES), aligned(4), may_alias));
+    
+    //! Apply an element-wise vector instruction (given by its handler code)
+    //!   to VEC_LANES words of A and B, s being VFMA's scalar.
+    //! The handler code is always a constant, see arith_apply.
+    static inline void vec_apply(uint32_t handler, vec_uint& a, vec_uint const& b, vec_uint const& s)
     {
-        switch (icode)
+        switch (handler)
         {
-            case I_CODE_HALT:
-                vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
-                break;
-                
-            case I_CODE_RST:
-                core_reset(vco);
-                break;
-                
-            case I_CODE_DMS:
-                core_stack_dump(vco);
-                break;
-                
-            case I_CODE_DMR:
-                core_register_dump(vco);
-                break;
-                
-            case I_CODE_DMO:
-            {
-                uint32_t* a = decode_A(vco);
-                if (!a)
-                    throw std::logic_error("vm::execute_sys: DMO expects an operand");
-                core_dump_value(std::cout, *a, true);
-                break;
-            }
-                
-            default:
-                throw std::logic_error("vm::execute_sys: invalid instruction code");
+            case H_CODE_VIADD: a += b; break;
+            case H_CODE_VISUB: a -= b; break;
+            case H_CODE_VIMUL: a *= b; break;
+            case H_CODE_VAND:  a &= b; break;
+            case H_CODE_VICMP: a = (vec_uint) ((vec_int) a < (vec_int) b); break;
+            case H_CODE_VFADD: a = (vec_uint) ((vec_float) a + (vec_float) b); break;
+            case H_CODE_VFSUB: a = (vec_uint) ((vec_float) a - (vec_float) b); break;
+            case H_CODE_VFMUL: a = (vec_uint) ((vec_float) a * (vec_float) b); break;
+            case H_CODE_VFMA:  a = (vec_uint) ((vec_float) a + (vec_float) s * (vec_float) b); break;
+            case H_CODE_VFCMP: a = (vec_uint) ((vec_float) a < (vec_float) b); break;
+            default:           break;
         }
     }
     
-    //! Execute an instruction from the MEM group.
-    static void execute_mem(core& vco, uint32_t icode)
+    //! Apply an element-wise vector instruction to runs of n words at A and B.
+    //! The result is the same as if the words were processed one by one, in
+    //!   order : when B starts a little before A, the words of A written to
+    //!   are read again from B, so we process fewer words at a time.
+    template <uint32_t HANDLER>
+    static void vec_map(uint32_t* a, uint32_t const* b, uint32_t n, uint32_t s)
     {
-        uint32_t* a = decode_A(vco);
-        uint32_t* b = decode_B(vco);
+        vec_uint scalar = { 0 };
+        scalar += s;
         
-        switch (icode)
+        uint32_t step = VEC_LANES;
+        if (b < a && (uint32_t) (a - b) < VEC_LANES)
+            step = a - b;
+            
+        uint32_t i = 0;
+        if (step == VEC_LANES)
         {
-            case I_CODE_PUSH:
-                if (!a)
-                    throw std::logic_error("vm::execute_mem: expected an operand in PUSH");
-                stack_push(vco, *a);
-                break;
-                
-            case I_CODE_POP:
-            {
-                // We allow POP's without operands so check
-                //   before dereferencing A !
-                uint32_t value = stack_pop(vco);
-                if (a)
-                    *a = value;
-                break;
-            }
+            for (; n - i >= VEC_LANES; i += VEC_LANES)
+                vec_apply(HANDLER, *(vec_uint*) (a + i), *(vec_uint const*) (b + i), scalar);
+        }
+        
+        // Leftover words go through zero-padded vectors
+        for (; i < n; i += step)
+        {
+            uint32_t count = n - i < step ? n - i : step;
+            vec_uint lhs = { 0 };
+            vec_uint rhs = { 0 };
+            std::copy(a + i, a + i + count, (uint32_t*) &lhs);
+            std::copy(b + i, b + i + count, (uint32_t*) &rhs);
+            vec_apply(HANDLER, lhs, rhs, scalar);
+            std::copy((uint32_t*) &lhs, (uint32_t*) &lhs + count, a + i);
+        }
+    }
+    
+    //! Fold VEC_LANES words of A (and B) into the accumulator of a reduction
+    //!   (given by its handler code).
+    static inline void vec_fold(uint32_t handler, vec_uint& acc, vec_uint const& a, vec_uint const& b)
+    {
+        switch (handler)
+        {
+            case H_CODE_VFDOT: acc = (vec_uint) ((vec_float) acc + (vec_float) a * (vec_float) b); break;
+            case H_CODE_VISUM: acc += a; break;
+            case H_CODE_VIMIN: acc = (vec_int) a < (vec_int) acc ? a : acc; break;
+            case H_CODE_VIMAX: acc = (vec_int) a > (vec_int) acc ? a : acc; break;
+            case H_CODE_VFSUM: acc = (vec_uint) ((vec_float) acc + (vec_float) a); break;
+            case H_CODE_VFMIN: acc = (vec_float) a < (vec_float) acc ? a : acc; break;
+            case H_CODE_VFMAX: acc = (vec_float) a > (vec_float) acc ? a : acc; break;
+            default:           break;
+        }
+    }
+    
+    //! Get the identity of a reduction (given by its handler code), which is
+    //!   its result on an empty run.
+    static inline uint32_t vec_identity(uint32_t handler)
+    {
+        word identity;
+        switch (handler)
+        {
+            case H_CODE_VIMIN: identity.i = INT32_MAX; break;
+            case H_CODE_VIMAX: identity.i = INT32_MIN; break;
+            case H_CODE_VFMIN: identity.f = HUGE_VALF; break;
+            case H_CODE_VFMAX: identity.f = -HUGE_VALF; break;
+            default:           identity.u = 0; break;
+        }
+        
+        return identity.u;
+    }
+    
+    //! Reduce runs of n words at A (and B, for VFDOT) to a single word.
+    //! The words are folded into VEC_LANES partial results, that are folded
+    //!   together at the end, so that the order of floating additions is not
+    //!   the one of the run (but it is always the same).
+    template <uint32_t HANDLER>
+    static uint32_t vec_reduce(uint32_t const* a, uint32_t const* b, uint32_t n)
+    {
+        vec_uint acc = { 0 };
+        acc += vec_identity(HANDLER);
+        
+        uint32_t i = 0;
+        for (; n - i >= VEC_LANES; i += VEC_LANES)
+            vec_fold(HANDLER, acc, *(vec_uint const*) (a + i), *(vec_uint const*) (b + i));
             
-            case I_CODE_DUP:
-            {
-                uint32_t top = stack_pop(vco);
-                stack_push(vco, top);
-                stack_push(vco, top);
-                break;
-            }
-                
-            case I_CODE_MOV:
-                if (!a || !b)
-                    throw std::logic_error("vm::execute_mem: expected two operands in MOV");
-                *a = *b;
-                break;
-                
-            case I_CODE_LOAD:
-            {
-                uint32_t addr = stack_pop(vco);
-                stack_push(vco, *mem_access(vco, addr));
-                break;
-            }
-                
-            case I_CODE_STOR:
-            {
-                uint32_t addr = stack_pop(vco);
-                *mem_access(vco, addr) = stack_pop(vco);
-                break;
-            }
-                
-            case I_CODE_CST:
-            {
-                uint32_t addr;
-                
-                if (a)
-                    addr = *a;
-                else
-                    addr = stack_pop(vco);
-                
-                uint32_t seg = vco.registers[REG_CODE_SEG];
-                if (b)
-                    seg = *b;
-                
-                if (seg >= vco.segments_size)
-                    throw std::logic_error("vm::execute_mem: bad segment in CST");
-                if (addr >= vco.segments[seg]->size)
-                    throw std::logic_error("vm::execute_mem: bad program address in CST");
-                
-                stack_push(vco, vco.segments[seg]->buffer[addr]);
-                break;
-            }
-                
-            default:
-                throw std::logic_error("vm::execute_mem: invalid instruction code");
-        }
-    }
-    
-    static void execute_flow(core& vco, uint32_t icode)
-    {
-        // Be careful to decode the operands right now,
-        //   because if A is an immediate value, we will save a bad PC,
-        //   as we will save it before reading the additional word.
-        // Don't dereference it now because for RET it is null.
-        uint32_t* a = decode_A(vco);
-        
-        switch (icode)
-        {
-            //! Here is the calling convention's ABI.
-            //! The caller is responsible for pushing the arguments
-            //!   on the stack before CALLing.
-            //! They must be pushed right to left.
-            //! For example (if arguments are 1-word wide), the n-th argument is accessed with
-            //!   [%ab-n] (n is zero-based)
-            //! The caller is responsible for cleaning up the stack after the callee
-            //!   has returned.
-            //! The return value can be written in the special register RV.
-            //! The caller must save the RV register itself if needed.
-            //! 
-            //! Stack frame when calling :
-            //!
-            //! +--------+
-            //! |  ARGn  |
-            //! +--------+
-            //! |  ....  |
-            //! +--------+
-            //! |  ARG0  |
-            //! +--------+ <-- %ab
-            //! | R0-R9  |
-            //! +--------+
-            //! |  AB    |
-            //! +--------+
-            //! |  PSR   |
-            //! +--------+
-            //! |  PC    |
-            //! +--------+
-            //! |  SEG   |
-            //! +--------+ <--- top of the stack
-            //!
-            case I_CODE_CALL:
-            {
-                if (!a)
-                    throw std::logic_error("vm::execute_flow: expected at least one operand in CALL");
-                
-                uint32_t* b = decode_B(vco);
-                                
-                // Because we use post-incrementation stack addressing,
-                //   SP is actually just over the top, so we must save SP-1
-                //   to get the argument base address.
-                uint32_t args_base = vco.registers[REG_CODE_SP] - 1;
-                
-                for (int i = (int) REG_CODE_R0; i <= (int) REG_CODE_R9; ++i)
-                    stack_push(vco, vco.registers[i]);
-                stack_push(vco, vco.registers[REG_CODE_AB]);
-                stack_push(vco, vco.registers[REG_CODE_PSR]);
-                stack_push(vco, vco.registers[REG_CODE_PC]);
-                stack_push(vco, vco.registers[REG_CODE_SEG]);
-                
-                vco.registers[REG_CODE_AB] = args_base;
-                
-                // Long call case (must change segment)
-                // Two operands, A (segment) and B (offset)
-                if (b)
-                {
-                    if (*a >= vco.segments_size)
-                        throw std::logic_error("vm::execute_flow: invalid segment address in long CALL");
-                    
-                    vco.registers[REG_CODE_SEG] = *a;
-                    vco.registers[REG_CODE_PC] = *b;
-                }
-                // Normal call, just one operand A
-                else
-                {
-                    vco.registers[REG_CODE_PC] = *a;
-                }
+        // Leftover words are padded with the identity
+        if (i < n)
+        {
+            vec_uint lhs = { 0 };
+            vec_uint rhs = { 0 };
+            lhs += vec_identity(HANDLER);
+            std::copy(a + i, a + n, (uint32_t*) &lhs);
+            std::copy(b + i, b + n, (uint32_t*) &rhs);
+            vec_fold(HANDLER, acc, lhs, rhs);
+        }
+        
+        uint32_t const* partial = (uint32_t const*) &acc;
+        vec_uint result = { 0 };
+        result += partial[0];
+        for (uint32_t j = 1; j < VEC_LANES; ++j)
+        {
+            vec_uint other = { 0 };
+            other += partial[j];
+            vec_fold(HANDLER == H_CODE_VFDOT ? H_CODE_VFSUM : HANDLER, result, other, other);
+        }
+        
+        return result[0];
+    }
+    
+    //! Compare runs of n words at A and B (as unsigneds), returning the PSR
+    //!   flags to set (see arith_compare) for their first distinct words, or
+    //!   Z if they are the same.
+    //! Runs are compared VEC_LANES words at a time, so that the first distinct
+    //!   words are only looked for in the chunk that holds them.
+    static uint32_t mem_compare(uint32_t const* a, uint32_t const* b, uint32_t n)
+    {
+        uint32_t i = 0;
+        for (; n - i >= VEC_LANES; i += VEC_LANES)
+        {
+            vec_uint diff = *(vec_uint const*) (a + i) ^ *(vec_uint const*) (b + i);
+            uint32_t const* words = (uint32_t const*) &diff;
+            if (std::count(words, words + VEC_LANES, 0) != VEC_LANES)
                 break;
-            }
+        }
+        
+        for (; i < n; ++i)
+        {
+            if (a[i] != b[i])
+                return arith_compare(H_CODE_UCMP, a[i], b[i]);
+        }
+        
+        return PSR_FLAG_Z;
+    }
+    
+    //! Check if a core is done running (it halted, or its flow ran past the
+    //!   end of the current segment).
+    static inline bool core_done(core const& vco)
+    {
+        return vco.registers[REG_CODE_PC] >= vco.segments[vco.registers[REG_CODE_SEG]]->size ||
+               vco.registers[REG_CODE_PSR] & PSR_FLAG_HALT;
+    }
+    
+    //! Check if the trusted interpreter can resume at the given location,
+    //!   with the given SP (see vm_verifier.h).
+    static inline bool trust_resume(core const& vco, uint32_t seg, uint32_t pc, uint32_t sp)
+    {
+        if (seg >= vco.segments_size)
+            return false;
+            
+        segment const* s = vco.segments[seg];
+        if (!s->code || pc >= s->size)
+            return false;
+            
+        decoded_instruction const& ins = s->code[pc];
+        return sp >= ins.depth && sp <= vco.stack_size && ins.room <= vco.stack_size - sp;
+    }
+    
+    //! Check if trusted code can go on with a CALL (given SP and its resolved operands).
+    static inline bool trust_call(core const& vco, uint32_t sp, uint32_t const* a, uint32_t const* b)
+    {
+        sp += CALL_FRAME_SIZE;
+        if (b)
+            return trust_resume(vco, *a, *b, sp);
+            
+        return trust_resume(vco, vco.registers[REG_CODE_SEG], *a, sp);
+    }
+    
+    //! Check if trusted code can go on with a RET (given SP), from the saved
+    //!   SEG and PC (a callee may have overwritten its stack frame).
+    static inline bool trust_return(core const& vco, uint32_t sp)
+    {
+        if (sp < CALL_FRAME_SIZE || sp > vco.stack_size)
+            return false;
+            
+        return trust_resume(vco, vco.stack[sp - 1], vco.stack[sp - 2], sp - CALL_FRAME_SIZE);
+    }
+    
+    //! The outcomes of execute.
+    //! LEAVE: trusted code has to leave the trusted interpreter
+    //! NEXT:  the flow goes on in sequence
+    //! JUMP:  the flow may have jumped (or changed SEG or PSR)
+    enum : uint32_t
+    {
+        EXECUTE_LEAVE,
+        EXECUTE_NEXT,
+        EXECUTE_JUMP
+    };
+    
+    //! Execute a decoded instruction, with the given handler (its own one,
+    //!   or the one it had before fusion, see decoder_base_handler).
+    //! Dispatching is done once on the handler code resolved by the decoder
+    //!   (instead of on the group, then on the instruction code).
+    //! This is the switch loop's body, and is also used to execute single
+    //!   instructions (see core_step).
+    //! Returns the outcome of the instruction (see EXECUTE_*).
+    template <bool TRUSTED>
+    static uint32_t execute(core& vco, decoded_instruction const* ins, uint32_t handler)
+    {
+        #define HANDLER(name) \
+            case H_CODE_ ## name:
+            
+        #define PC \
+            vco.registers[REG_CODE_PC]
+        #define SP \
+            vco.registers[REG_CODE_SP]
+        #define SAVE \
+            do {} while (0)
+        #define RESTORE \
+            do {} while (0)
+        #define SEGMENT \
+            do {} while (0)
+            
+        #define PUSH(value) \
+            stack_push<TRUSTED>(vco, SP, value)
+        #define RESERVE(n) \
+            stack_reserve<TRUSTED>(vco, SP, n)
+        #define RELEASE(n) \
+            stack_release<TRUSTED>(SP, n)
+        #define POP() \
+            stack_pop<TRUSTED>(vco, SP)
+        #define DROP(n) \
+            (SP -= (n))
+        #define OPERAND(op) \
+            resolve_operand<TRUSTED>(vco, PC, SP, op)
+        #define MEMORY(addr) \
+            mem_access(vco, addr)
+            
+        #define NEXT \
+            return EXECUTE_NEXT
+            
+        #define JUMP \
+            return EXECUTE_JUMP
+            
+        #define LEAVE \
+            return EXECUTE_LEAVE
+            
+        switch (handler)
+        {
+            #include "vm_handlers.inc"
             
-            case I_CODE_DIVE:
-            {
-                if (!a)
-                    throw std::logic_error("vm::execute_flow: expected at least one operand in DIVE");
-                if (*a > vco.hatches_size)
-                    throw std::logic_error("vm::execute_flow: invalid hatch address in DIVE");
-                
-                vco.hatches[*a]->entry(vco);
-                
-                break;
-            }
-                
-            case I_CODE_RET:
-                vco.registers[REG_CODE_SEG] = stack_pop(vco);
-                vco.registers[REG_CODE_PC] = stack_pop(vco);
-                vco.registers[REG_CODE_PSR] = stack_pop(vco);
-                vco.registers[REG_CODE_AB] = stack_pop(vco);
-                for (int i = (int) REG_CODE_R9; i >= (int) REG_CODE_R0; --i)
-                    vco.registers[i] = stack_pop(vco);
-                break;
-                
-            if (!a)
-                throw std::logic_error("vm::execute_flow: expected an operand in jump instruction");
-                
-            case I_CODE_JMP:
-                vco.registers[REG_CODE_PC] = *a;
-                break;
-                
-            case I_CODE_JZ:
-            case I_CODE_JE:
-                if (vco.registers[REG_CODE_PSR] & PSR_FLAG_Z)
-                    vco.registers[REG_CODE_PC] = *a;
-                goto psr_clr;
-                
-            case I_CODE_JNZ:
-            case I_CODE_JNE:
-                if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_Z))
-                    vco.registers[REG_CODE_PC] = *a;
-                goto psr_clr;
-                
-            case I_CODE_JL:
-                if (vco.registers[REG_CODE_PSR] & PSR_FLAG_N)
-                    vco.registers[REG_CODE_PC] = *a;
-                goto psr_clr;
-                
-            case I_CODE_JLE:
-                if (vco.registers[REG_CODE_PSR] & PSR_FLAG_N ||
-                    vco.registers[REG_CODE_PSR] & PSR_FLAG_Z)
-                    vco.registers[REG_CODE_PC] = *a;
-                goto psr_clr;
-                
-            case I_CODE_JG:
-                if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_N))
-                    vco.registers[REG_CODE_PC] = *a;
-                goto psr_clr;
-                
-            case I_CODE_JGE:
-                if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_N) ||
-                    vco.registers[REG_CODE_PSR] & PSR_FLAG_Z)
-                    vco.registers[REG_CODE_PC] = *a;
-                goto psr_clr;
-                
-            psr_clr:
-                vco.registers[REG_CODE_PSR] &= PSR_FLAG_CLR;
-                break;
-                
             default:
-                throw std::logic_error("vm::execute_flow: invalid instruction code");
+                throw std::logic_error("vm::execute: invalid handler code");
         }
+        
+        #undef HANDLER
+        #undef PC
+        #undef SP
+        #undef SAVE
+        #undef RESTORE
+        #undef SEGMENT
+        #undef PUSH
+        #undef RESERVE
+        #undef RELEASE
+        #undef POP
+        #undef DROP
+        #undef OPERAND
+        #undef MEMORY
+        #undef NEXT
+        #undef JUMP
+        #undef LEAVE
     }
     
-    //! Execute an instruction from the ARITH group.
-    static void execute_arith(core& vco, uint32_t icode)
+    //! Get the handler to dispatch a decoded instruction to : the one it had
+    //!   before fusion if UNFUSED (see decoder_base_handler), so that each
+    //!   instruction of a fused sequence is dispatched.
+    template <bool UNFUSED>
+    static inline uint32_t run_handler(decoded_instruction const* ins)
     {
-        //! We use unions here to avoid warning about type-punned pointers.
-        union {
-            uint32_t u_rhs;
-            int32_t i_rhs;
-            float f_rhs;
-        };
+        if (UNFUSED && ins->handler >= H_CODE_FUSED)
+            return decoder_base_handler(*ins);
+            
+        return ins->handler;
+    }
+    
+    //! The dispatch loops below are expanded in three modes :
+    //!   RUN_CHECKED: the checked interpreter (see core_run),
+    //!   RUN_TRUSTED: the trusted interpreter, which runs verified code until
+    //!                it has to leave it,
+    //!   RUN_WATCHED: the checked interpreter, which stops as soon as the
+    //!                program's flow reaches a location where the trusted
+    //!                interpreter can resume (see core_run_trusted),
+    //!   RUN_PROFILED: the checked interpreter, which records each instruction
+    //!                 in a profile (see core_run_profiled), running fused
+    //!                 sequences one instruction at a time,
+    //!   RUN_TRACED: the checked interpreter, which records each instruction
+    //!               in the core's trace (see vm_trace.h), running fused
+    //!               sequences one instruction at a time,
+    //!   RUN_UNCOMPILED: the checked interpreter, which stops as soon as the
+    //!                   program's flow reaches a location that was compiled
+    //!                   to native code (see core_run_to_native),
+    //!   RUN_SAMPLED: the checked interpreter, whose budget is a number of
+    //!                dispatches, and which stops right before a DIVE that
+    //!                is not the first dispatch (see core_run_sampled).
+    enum : uint32_t
+    {
+        RUN_CHECKED,
+        RUN_TRUSTED,
+        RUN_WATCHED,
+        RUN_PROFILED,
+        RUN_TRACED,
+        RUN_UNCOMPILED,
+        RUN_SAMPLED
+    };
+    
+    //! Instruction semantics are defined once in vm_handlers.inc, and expanded
+    //!   in one of the two dispatch loops below, selected at build time :
+    //!   - the direct-threaded loop (BOLT_THREADED, requires GCC's labels as values)
+    //!     jumps from each handler straight to the next one, so that each
+    //!     handler has its own dispatch site (and branch prediction history),
+    //!   - the switch loop is the portable fallback.
+    //!
+    //! The threaded loop runs on a local execution context : PC, SP and the
+    //!   current segment's decoded stream and size are kept in local variables
+    //!   (which the compiler can keep in host registers), instead of going
+    //!   through the core's registers and segment table on each instruction.
+    //! They are written back to the core's registers whenever something else
+    //!   may read them : register operands, hatches, dumps, and when leaving
+    //!   the loop (including on errors). The current segment is reloaded only
+    //!   when SEG may have changed (long CALL, RET, hatches, writing to SEG...).
+    #if defined(BOLT_THREADED) && defined(__GNUC__)
+    
+    //! The local execution context of the threaded loop.
+    //! The mark field is the decoded entry the program's flow last jumped to,
+    //!   in the origin stream (the code field at that time), so that the words
+    //!   run since then are charged to the budget on the next jump (see run below).
+    struct run_context
+    {
+        decoded_instruction const* code;
+        uint32_t size;
+        uint32_t pc;
+        uint32_t sp;
         
-        union {
-            uint32_t u_lhs;
-            int32_t i_lhs;
-            float f_lhs;
-        };
+        decoded_instruction const* origin;
+        decoded_instruction const* mark;
+        int64_t budget;
+    };
+    
+    //! Run the decoded program until the end of the segment (or the core halted),
+    //!   or until the budget is exhausted (down to zero or less), if BUDGET.
+    //! The budget is counted in program words run, it is only charged when the
+    //!   program's flow jumps (sequential code costs nothing), and checked when
+    //!   it jumps backward (see CHARGE below). It is left to what remains of it.
+    //! In the RUN_SAMPLED mode, the budget is rather counted in dispatches, and
+    //!   checked on each one (see COUNT below), BUDGET being false.
+    //! The profile is only used (and must be given) in the RUN_PROFILED mode.
+    template <uint32_t MODE, bool BUDGET>
+    static void run(core& vco, int64_t& budget, profile* prof)
+    {
+        static bool const TRUSTED = MODE == RUN_TRUSTED;
+        static bool const UNFUSED = MODE == RUN_PROFILED || MODE == RUN_TRACED;
         
-        union {
-            uint32_t u_ret;
-            int32_t i_ret;
-            float f_ret;
+        //! These macros define the behavior of the declarations in vm_instructions.inc
+        //!   and vm_fusions.inc, here we build the handler address table (in H_CODE_* order).
+        #define DECL_INSTR(group, name, offset, f, a, b) \
+            &&handler_ ## name,
+        #define DECL_FUSION(name, shape, i0, i1, i2, i3) \
+            &&handler_ ## name,
+            
+        static void* const handlers[H_CODE_COUNT] =
+        {
+            &&handler_END,
+            &&handler_BAD,
+            &&handler_FETCH,
+            
+            #include "bolt/vm_instructions.inc"
+            #include "bolt/vm_fusions.inc"
         };
         
-        u_rhs = stack_pop(vco);
-        u_lhs = stack_pop(vco);
+        #undef DECL_INSTR
+        #undef DECL_FUSION
+        
+        run_context ctx;
+        decoded_instruction const* ins;
         
-        switch (icode)
+        #define PC \
+            ctx.pc
+        #define SP \
+            ctx.sp
+            
+        //! Write PC and SP back to the core's registers.
+        #define SAVE \
+            do \
+            { \
+                vco.registers[REG_CODE_PC] = ctx.pc; \
+                vco.registers[REG_CODE_SP] = ctx.sp; \
+            } while (0)
+            
+        //! Reload the current segment from SEG.
+        #define SEGMENT \
+            do \
+            { \
+                segment const* current = vco.segments[vco.registers[REG_CODE_SEG]]; \
+                ctx.code = current->code; \
+                ctx.size = current->size; \
+            } while (0)
+            
+        //! Reload the whole context from the core's registers.
+        #define RESTORE \
+            do \
+            { \
+                ctx.pc = vco.registers[REG_CODE_PC]; \
+                ctx.sp = vco.registers[REG_CODE_SP]; \
+                SEGMENT; \
+            } while (0)
+            
+        #define PUSH(value) \
+            stack_push<TRUSTED>(vco, ctx.sp, value)
+        #define RESERVE(n) \
+            stack_reserve<TRUSTED>(vco, ctx.sp, n)
+        #define RELEASE(n) \
+            stack_release<TRUSTED>(ctx.sp, n)
+        #define POP() \
+            stack_pop<TRUSTED>(vco, ctx.sp)
+        #define DROP(n) \
+            (ctx.sp -= (n))
+        #define OPERAND(op) \
+            resolve_operand<TRUSTED>(vco, ctx.pc, ctx.sp, op)
+        #define MEMORY(addr) \
+            mem_access(vco, addr)
+        
+        //! Jump to the next decoded instruction's handler (see run_handler).
+        //! Sequential execution can never run past the terminating entry of
+        //!   the decoded stream (see vm_decoder.h), so no check is needed here.
+        //! Note that PC is set to point past the instruction before executing it.
+        #define NEXT \
+            do \
+            { \
+                ins = ctx.code + ctx.pc; \
+                if (MODE == RUN_SAMPLED) \
+                    COUNT; \
+                if (MODE == RUN_PROFILED) \
+                    profile_step(*prof, vco, ins); \
+                if (MODE == RUN_TRACED) \
+                    trace_record(*vco.trace, vco.registers[REG_CODE_SEG], ctx.pc, ins->instr, ctx.sp); \
+                vco.registers[REG_CODE_IR] = ins->instr; \
+                ctx.pc = ins->next; \
+                goto *handlers[run_handler<UNFUSED>(ins)]; \
+            } while (0)
+            
+        //! Leave the loop.
+        #define EXIT \
+            do \
+            { \
+                SAVE; \
+                budget = ctx.budget; \
+                return; \
+            } while (0)
+            
+        //! Count a dispatch in the RUN_SAMPLED mode, stopping when the budget
+        //!   is exhausted, or before a DIVE once something ran.
+        #define COUNT \
+            do \
+            { \
+                if (ctx.budget <= 0 || (ins->handler == H_CODE_DIVE && ctx.budget < budget)) \
+                    EXIT; \
+                --ctx.budget; \
+            } while (0)
+            
+        //! Check for halt and end of segment.
+        #define CHECK \
+            do \
+            { \
+                if (ctx.pc >= ctx.size || vco.registers[REG_CODE_PSR] & PSR_FLAG_STOP) \
+                    EXIT; \
+            } while (0)
+            
+        //! Charge the words run since the last jump to the budget, stopping
+        //!   if it is exhausted and the flow went backward (backward jumps,
+        //!   most calls and returns, and anything leaving the segment) : a run
+        //!   can't go on for long without jumping backward, so that there is
+        //!   no need to check elsewhere.
+        #define CHARGE \
+            do \
+            { \
+                if (BUDGET) \
+                { \
+                    bool backward = ctx.code != ctx.origin || ctx.pc < ins->next; \
+                    ctx.budget -= ins->next - (ctx.mark - ctx.origin); \
+                    ctx.origin = ctx.code; \
+                    ctx.mark = ctx.code + ctx.pc; \
+                    if (ctx.budget <= 0 && backward) \
+                        EXIT; \
+                } \
+            } while (0)
+            
+        //! Check for halt and end of segment before going on, and stop if we
+        //!   can switch to the trusted interpreter (or if the budget is exhausted).
+        #define JUMP \
+            do \
+            { \
+                CHECK; \
+                CHARGE; \
+                if (MODE == RUN_WATCHED && trust_resume(vco, vco.registers[REG_CODE_SEG], ctx.pc, ctx.sp)) \
+                    EXIT; \
+                if (MODE == RUN_UNCOMPILED && jit_is_compiled(*vco.segments[vco.registers[REG_CODE_SEG]], ctx.pc)) \
+                    EXIT; \
+                NEXT; \
+            } while (0)
+            
+        #define LEAVE \
+            EXIT
+            
+        #define HANDLER(name) \
+            handler_ ## name:
+            
+        RESTORE;
+        ctx.origin = ctx.code;
+        ctx.mark = ctx.code + ctx.pc;
+        ctx.budget = budget;
+        
+        try
         {
-            case I_CODE_UADD:
-                stack_push(vco, u_lhs + u_rhs);
-                break;
-                
-            case I_CODE_USUB:
-                stack_push(vco, u_lhs - u_rhs);
-                break;
-                
-            case I_CODE_UMUL:
-                stack_push(vco, u_lhs * u_rhs);
-                break;
-                
-            case I_CODE_UDIV:
-                stack_push(vco, u_lhs / u_rhs);
-                break;
-                
-            case I_CODE_UAND:
-                stack_push(vco, u_lhs & u_rhs);
-                break;
-                
-            case I_CODE_UOR:
-                stack_push(vco, u_lhs | u_rhs);
-                break;
-                
-            case I_CODE_UXOR:
-                stack_push(vco, u_lhs ^ u_rhs);
-                break;
+            CHECK;
+            NEXT;
             
-            case I_CODE_UCMP:
-                if (u_lhs < u_rhs)
-                    vco.registers[REG_CODE_PSR] |= PSR_FLAG_N;
-                if (u_lhs == u_rhs)
-                    vco.registers[REG_CODE_PSR] |= PSR_FLAG_Z;
-                break;
-                
-            case I_CODE_IADD:
-                i_ret = i_lhs + i_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_ISUB:
-                i_ret = i_lhs - i_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_IMUL:
-                i_ret = i_lhs * i_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_IDIV:
-                i_ret = i_lhs / i_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_ICMP:
-                if (i_lhs < i_rhs)
-                    vco.registers[REG_CODE_PSR] |= PSR_FLAG_N;
-                if (i_lhs == i_rhs)
-                    vco.registers[REG_CODE_PSR] |= PSR_FLAG_Z;
-                break;
-                
-            case I_CODE_FADD:
-                f_ret = f_lhs + f_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_FSUB:
-                f_ret = f_lhs - f_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_FMUL:
-                f_ret = f_lhs * f_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_FDIV:
-                f_ret = f_lhs / f_rhs;
-                stack_push(vco, u_ret);
-                break;
-                
-            case I_CODE_FCMP:
-                if (f_lhs < f_rhs)
-                    vco.registers[REG_CODE_PSR] |= PSR_FLAG_N;
-                if (f_lhs == f_rhs)
-                    vco.registers[REG_CODE_PSR] |= PSR_FLAG_Z;
-                break;
-                
-            default:
-                throw std::logic_error("vm::execute_arith: invalid instruction code");
+            #include "vm_handlers.inc"
         }
+        catch (...)
+        {
+            // Leave a consistent core to whoever handles the error
+            SAVE;
+            budget = ctx.budget;
+            throw;
+        }
+        
+        #undef HANDLER
+        #undef PC
+        #undef SP
+        #undef SAVE
+        #undef SEGMENT
+        #undef RESTORE
+        #undef PUSH
+        #undef RESERVE
+        #undef RELEASE
+        #undef POP
+        #undef DROP
+        #undef OPERAND
+        #undef MEMORY
+        #undef NEXT
+        #undef EXIT
+        #undef COUNT
+        #undef CHECK
+        #undef CHARGE
+        #undef JUMP
+        #undef LEAVE
     }
     
-    //! Execute the next instruction.
-    static void execute(core& vco)
-    {   
-        uint32_t instr = fetch(vco);
+    #else
+    
+    //! Run the decoded program until the end of the segment (or the core halted),
+    //!   or until the budget is exhausted (down to zero or less), if BUDGET.
+    //! The budget is charged and checked as in the threaded loop, with mark
+    //!   the location the program's flow last jumped to (or counted as in
+    //!   the threaded loop in the RUN_SAMPLED mode, from its start value).
+    //! The profile is only used (and must be given) in the RUN_PROFILED mode.
+    template <uint32_t MODE, bool BUDGET>
+    static void run(core& vco, int64_t& budget, profile* prof)
+    {
+        static bool const UNFUSED = MODE == RUN_PROFILED || MODE == RUN_TRACED;
         
-        uint32_t icode = (instr & I_CODE_MASK) >> I_CODE_SHIFT;
-        uint32_t igroup = (icode & I_GROUP_MASK) >> I_GROUP_SHIFT;
+        segment* seg;
+        uint32_t mark = vco.registers[REG_CODE_PC];
+        int64_t const start = budget;
+        while (vco.registers[REG_CODE_PC] < (seg = vco.segments[vco.registers[REG_CODE_SEG]])->size &&
+               !(vco.registers[REG_CODE_PSR] & PSR_FLAG_STOP))
+        {
+            decoded_instruction const* ins = seg->code + vco.registers[REG_CODE_PC];
+            if (MODE == RUN_SAMPLED)
+            {
+                if (budget <= 0 || (ins->handler == H_CODE_DIVE && budget < start))
+                    return;
+                --budget;
+            }
+            if (MODE == RUN_PROFILED)
+                profile_step(*prof, vco, ins);
+            if (MODE == RUN_TRACED)
+                trace_record(*vco.trace, vco.registers[REG_CODE_SEG], vco.registers[REG_CODE_PC],
+                             ins->instr, vco.registers[REG_CODE_SP]);
+                             
+            vco.registers[REG_CODE_IR] = ins->instr;
+            vco.registers[REG_CODE_PC] = ins->next;
+            
+            uint32_t outcome = execute<MODE == RUN_TRUSTED>(vco, ins, run_handler<UNFUSED>(ins));
+            if (outcome == EXECUTE_LEAVE)
+                return;
+            if (BUDGET && outcome == EXECUTE_JUMP)
+            {
+                bool backward = vco.segments[vco.registers[REG_CODE_SEG]] != seg ||
+                                vco.registers[REG_CODE_PC] < ins->next;
+                budget -= ins->next - mark;
+                mark = vco.registers[REG_CODE_PC];
+                if (budget <= 0 && backward)
+                    return;
+            }
+            
+            if (MODE == RUN_WATCHED && trust_resume(vco, vco.registers[REG_CODE_SEG],
+                                                    vco.registers[REG_CODE_PC], vco.registers[REG_CODE_SP]))
+                return;
+            if (MODE == RUN_UNCOMPILED && jit_is_compiled(*vco.segments[vco.registers[REG_CODE_SEG]],
+                                                          vco.registers[REG_CODE_PC]))
+                return;
+        }
+    }
+    
+    #endif
+    
+    //! Decode the segments that were not by the linker, and bind the hatches.
+    static void run_prepare(core& vco)
+    {
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            if (!vco.segments[i]->code)
+                vco.segments[i]->code = decoder_decode(*vco.segments[i]);
+        }
+        core_bind_hatches(vco);
+    }
+    
+    //! Run the checked interpreter for a budget (if BUDGET), returns true if it
+    //!   was exhausted (or the core suspended) before the core halted.
+    template <bool BUDGET>
+    static bool run_checked(core& vco, int64_t& budget)
+    {
+        run_prepare(vco);
+        if (vco.trace)
+            run<RUN_TRACED, BUDGET>(vco, budget, 0);
+        else
+            run<RUN_CHECKED, BUDGET>(vco, budget, 0);
         
-        switch (igroup)
+        if (!core_done(vco))
+            return true;
+            
+        vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+        return false;
+    }
+    
+    //! Run the checked interpreter for a budget of dispatches, stopping before
+    //!   a DIVE (see core_run_sampled), returns true if it stopped (or the
+    //!   core suspended) before the core halted.
+    static bool run_sampled(core& vco, int64_t& budget)
+    {
+        run_prepare(vco);
+        run<RUN_SAMPLED, false>(vco, budget, 0);
+        
+        if (!core_done(vco))
+            return true;
+            
+        vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+        return false;
+    }
+    
+    //! Run the trusted interpreter for a budget (if BUDGET), returns true if it
+    //!   was exhausted (or the core suspended) before the core halted.
+    //! Segments that were not decoded by the linker were not verified either,
+    //!   so they won't run trusted.
+    template <bool BUDGET>
+    static bool run_trusted(core& vco, int64_t& budget)
+    {
+        if (vco.trace)
+            return run_checked<BUDGET>(vco, budget);
+            
+        run_prepare(vco);
+        
+        // Switch between both interpreters, the checked one always runs at least
+        //   one instruction, so that we can't get stuck where trusted code leaves
+        while (!core_done(vco) && !(vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT) && budget > 0)
         {
-            case I_GROUP_SYS:
-                execute_sys(vco, icode);
-                break;
-                
-            case I_GROUP_MEM:
-                execute_mem(vco, icode);
-                break;
-                
-            case I_GROUP_FLOW:
-                execute_flow(vco, icode);
-                break;
+            if (trust_resume(vco, vco.registers[REG_CODE_SEG], vco.registers[REG_CODE_PC], vco.registers[REG_CODE_SP]))
+                run<RUN_TRUSTED, BUDGET>(vco, budget, 0);
                 
-            case I_GROUP_ARITH:
-                execute_arith(vco, icode);
-                break;
+            if (budget > 0)
+                run<RUN_WATCHED, BUDGET>(vco, budget, 0);
+        }
+        
+        if (!core_done(vco))
+            return true;
             
-            default:
-                throw std::logic_error("vm::execute: invalid instruction group");
+        vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+        return false;
+    }
+    
+    //! Run an interpreter for a budget, reporting errors as a status (the
+    //!   faulty instruction has been fetched already, so that the run can't
+    //!   go on, and the core is halted).
+    //! The budget is left to what remains of it (zero once exhausted).
+    template <bool(*RUN)(core&, int64_t&)>
+    static uint32_t run_for(core& vco, uint64_t& budget, std::string* fault)
+    {
+        int64_t left = budget < INT64_MAX ? budget : INT64_MAX;
+        try
+        {
+            bool stopped = RUN(vco, left);
+            budget = left > 0 ? left : 0;
+            if (stopped)
+                return vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT ? CORE_SUSPENDED : CORE_EXHAUSTED;
+        }
+        catch (std::exception const& exc)
+        {
+            vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+            if (fault)
+                *fault = exc.what();
+            return CORE_FAULTED;
         }
+        
+        return CORE_HALTED;
     }
     
     /*************************/
@@ -624,9 +1043,17 @@ namespace bolt { namespace vm
         
         vco.hatches_size = hatches_size;
         if (vco.hatches_size)
+        {
             vco.hatches = new hatch*[hatches_size];
+            vco.hatch_entries = new hatch_function[hatches_size];
+        }
         else
+        {
             vco.hatches = 0;
+            vco.hatch_entries = 0;
+        }
+        
+        vco.trace = 0;
         
         return vco;
     }
@@ -637,6 +1064,11 @@ namespace bolt { namespace vm
         {
             if (vco.segments[i] && vco.segments[i]->buffer)
                 delete[] vco.segments[i]->buffer;
+            if (vco.segments[i])
+            {
+                decoder_free(vco.segments[i]->code);
+                jit_free(vco.segments[i]->native);
+            }
             delete vco.segments[i];
         }
     }
@@ -647,11 +1079,23 @@ namespace bolt { namespace vm
             delete vco.hatches[i];
     }
     
+    void core_bind_hatches(core& vco)
+    {
+        for (uint32_t i = 0; i < vco.hatches_size; ++i)
+        {
+            if (vco.hatch_entries[i] != vco.hatches[i]->entry)
+                vco.hatch_entries[i] = vco.hatches[i]->entry;
+        }
+    }
+    
     void core_free(core& vco)
     {
         if (vco.hatches)
             delete[] vco.hatches;
         vco.hatches = 0;
+        if (vco.hatch_entries)
+            delete[] vco.hatch_entries;
+        vco.hatch_entries = 0;
         vco.hatches_size = 0;
         
         if (vco.segments)
@@ -675,15 +1119,201 @@ namespace bolt { namespace vm
         vco.registers[REG_CODE_HB] = vco.stack_size;
     }
     
+    snapshot core_snapshot(core const& vco)
+    {
+        // The clones share the segments, so their code must not change
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment view = *vco.segments[i];
+            if (!view.code)
+                view.code = decoder_decode(view);
+                
+            bool self_modifying = decoder_is_self_modifying(view);
+            if (view.code != vco.segments[i]->code)
+                decoder_free(view.code);
+            if (self_modifying)
+                throw std::logic_error("vm::core_snapshot: self-modifying segments can't be shared (link them as read-only code)");
+        }
+        
+        snapshot snap;
+        snap.stack_size = vco.stack_size;
+        snap.heap_size = vco.heap_size;
+        snap.segments_size = vco.segments_size;
+        snap.hatches_size = vco.hatches_size;
+        snap.base = vco.base;
+        std::copy_n(vco.registers, REG_COUNT, snap.registers);
+        
+        // A stack overflowing into the heap is saved with it
+        snap.stack_used = std::min(vco.registers[REG_CODE_SP], vco.stack_size);
+        if (snap.stack_used + snap.heap_size)
+        {
+            snap.memory = new uint32_t[snap.stack_used + snap.heap_size];
+            std::copy_n(vco.stack, snap.stack_used, snap.memory);
+            std::copy_n(vco.stack + vco.stack_size, vco.heap_size, snap.memory + snap.stack_used);
+        }
+        else
+            snap.memory = 0;
+            
+        snap.segments = vco.segments;
+        snap.hatches = vco.hatches;
+        
+        return snap;
+    }
+    
+    core core_clone(snapshot const& snap)
+    {
+        core vco = core_create(snap.stack_size, snap.heap_size, snap.segments_size, snap.hatches_size);
+        vco.base = snap.base;
+        
+        std::copy_n(snap.segments, snap.segments_size, vco.segments);
+        std::copy_n(snap.hatches, snap.hatches_size, vco.hatches);
+        for (uint32_t i = 0; i < vco.hatches_size; ++i)
+            vco.hatch_entries[i] = vco.hatches[i]->entry;
+            
+        core_restore(vco, snap);
+        
+        return vco;
+    }
+    
+    void core_restore(core& vco, snapshot const& snap)
+    {
+        if (vco.stack_size != snap.stack_size || vco.heap_size != snap.heap_size)
+            throw std::logic_error("vm::core_restore: the core's memory doesn't match the snapshot's");
+            
+        std::copy_n(snap.registers, REG_COUNT, vco.registers);
+        std::copy_n(snap.memory, snap.stack_used, vco.stack);
+        std::copy_n(snap.memory + snap.stack_used, snap.heap_size, vco.stack + vco.stack_size);
+    }
+    
+    void core_free_snapshot(snapshot& snap)
+    {
+        if (snap.memory)
+            delete[] snap.memory;
+        snap.memory = 0;
+        snap.stack_used = 0;
+        snap.stack_size = 0;
+        snap.heap_size = 0;
+        snap.segments = 0;
+        snap.segments_size = 0;
+        snap.hatches = 0;
+        snap.hatches_size = 0;
+    }
+    
+    void core_call(core& vco, uint32_t seg, uint32_t entry, uint32_t const* args, uint32_t args_size)
+    {
+        if (seg >= vco.segments_size)
+            throw std::logic_error("vm::core_call: invalid segment address");
+        if (entry >= vco.segments[seg]->size)
+            throw std::logic_error("vm::core_call: invalid program address");
+        if (args_size > vco.stack_size || vco.stack_size - args_size < CALL_FRAME_SIZE)
+            throw std::logic_error("vm::core_call: stack overflow");
+            
+        core_reset(vco);
+        for (uint32_t i = REG_CODE_R0; i <= REG_CODE_R9; ++i)
+            vco.registers[i] = 0;
+        vco.registers[REG_CODE_RV] = 0;
+        
+        // Arguments are pushed right to left
+        uint32_t* stack = vco.stack;
+        for (uint32_t i = args_size; i > 0; --i)
+            *stack++ = args[i - 1];
+            
+        // Then comes a frame returning past the end of the segment, where
+        //   the run stops, with no saved registers
+        for (uint32_t i = REG_CODE_R0; i <= REG_CODE_R9; ++i)
+            *stack++ = 0;
+        *stack++ = 0;
+        *stack++ = PSR_FRAME;
+        *stack++ = vco.segments[seg]->size;
+        *stack++ = seg;
+        
+        vco.registers[REG_CODE_SEG] = seg;
+        vco.registers[REG_CODE_PC] = entry;
+        vco.registers[REG_CODE_SP] = args_size + CALL_FRAME_SIZE;
+        vco.registers[REG_CODE_AB] = args_size - 1;
+    }
+    
     void core_run(core& vco)
     {
-        while (vco.registers[REG_CODE_PC] < vco.segments[vco.registers[REG_CODE_SEG]]->size &&
-               !(vco.registers[REG_CODE_PSR] & PSR_FLAG_HALT))
+        int64_t budget = INT64_MAX;
+        run_checked<false>(vco, budget);
+    }
+    
+    void core_run_trusted(core& vco)
+    {
+        int64_t budget = INT64_MAX;
+        run_trusted<false>(vco, budget);
+    }
+    
+    uint32_t core_run_for(core& vco, uint64_t budget, std::string* fault)
+    {
+        return run_for<run_checked<true> >(vco, budget, fault);
+    }
+    
+    uint32_t core_run_trusted_for(core& vco, uint64_t budget, std::string* fault)
+    {
+        return run_for<run_trusted<true> >(vco, budget, fault);
+    }
+    
+    uint32_t core_run_sampled(core& vco, uint64_t& budget, std::string* fault)
+    {
+        return run_for<run_sampled>(vco, budget, fault);
+    }
+    
+    void core_run_profiled(core& vco, profile& prof)
+    {
+        int64_t budget = INT64_MAX;
+        run_prepare(vco);
+        
+        try
         {
-            execute(vco);
+            run<RUN_PROFILED, false>(vco, budget, &prof);
         }
+        catch (...)
+        {
+            profile_stop(prof);
+            throw;
+        }
+        profile_stop(prof);
         
-        vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+        if (core_done(vco))
+            vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+    }
+    
+    void core_run_to_native(core& vco, int64_t& budget)
+    {
+        run<RUN_UNCOMPILED, true>(vco, budget, 0);
+    }
+    
+    void core_suspend(core& vco)
+    {
+        vco.registers[REG_CODE_PSR] |= PSR_FLAG_WAIT;
+    }
+    
+    void core_resume(core& vco, uint32_t rv)
+    {
+        if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT))
+            throw std::logic_error("vm::core_resume: core is not suspended");
+            
+        vco.registers[REG_CODE_RV] = rv;
+        vco.registers[REG_CODE_PSR] &= ~PSR_FLAG_WAIT;
+    }
+    
+    void core_step(core& vco)
+    {
+        segment* seg = vco.segments[vco.registers[REG_CODE_SEG]];
+        if (vco.registers[REG_CODE_PC] >= seg->size)
+            return;
+            
+        if (!seg->code)
+            seg->code = decoder_decode(*seg);
+            
+        decoded_instruction const* ins = seg->code + vco.registers[REG_CODE_PC];
+        
+        vco.registers[REG_CODE_IR] = ins->instr;
+        vco.registers[REG_CODE_PC] = ins->next;
+        
+        execute<false>(vco, ins, ins->handler);
     }
     
     void core_register_dump(core& vco, std::ostream& os)
@@ -713,6 +1343,8 @@ namespace bolt { namespace vm
         core_dump_value(os, vco.registers[REG_CODE_PSR], false);
         if (vco.registers[REG_CODE_PSR] & PSR_FLAG_HALT)
             os << " HALT";
+        if (vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT)
+            os << " WAIT";
         if (vco.registers[REG_CODE_PSR] & PSR_FLAG_N)
             os << " N";
         if (vco.registers[REG_CODE_PSR] & PSR_FLAG_Z)
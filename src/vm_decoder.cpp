@@ -0,0 +1,495 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bolt/vm_decoder.h"
+#include <vector>
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Mark an instruction as faulty.
+    //! Returns false so it can be used as a return value for the functions below.
+    static bool decoder_fault(decoded_instruction& ins, uint32_t handler, char const* fault)
+    {
+        ins.handler = handler;
+        ins.fault = fault;
+        return false;
+    }
+    
+    //! Fetch the next operand word, checking the segment bounds.
+    //! Returns 0 if past the end of the segment.
+    static uint32_t* decoder_fetch_word(segment const& seg, uint32_t& pc)
+    {
+        if (pc >= seg.size)
+            return 0;
+            
+        return seg.buffer + pc++;
+    }
+    
+    //! Decode an operand based on its code, value, indirection and offset bits.
+    //! This consumes the operand words exactly as resolve_operand used to, and
+    //!   returns false (having marked the instruction faulty) on errors.
+    static bool decoder_decode_operand(segment const& seg, uint32_t& pc, decoded_instruction& ins,
+                                       decoded_operand& op, uint32_t code, uint32_t val, bool ind, bool off)
+    {
+        op.kind = OPK_NONE;
+        op.reg = 0;
+        op.offset = 0;
+        op.proven = 0;
+        op.imm = 0;
+        
+        switch (code)
+        {
+            case OP_CODE_NONE:
+                return true;
+                
+            case OP_CODE_REG:
+                // Invalid registers silently resolve to no operand
+                if (val >= REG_COUNT)
+                    return true;
+                    
+                op.reg = val;
+                op.kind = ind ? OPK_REG_IND : OPK_REG;
+                break;
+                
+            case OP_CODE_IMM:
+                op.imm = decoder_fetch_word(seg, pc);
+                if (!op.imm)
+                    return decoder_fault(ins, H_CODE_FETCH, "vm::fetch_word: PC out of bounds");
+                    
+                op.kind = ind ? OPK_IMM_IND : OPK_IMM;
+                break;
+                
+            default:
+                return decoder_fault(ins, H_CODE_BAD, "vm::decode_operand: invalid operand code");
+        }
+        
+        // The offset bit is ignored if the indirection bit is not set
+        if (ind && off)
+        {
+            uint32_t* offset = decoder_fetch_word(seg, pc);
+            if (!offset)
+                return decoder_fault(ins, H_CODE_FETCH, "vm::fetch_word: PC out of bounds");
+                
+            op.offset = (int32_t) *offset;
+        }
+        
+        return true;
+    }
+    
+    //! Decode the A operand.
+    static bool decoder_decode_A(segment const& seg, uint32_t& pc, decoded_instruction& ins)
+    {
+        uint32_t code = (ins.instr & OP_A_CODE) >> OP_A_CODE_SHIFT;
+        uint32_t val = (ins.instr & OP_A_VAL) >> OP_A_VAL_SHIFT;
+        bool ind = ins.instr & OP_A_IND;
+        bool off = ins.instr & OP_A_OFF;
+        
+        return decoder_decode_operand(seg, pc, ins, ins.a, code, val, ind, off);
+    }
+    
+    //! Decode the B operand.
+    static bool decoder_decode_B(segment const& seg, uint32_t& pc, decoded_instruction& ins)
+    {
+        uint32_t code = (ins.instr & OP_B_CODE) >> OP_B_CODE_SHIFT;
+        uint32_t val = (ins.instr & OP_B_VAL) >> OP_B_VAL_SHIFT;
+        bool ind = ins.instr & OP_B_IND;
+        bool off = ins.instr & OP_B_OFF;
+        
+        return decoder_decode_operand(seg, pc, ins, ins.b, code, val, ind, off);
+    }
+    
+    //! The maximum number of words an instruction spans : its own word, and
+    //!   two operands with their offset words.
+    enum : uint32_t
+    {
+        DECODER_MAX_SIZE = 5
+    };
+    
+    //! Map an instruction code to its handler code.
+    //! Returns H_CODE_BAD if the code is not part of the instruction set.
+    static uint32_t decoder_find_handler(uint32_t icode)
+    {
+        //! This macro defines the behavior of the declarations in vm_instructions.inc,
+        //!   here we map each I_CODE_* to its H_CODE_* counterpart.
+        #define DECL_INSTR(group, name, offset, f, a, b) \
+            case I_CODE_ ## name: \
+                return H_CODE_ ## name;
+                
+        switch (icode)
+        {
+            #include "bolt/vm_instructions.inc"
+            
+            default:
+                return H_CODE_BAD;
+        }
+        
+        #undef DECL_INSTR
+    }
+    
+    //! Decode the instruction starting at the given location.
+    //! Only the operands that the interpreter actually reads for this instruction
+    //!   are consumed, so that the next PC is the same as with the raw encoding.
+    static void decoder_decode_at(segment const& seg, uint32_t pc, decoded_instruction& ins)
+    {
+        uint32_t start = pc;
+        ins.instr = seg.buffer[pc++];
+        ins.fault = 0;
+        ins.depth = 0;
+        ins.room = ROOM_UNTRUSTED;
+        ins.saves = SAVE_ALL;
+        ins.a.kind = OPK_NONE;
+        ins.a.proven = 0;
+        ins.b.kind = OPK_NONE;
+        ins.b.proven = 0;
+        
+        uint32_t icode = decoder_icode(ins);
+        uint32_t igroup = (icode & I_GROUP_MASK) >> I_GROUP_SHIFT;
+        
+        ins.handler = decoder_find_handler(icode);
+        
+        switch (igroup)
+        {
+            case I_GROUP_SYS:
+                if (ins.handler == H_CODE_BAD)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_sys: invalid instruction code");
+                else if (ins.handler == H_CODE_DMO && decoder_decode_A(seg, pc, ins))
+                {
+                    if (ins.a.kind == OPK_NONE)
+                        decoder_fault(ins, H_CODE_BAD, "vm::execute_sys: DMO expects an operand");
+                }
+                break;
+                
+            case I_GROUP_MEM:
+                if (!decoder_decode_A(seg, pc, ins) || !decoder_decode_B(seg, pc, ins))
+                    break;
+                    
+                if (ins.handler == H_CODE_BAD)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_mem: invalid instruction code");
+                else if (ins.handler == H_CODE_PUSH && ins.a.kind == OPK_NONE)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_mem: expected an operand in PUSH");
+                else if (ins.handler == H_CODE_MOV && (ins.a.kind == OPK_NONE || ins.b.kind == OPK_NONE))
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_mem: expected two operands in MOV");
+                else if (ins.handler >= H_CODE_MCPY && ins.handler <= H_CODE_MCMP &&
+                         (ins.a.kind == OPK_NONE || ins.b.kind == OPK_NONE))
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_mem: expected two operands in bulk instruction");
+                else if (seg.read_only && (icode == I_CODE_POP || icode == I_CODE_MOV) && ins.a.kind == OPK_IMM)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_mem: write to an immediate in read-only code");
+                break;
+                
+            case I_GROUP_FLOW:
+                if (!decoder_decode_A(seg, pc, ins))
+                    break;
+                    
+                // B is only ever read by CALL
+                if (ins.handler == H_CODE_CALL && !decoder_decode_B(seg, pc, ins))
+                    break;
+                    
+                if (ins.handler == H_CODE_BAD)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_flow: invalid instruction code");
+                else if (ins.handler == H_CODE_CALL && ins.a.kind == OPK_NONE)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_flow: expected at least one operand in CALL");
+                else if (ins.handler == H_CODE_DIVE && ins.a.kind == OPK_NONE)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_flow: expected at least one operand in DIVE");
+                else if (ins.handler != H_CODE_CALL && ins.handler != H_CODE_DIVE &&
+                         ins.handler != H_CODE_RET && ins.a.kind == OPK_NONE)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_flow: expected an operand in jump instruction");
+                break;
+                
+            case I_GROUP_ARITH:
+                if (ins.handler == H_CODE_BAD)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_arith: invalid instruction code");
+                break;
+                
+            case I_GROUP_VEC:
+                if (!decoder_decode_A(seg, pc, ins))
+                    break;
+                    
+                // B is read by all but the reductions of a single run, which
+                //   come last in vm_instructions.inc
+                if (ins.handler < H_CODE_VISUM && !decoder_decode_B(seg, pc, ins))
+                    break;
+                    
+                if (ins.handler == H_CODE_BAD)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_vec: invalid instruction code");
+                else if (ins.a.kind == OPK_NONE)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_vec: expected an operand in vector instruction");
+                else if (ins.handler < H_CODE_VISUM && ins.b.kind == OPK_NONE)
+                    decoder_fault(ins, H_CODE_BAD, "vm::execute_vec: expected two operands in vector instruction");
+                break;
+                
+            default:
+                decoder_fault(ins, H_CODE_BAD, "vm::execute: invalid instruction group");
+                break;
+        }
+        
+        ins.next = pc;
+        ins.size = pc - start;
+    }
+    
+    //! A superinstruction pattern, see vm_fusions.inc.
+    struct decoder_fusion
+    {
+        uint32_t handler;
+        uint32_t sequence[4];
+    };
+    
+    //! This macro defines the behavior of the declarations in vm_fusions.inc,
+    //!   here we build the table of the patterns to look for.
+    #define DECL_FUSION(name, shape, i0, i1, i2, i3) \
+        { H_CODE_ ## name, { H_CODE_ ## i0, H_CODE_ ## i1, H_CODE_ ## i2, H_CODE_ ## i3 } },
+        
+    static decoder_fusion const decoder_fusions[] =
+    {
+        #include "bolt/vm_fusions.inc"
+    };
+    
+    #undef DECL_FUSION
+    
+    //! Check if the instruction sequence starting at the given location matches
+    //!   a fusion pattern (the following entries may have been fused already).
+    //! Faulty instructions never match, as they have the BAD or FETCH handler.
+    static bool decoder_match(decoded_instruction const* code, uint32_t size, uint32_t pc,
+                              decoder_fusion const& fusion)
+    {
+        for (int i = 0; i < 4 && fusion.sequence[i] != H_CODE_END; ++i)
+        {
+            if (pc >= size || decoder_base_handler(code[pc]) != fusion.sequence[i])
+                return false;
+                
+            pc = code[pc].next;
+        }
+        
+        return true;
+    }
+    
+    //! Give the instruction at the given location the fused handler of the
+    //!   sequence it starts, if any, or its own handler.
+    //! Only the handler of the first entry is changed, so that patterns are
+    //!   always matched against the original handlers of the following entries.
+    static void decoder_fuse_at(decoded_instruction* code, uint32_t size, uint32_t pc)
+    {
+        uint32_t fusions_size = sizeof(decoder_fusions) / sizeof(decoder_fusion);
+        
+        code[pc].handler = decoder_base_handler(code[pc]);
+        for (uint32_t i = 0; i < fusions_size; ++i)
+        {
+            if (decoder_match(code, size, pc, decoder_fusions[i]))
+            {
+                code[pc].handler = decoder_fusions[i].handler;
+                break;
+            }
+        }
+    }
+    
+    //! Replace the handler of each instruction starting a fusible sequence
+    //!   by the matching fused handler.
+    static void decoder_fuse(decoded_instruction* code, uint32_t size)
+    {
+        for (uint32_t pc = 0; pc < size; ++pc)
+            decoder_fuse_at(code, size, pc);
+    }
+    
+    //! Get the R0-R9 registers a function may write to, given its entry
+    //!   (see decoder_frames).
+    static uint32_t decoder_clobbers(segment const& seg, uint32_t entry)
+    {
+        std::vector<bool> seen(seg.size, false);
+        std::vector<uint32_t> pending(1, entry);
+        uint32_t clobbers = 0;
+        
+        while (!pending.empty())
+        {
+            uint32_t pc = pending.back();
+            pending.pop_back();
+            if (pc >= seg.size || seen[pc])
+                continue;
+            seen[pc] = true;
+            
+            // Faulty instructions never go on
+            decoded_instruction const& ins = seg.code[pc];
+            if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+                continue;
+                
+            uint32_t icode = decoder_icode(ins);
+            uint32_t igroup = (icode & I_GROUP_MASK) >> I_GROUP_SHIFT;
+            
+            if (icode == I_CODE_HALT || icode == I_CODE_RET)
+                continue;
+            if (icode == I_CODE_RST || icode == I_CODE_DIVE)
+                return SAVE_ALL;
+                
+            if ((icode == I_CODE_POP || icode == I_CODE_MOV) && ins.a.kind == OPK_REG)
+            {
+                if (ins.a.reg <= REG_CODE_R9)
+                    clobbers |= 1 << (ins.a.reg - REG_CODE_R0);
+                else if (ins.a.reg == REG_CODE_PC || ins.a.reg == REG_CODE_SEG || ins.a.reg == REG_CODE_SP)
+                    return SAVE_ALL;
+            }
+            
+            // Jumps (but calls, that come back here)
+            if (igroup == I_GROUP_FLOW && icode != I_CODE_CALL)
+            {
+                if (ins.a.kind != OPK_IMM)
+                    return SAVE_ALL;
+                pending.push_back(*ins.a.imm);
+                if (icode == I_CODE_JMP)
+                    continue;
+            }
+            
+            pending.push_back(ins.next);
+        }
+        
+        return clobbers;
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    decoded_instruction* decoder_decode(segment const& seg)
+    {
+        decoded_instruction* code = new decoded_instruction[seg.size + 1];
+        
+        // Decode an instruction at each location, see vm_decoder.h
+        for (uint32_t pc = 0; pc < seg.size; ++pc)
+            decoder_decode_at(seg, pc, code[pc]);
+            
+        // Then look for superinstructions, see vm_fusions.inc
+        decoder_fuse(code, seg.size);
+        
+        // Terminate the stream
+        code[seg.size].handler = H_CODE_END;
+        code[seg.size].instr = 0;
+        code[seg.size].next = seg.size;
+        code[seg.size].size = 1;
+        code[seg.size].depth = 0;
+        code[seg.size].room = ROOM_UNTRUSTED;
+        code[seg.size].saves = SAVE_ALL;
+        code[seg.size].a.kind = OPK_NONE;
+        code[seg.size].b.kind = OPK_NONE;
+        code[seg.size].fault = 0;
+        
+        return code;
+    }
+    
+    void decoder_free(decoded_instruction* code)
+    {
+        if (code)
+            delete[] code;
+    }
+    
+    uint32_t decoder_base_handler(decoded_instruction const& ins)
+    {
+        // Faulty instructions are never fused (see decoder_match)
+        if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+            return ins.handler;
+            
+        return decoder_find_handler(decoder_icode(ins));
+    }
+    
+    void decoder_patch(segment const& seg, uint32_t word)
+    {
+        decoded_instruction* code = seg.code;
+        if (!code || word >= seg.size)
+            return;
+            
+        // The entries spanning the word are decoded again : it is the
+        //   instruction word of its own entry, and may be an offset word
+        //   (which are inlined) of the previous ones
+        uint32_t first = word >= DECODER_MAX_SIZE - 1 ? word - (DECODER_MAX_SIZE - 1) : 0;
+        for (uint32_t pc = first; pc <= word; ++pc)
+            if (pc == word || pc + code[pc].size > word)
+                decoder_decode_at(seg, pc, code[pc]);
+                
+        // Then the sequences that may go through the word's entry are
+        //   matched again
+        first = word >= 3 * DECODER_MAX_SIZE ? word - 3 * DECODER_MAX_SIZE : 0;
+        for (uint32_t pc = first; pc <= word; ++pc)
+            decoder_fuse_at(code, seg.size, pc);
+    }
+    
+    bool decoder_is_self_modifying(segment const& seg)
+    {
+        for (uint32_t pc = 0; pc < seg.size; ++pc)
+        {
+            decoded_instruction const& ins = seg.code[pc];
+            uint32_t icode = decoder_icode(ins);
+            
+            if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+                continue;
+            if ((icode == I_CODE_POP || icode == I_CODE_MOV) && ins.a.kind == OPK_IMM)
+                return true;
+        }
+        
+        return false;
+    }
+    
+    void decoder_frames(core& vco)
+    {
+        std::vector<bool> self_modifying(vco.segments_size);
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+            self_modifying[i] = decoder_is_self_modifying(*vco.segments[i]);
+            
+        // The masks of the functions we already looked at, by entry
+        std::vector<std::vector<uint32_t> > clobbers(vco.segments_size);
+        
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment& seg = *vco.segments[i];
+            
+            // The targets of the calls may change at run time
+            if (self_modifying[i])
+                continue;
+                
+            for (uint32_t pc = 0; pc < seg.size; ++pc)
+            {
+                decoded_instruction& ins = seg.code[pc];
+                if (ins.handler != H_CODE_CALL)
+                    continue;
+                    
+                uint32_t target_seg = i;
+                uint32_t target;
+                if (ins.b.kind == OPK_NONE && ins.a.kind == OPK_IMM)
+                    target = *ins.a.imm;
+                else if (ins.a.kind == OPK_IMM && ins.b.kind == OPK_IMM)
+                {
+                    target_seg = *ins.a.imm;
+                    target = *ins.b.imm;
+                }
+                else
+                    continue;
+                    
+                if (target_seg >= vco.segments_size || self_modifying[target_seg] ||
+                    target >= vco.segments[target_seg]->size)
+                    continue;
+                    
+                std::vector<uint32_t>& masks = clobbers[target_seg];
+                if (masks.empty())
+                    masks.resize(vco.segments[target_seg]->size, ~0u);
+                if (masks[target] == ~0u)
+                    masks[target] = decoder_clobbers(*vco.segments[target_seg], target);
+                    
+                ins.saves = masks[target];
+            }
+        }
+    }
+} }
@@ -0,0 +1,1431 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bolt/vm_jit.h"
+#include "bolt/vm_decoder.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define BOLT_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+namespace bolt { namespace vm
+{
+    //! A block of executable memory, holding some of a segment's native code.
+    struct jit_chunk
+    {
+        uint8_t* buffer;
+        size_t size;
+    };
+    
+    //! The native code of a segment.
+    //! It is made of chunks, the first one being compiled along with the
+    //!   segment, and the next ones as the program's flow reaches locations
+    //!   that were not compiled yet (see jit_extend).
+    //! Each chunk starts with the entry stub (see jit_emit_stubs), that is
+    //!   called with the address to jump to, taken from the dispatch table.
+    //! The dispatch table holds the native address of each PC value, or null
+    //!   if the location was not compiled. Its entries are only set once, and
+    //!   the lock is held while compiling a chunk, as the native code may be
+    //!   shared by several cores running on different threads (see vm_pool.h).
+    struct jit_code
+    {
+        std::vector<jit_chunk> chunks;
+        
+        std::atomic<void*>* table;
+        uint32_t(*enter)(core* vco, void* target, int64_t* budget);
+        
+        std::mutex lock;
+    };
+    
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    #ifdef BOLT_JIT_X86_64
+    
+    //! Native code exit codes.
+    //!
+    //! JUMP: go on at PC (PC, SEG or PSR may have changed)
+    //! STEP: the instruction at PC must be run by the interpreter
+    enum : uint32_t
+    {
+        JIT_EXIT_JUMP,
+        JIT_EXIT_STEP
+    };
+    
+    //! The maximum number of chunks of a segment's native code : past it, the
+    //!   locations that were not compiled are left to the interpreter.
+    enum : uint32_t
+    {
+        JIT_MAX_CHUNKS = 64
+    };
+    
+    //! x86-64 registers.
+    //! Here is how the native code uses them :
+    //!   rbx: the core
+    //!   rbp: the budget (see jit_charge)
+    //!   r12: the core's stack (and heap) memory
+    //!   r13: the segment's dispatch table
+    //!   r14: the memory size (stack_size + heap_size)
+    //!   r15: the stack size
+    //!   the others are scratch registers.
+    enum : int
+    {
+        X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+        X86_R8,  X86_R9,  X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15
+    };
+    
+    //! x86-64 condition codes (as used by Jcc and SETcc).
+    enum : uint8_t
+    {
+        X86_CC_B  = 0x2,
+        X86_CC_AE = 0x3,
+        X86_CC_E  = 0x4,
+        X86_CC_NE = 0x5,
+        X86_CC_A  = 0x7,
+        X86_CC_NP = 0xB,
+        X86_CC_L  = 0xC,
+        X86_CC_LE = 0xE,
+        X86_CC_G  = 0xF
+    };
+    
+    //! x86-64 opcodes, in their "op r/m32, r32" (or "op r32, r/m32" for the
+    //!   _LOAD variants) forms.
+    enum : uint8_t
+    {
+        X86_ADD       = 0x01,
+        X86_ADD_LOAD  = 0x03,
+        X86_OR        = 0x09,
+        X86_AND       = 0x21,
+        X86_SUB       = 0x29,
+        X86_XOR       = 0x31,
+        X86_CMP       = 0x39,
+        X86_CMP_LOAD  = 0x3B,
+        X86_TEST      = 0x85,
+        X86_MOV       = 0x89,
+        X86_MOV_LOAD  = 0x8B
+    };
+    
+    //! x86-64 group 1 opcode extensions (op r/m32, imm32).
+    enum : uint8_t
+    {
+        X86_EXT_ADD = 0,
+        X86_EXT_OR  = 1,
+        X86_EXT_AND = 4,
+        X86_EXT_SUB = 5,
+        X86_EXT_CMP = 7
+    };
+    
+    //! A relative (32-bit) jump to patch, once the native location of
+    //!   its target PC is known.
+    struct jit_fixup
+    {
+        size_t at;
+        uint32_t pc;
+    };
+    
+    //! Compilation state (of a chunk).
+    //! The labels array holds the native offset of each PC in the chunk (or -1).
+    //! The pending array is the list of PCs that are still to be compiled.
+    //! The table is the segment's dispatch table, that holds the locations
+    //!   compiled in the previous chunks.
+    struct jit_compiler
+    {
+        segment const* seg;
+        std::vector<uint8_t> code;
+        std::atomic<void*> const* table;
+        
+        std::vector<int64_t> labels;
+        std::vector<uint32_t> pending;
+        
+        std::vector<jit_fixup> jumps;
+        std::vector<jit_fixup> colds;
+        
+        size_t exit_jump;
+        size_t epilogue;
+        size_t dispatch;
+    };
+    
+    //!
+    //! Machine code emission
+    //!
+    
+    static void x86_byte(jit_compiler& jc, uint8_t value)
+    {
+        jc.code.push_back(value);
+    }
+    
+    static void x86_dword(jit_compiler& jc, uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+            x86_byte(jc, (value >> (8 * i)) & 0xFF);
+    }
+    
+    static void x86_qword(jit_compiler& jc, uint64_t value)
+    {
+        x86_dword(jc, value & 0xFFFFFFFF);
+        x86_dword(jc, value >> 32);
+    }
+    
+    //! Emit a REX prefix, if needed.
+    static void x86_rex(jit_compiler& jc, bool wide, int reg, int index, int base)
+    {
+        uint8_t rex = 0x40;
+        if (wide)
+            rex |= 0x08;
+        if (reg & 8)
+            rex |= 0x04;
+        if (index & 8)
+            rex |= 0x02;
+        if (base & 8)
+            rex |= 0x01;
+            
+        if (rex != 0x40)
+            x86_byte(jc, rex);
+    }
+    
+    //! op rm, reg (both registers)
+    static void x86_rr(jit_compiler& jc, uint8_t op, int reg, int rm)
+    {
+        x86_rex(jc, false, reg, 0, rm);
+        x86_byte(jc, op);
+        x86_byte(jc, 0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+    
+    //! op rm, imm32 (group 1)
+    static void x86_ri(jit_compiler& jc, uint8_t ext, int rm, uint32_t imm)
+    {
+        x86_rex(jc, false, 0, 0, rm);
+        x86_byte(jc, 0x81);
+        x86_byte(jc, 0xC0 | ext << 3 | (rm & 7));
+        x86_dword(jc, imm);
+    }
+    
+    //! test rm, imm32
+    static void x86_test_ri(jit_compiler& jc, int rm, uint32_t imm)
+    {
+        x86_rex(jc, false, 0, 0, rm);
+        x86_byte(jc, 0xF7);
+        x86_byte(jc, 0xC0 | (rm & 7));
+        x86_dword(jc, imm);
+    }
+    
+    //! op reg, [rbx + disp32], that is a field of the core
+    static void x86_core(jit_compiler& jc, uint8_t op, int reg, uint32_t disp, bool wide = false)
+    {
+        x86_rex(jc, wide, reg, 0, X86_RBX);
+        x86_byte(jc, op);
+        x86_byte(jc, 0x80 | (reg & 7) << 3 | X86_RBX);
+        x86_dword(jc, disp);
+    }
+    
+    //! op reg, [r12 + index * 4 + disp8], that is a word of the core's memory
+    static void x86_stack(jit_compiler& jc, uint8_t op, int reg, int index, int8_t disp)
+    {
+        x86_rex(jc, false, reg, index, X86_R12);
+        x86_byte(jc, op);
+        x86_byte(jc, 0x40 | (reg & 7) << 3 | 0x04);
+        x86_byte(jc, 0x80 | (index & 7) << 3 | (X86_R12 & 7));
+        x86_byte(jc, (uint8_t) disp);
+    }
+    
+    //! mov reg, imm32
+    static void x86_mov_imm(jit_compiler& jc, int reg, uint32_t imm)
+    {
+        x86_rex(jc, false, 0, 0, reg);
+        x86_byte(jc, 0xB8 + (reg & 7));
+        x86_dword(jc, imm);
+    }
+    
+    //! setcc reg8 (only for al, cl, dl and bl)
+    static void x86_setcc(jit_compiler& jc, uint8_t cc, int reg)
+    {
+        x86_byte(jc, 0x0F);
+        x86_byte(jc, 0x90 + cc);
+        x86_byte(jc, 0xC0 | reg);
+    }
+    
+    //! Patch a relative jump so that it lands at target.
+    static void x86_patch(jit_compiler& jc, size_t at, size_t target)
+    {
+        uint32_t rel = (uint32_t) (target - (at + 4));
+        for (int i = 0; i < 4; ++i)
+            jc.code[at + i] = (rel >> (8 * i)) & 0xFF;
+    }
+    
+    //! jmp rel32, returning the location of the offset.
+    static size_t x86_jmp(jit_compiler& jc)
+    {
+        x86_byte(jc, 0xE9);
+        x86_dword(jc, 0);
+        return jc.code.size() - 4;
+    }
+    
+    //! jcc rel32, returning the location of the offset.
+    static size_t x86_jcc(jit_compiler& jc, uint8_t cc)
+    {
+        x86_byte(jc, 0x0F);
+        x86_byte(jc, 0x80 + cc);
+        x86_dword(jc, 0);
+        return jc.code.size() - 4;
+    }
+    
+    //!
+    //! Templates building blocks
+    //!
+    
+    //! Offset of a register in the core structure.
+    static uint32_t jit_register(uint32_t reg)
+    {
+        return offsetof(core, registers) + reg * sizeof(uint32_t);
+    }
+    
+    static void jit_load_register(jit_compiler& jc, int x86_reg, uint32_t reg)
+    {
+        x86_core(jc, X86_MOV_LOAD, x86_reg, jit_register(reg));
+    }
+    
+    static void jit_store_register(jit_compiler& jc, uint32_t reg, int x86_reg)
+    {
+        x86_core(jc, X86_MOV, x86_reg, jit_register(reg));
+    }
+    
+    //! mov dword [rbx + reg], imm32
+    static void jit_store_register_imm(jit_compiler& jc, uint32_t reg, uint32_t imm)
+    {
+        x86_byte(jc, 0xC7);
+        x86_byte(jc, 0x80 | X86_RBX);
+        x86_dword(jc, jit_register(reg));
+        x86_dword(jc, imm);
+    }
+    
+    //! Charge the budget with the given number of words.
+    //! The native code charges it when the program's flow goes backward
+    //!   (backward constant jumps, with the words they loop over, and
+    //!   computed jumps and returns, with a word), and leaves when it is
+    //!   exhausted : a run can't go on for long without doing so, as for
+    //!   the interpreter (see core_run_for).
+    //! sub qword [rbp], words
+    static void jit_charge(jit_compiler& jc, uint32_t words)
+    {
+        x86_byte(jc, 0x48);
+        x86_byte(jc, 0x81);
+        x86_byte(jc, 0x6D);
+        x86_byte(jc, 0x00);
+        x86_dword(jc, words);
+    }
+    
+    //! Jump to the given PC's native code (compiling it later if needed).
+    static void jit_jump_label(jit_compiler& jc, size_t at, uint32_t pc)
+    {
+        jit_fixup fix = { at, pc };
+        jc.jumps.push_back(fix);
+        jc.pending.push_back(pc);
+    }
+    
+    //! Leave the native code if cc holds, for the interpreter to run the
+    //!   instruction at pc.
+    //! This is used to check anything that would fault at run-time : the
+    //!   checks of an instruction are always done before any side effect, so
+    //!   the interpreter can run it again from scratch and raise the error.
+    static void jit_check(jit_compiler& jc, uint8_t cc, uint32_t pc)
+    {
+        jit_fixup fix = { x86_jcc(jc, cc), pc };
+        jc.colds.push_back(fix);
+    }
+    
+    //! Leave the native code unconditionally, for the interpreter to run
+    //!   the instruction at pc.
+    static void jit_step(jit_compiler& jc, uint32_t pc)
+    {
+        jit_fixup fix = { x86_jmp(jc), pc };
+        jc.colds.push_back(fix);
+    }
+    
+    //! Leave the native code, going on at the given PC.
+    //! PC and IR are not kept up to date by native code, so they are set here.
+    static void jit_exit(jit_compiler& jc, decoded_instruction const& ins, uint32_t pc)
+    {
+        jit_store_register_imm(jc, REG_CODE_PC, pc);
+        jit_store_register_imm(jc, REG_CODE_IR, ins.instr);
+        x86_patch(jc, x86_jmp(jc), jc.exit_jump);
+    }
+    
+    //! Jump to a constant PC.
+    //! Backward jumps charge the budget, and leave if it is exhausted.
+    static void jit_goto(jit_compiler& jc, decoded_instruction const& ins, uint32_t pc)
+    {
+        if (pc >= jc.seg->size)
+            jit_exit(jc, ins, pc);
+        else if (pc < ins.next)
+        {
+            jit_charge(jc, ins.next - pc);
+            jit_jump_label(jc, x86_jcc(jc, X86_CC_G), pc);
+            jit_exit(jc, ins, pc);
+        }
+        else
+            jit_jump_label(jc, x86_jmp(jc), pc);
+    }
+    
+    //! Jump to a constant PC if cc holds.
+    static void jit_branch(jit_compiler& jc, decoded_instruction const& ins, uint8_t cc, uint32_t pc)
+    {
+        if (pc < jc.seg->size && pc >= ins.next)
+            jit_jump_label(jc, x86_jcc(jc, cc), pc);
+        else
+        {
+            // Inverting a condition code is flipping its lowest bit
+            size_t skip = x86_jcc(jc, cc ^ 1);
+            jit_goto(jc, ins, pc);
+            x86_patch(jc, skip, jc.code.size());
+        }
+    }
+    
+    //! Jump to the PC value in the PC register, through the dispatch table.
+    static void jit_dispatch(jit_compiler& jc, decoded_instruction const& ins)
+    {
+        jit_store_register_imm(jc, REG_CODE_IR, ins.instr);
+        x86_patch(jc, x86_jmp(jc), jc.dispatch);
+    }
+    
+    //! Load a register's value.
+    //! PC and IR are not kept up to date by native code, but their values
+    //!   are known at compile time.
+    static void jit_register_value(jit_compiler& jc, decoded_instruction const& ins, uint32_t reg, int x86_reg)
+    {
+        if (reg == REG_CODE_PC)
+            x86_mov_imm(jc, x86_reg, ins.next);
+        else if (reg == REG_CODE_IR)
+            x86_mov_imm(jc, x86_reg, ins.instr);
+        else
+            jit_load_register(jc, x86_reg, reg);
+    }
+    
+    //! Compute an indirect operand's address, checking that it is in the
+    //!   core's memory (see mem_access in vm_core.cpp).
+    static void jit_operand_address(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins,
+                                    decoded_operand const& op, int x86_reg)
+    {
+        if (op.kind == OPK_IMM_IND)
+            x86_mov_imm(jc, x86_reg, *op.imm + op.offset);
+        else
+        {
+            jit_register_value(jc, ins, op.reg, x86_reg);
+            if (op.offset)
+                x86_ri(jc, X86_EXT_ADD, x86_reg, op.offset);
+        }
+        
+        x86_rr(jc, X86_CMP, X86_R14, x86_reg);
+        jit_check(jc, X86_CC_A, pc);
+    }
+    
+    //! Load an operand's value.
+    static void jit_operand_value(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins,
+                                  decoded_operand const& op, int x86_reg)
+    {
+        switch (op.kind)
+        {
+            case OPK_REG:
+                jit_register_value(jc, ins, op.reg, x86_reg);
+                break;
+                
+            case OPK_IMM:
+                x86_mov_imm(jc, x86_reg, *op.imm);
+                break;
+                
+            default:
+                jit_operand_address(jc, pc, ins, op, x86_reg);
+                x86_stack(jc, X86_MOV_LOAD, x86_reg, x86_reg, 0);
+                break;
+        }
+    }
+    
+    //! Write to a register.
+    //! Writing to PC, SEG or PSR may change the program flow, in which case
+    //!   this returns false.
+    static bool jit_set_register(jit_compiler& jc, decoded_instruction const& ins, uint32_t reg, int x86_reg)
+    {
+        jit_store_register(jc, reg, x86_reg);
+        
+        if (reg == REG_CODE_PC)
+        {
+            jit_dispatch(jc, ins);
+            return false;
+        }
+        else if (reg == REG_CODE_SEG || reg == REG_CODE_PSR)
+        {
+            jit_exit(jc, ins, ins.next);
+            return false;
+        }
+        
+        return true;
+    }
+    
+    //!
+    //! Instruction templates
+    //!
+    //! Each one returns true if the program flow may go on with
+    //!   the next instruction.
+    //!
+    
+    static bool jit_push(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins)
+    {
+        jit_operand_value(jc, pc, ins, ins.a, X86_RCX);
+        
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_rr(jc, X86_CMP, X86_R15, X86_RAX);
+        jit_check(jc, X86_CC_AE, pc);
+        
+        x86_stack(jc, X86_MOV, X86_RCX, X86_RAX, 0);
+        x86_ri(jc, X86_EXT_ADD, X86_RAX, 1);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        return true;
+    }
+    
+    static bool jit_pop(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins)
+    {
+        bool indirect = ins.a.kind == OPK_REG_IND || ins.a.kind == OPK_IMM_IND;
+        if (indirect)
+            jit_operand_address(jc, pc, ins, ins.a, X86_R8);
+            
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_rr(jc, X86_TEST, X86_RAX, X86_RAX);
+        jit_check(jc, X86_CC_E, pc);
+        
+        x86_ri(jc, X86_EXT_SUB, X86_RAX, 1);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, 0);
+        
+        if (indirect)
+            x86_stack(jc, X86_MOV, X86_RCX, X86_R8, 0);
+        else if (ins.a.kind == OPK_REG)
+            return jit_set_register(jc, ins, ins.a.reg, X86_RCX);
+        return true;
+    }
+    
+    static bool jit_dup(jit_compiler& jc, uint32_t pc)
+    {
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_rr(jc, X86_TEST, X86_RAX, X86_RAX);
+        jit_check(jc, X86_CC_E, pc);
+        x86_rr(jc, X86_CMP, X86_R15, X86_RAX);
+        jit_check(jc, X86_CC_AE, pc);
+        
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, -4);
+        x86_stack(jc, X86_MOV, X86_RCX, X86_RAX, 0);
+        x86_ri(jc, X86_EXT_ADD, X86_RAX, 1);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        return true;
+    }
+    
+    static bool jit_mov(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins)
+    {
+        if (ins.a.kind != OPK_REG)
+            jit_operand_address(jc, pc, ins, ins.a, X86_R8);
+        jit_operand_value(jc, pc, ins, ins.b, X86_RCX);
+        
+        if (ins.a.kind == OPK_REG)
+            return jit_set_register(jc, ins, ins.a.reg, X86_RCX);
+            
+        x86_stack(jc, X86_MOV, X86_RCX, X86_R8, 0);
+        return true;
+    }
+    
+    static bool jit_load(jit_compiler& jc, uint32_t pc)
+    {
+        // Check for underflow, then for overflow when pushing back
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_rr(jc, X86_TEST, X86_RAX, X86_RAX);
+        jit_check(jc, X86_CC_E, pc);
+        x86_ri(jc, X86_EXT_SUB, X86_RAX, 1);
+        x86_rr(jc, X86_CMP, X86_R15, X86_RAX);
+        jit_check(jc, X86_CC_AE, pc);
+        
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, 0);
+        x86_rr(jc, X86_CMP, X86_R14, X86_RCX);
+        jit_check(jc, X86_CC_A, pc);
+        
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RCX, 0);
+        x86_stack(jc, X86_MOV, X86_RCX, X86_RAX, 0);
+        return true;
+    }
+    
+    static bool jit_stor(jit_compiler& jc, uint32_t pc)
+    {
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_ri(jc, X86_EXT_CMP, X86_RAX, 2);
+        jit_check(jc, X86_CC_B, pc);
+        
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, -4);
+        x86_rr(jc, X86_CMP, X86_R14, X86_RCX);
+        jit_check(jc, X86_CC_A, pc);
+        
+        x86_stack(jc, X86_MOV_LOAD, X86_RDX, X86_RAX, -8);
+        x86_stack(jc, X86_MOV, X86_RDX, X86_RCX, 0);
+        x86_ri(jc, X86_EXT_SUB, X86_RAX, 2);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        return true;
+    }
+    
+    //! See the calling convention in vm_handlers.inc.
+    static bool jit_call(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins)
+    {
+        bool is_long = ins.b.kind != OPK_NONE;
+        bool is_constant = !is_long && ins.a.kind == OPK_IMM;
+        
+        if (!is_constant)
+            jit_operand_value(jc, pc, ins, ins.a, X86_R10);
+        if (is_long)
+        {
+            jit_operand_value(jc, pc, ins, ins.b, X86_R11);
+            x86_core(jc, X86_CMP_LOAD, X86_R10, offsetof(core, segments_size));
+            jit_check(jc, X86_CC_AE, pc);
+        }
+        
+        // Check that the 14 words of the frame fit in the stack
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_rr(jc, X86_CMP, X86_R15, X86_RAX);
+        jit_check(jc, X86_CC_AE, pc);
+        x86_rr(jc, X86_MOV, X86_R15, X86_RDX);
+        x86_rr(jc, X86_SUB, X86_RAX, X86_RDX);
+        x86_ri(jc, X86_EXT_CMP, X86_RDX, 14);
+        jit_check(jc, X86_CC_B, pc);
+        
+        // Only save the registers the callee may write to, see the calling
+        //   convention in vm_handlers.inc
+        uint32_t skips = ~ins.saves & SAVE_ALL;
+        int8_t disp = 0;
+        for (uint32_t i = REG_CODE_R0; i <= REG_CODE_R9; ++i, disp += 4)
+        {
+            if (skips & 1 << (i - REG_CODE_R0))
+                continue;
+            jit_load_register(jc, X86_RDX, i);
+            x86_stack(jc, X86_MOV, X86_RDX, X86_RAX, disp);
+        }
+        jit_load_register(jc, X86_RDX, REG_CODE_AB);
+        x86_stack(jc, X86_MOV, X86_RDX, X86_RAX, disp);
+        jit_load_register(jc, X86_RDX, REG_CODE_PSR);
+        x86_ri(jc, X86_EXT_AND, X86_RDX, ~PSR_FRAME);
+        if (skips)
+            x86_ri(jc, X86_EXT_OR, X86_RDX, skips << PSR_FRAME_SHIFT);
+        x86_stack(jc, X86_MOV, X86_RDX, X86_RAX, disp + 4);
+        
+        // mov dword [r12 + rax * 4 + disp8], next
+        x86_rex(jc, false, 0, X86_RAX, X86_R12);
+        x86_byte(jc, 0xC7);
+        x86_byte(jc, 0x44);
+        x86_byte(jc, 0x84);
+        x86_byte(jc, disp + 8);
+        x86_dword(jc, ins.next);
+        
+        jit_load_register(jc, X86_RDX, REG_CODE_SEG);
+        x86_stack(jc, X86_MOV, X86_RDX, X86_RAX, disp + 12);
+        
+        // AB = SP - 1, then SP += 14
+        x86_rr(jc, X86_MOV, X86_RAX, X86_RDX);
+        x86_ri(jc, X86_EXT_SUB, X86_RDX, 1);
+        jit_store_register(jc, REG_CODE_AB, X86_RDX);
+        x86_ri(jc, X86_EXT_ADD, X86_RAX, 14);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        
+        // The return address is only reachable dynamically
+        jc.pending.push_back(ins.next);
+        
+        if (is_constant)
+            jit_goto(jc, ins, *ins.a.imm);
+        else if (is_long)
+        {
+            jit_store_register(jc, REG_CODE_SEG, X86_R10);
+            jit_store_register(jc, REG_CODE_PC, X86_R11);
+            jit_store_register_imm(jc, REG_CODE_IR, ins.instr);
+            x86_patch(jc, x86_jmp(jc), jc.exit_jump);
+        }
+        else
+        {
+            jit_store_register(jc, REG_CODE_PC, X86_R10);
+            jit_dispatch(jc, ins);
+        }
+        return false;
+    }
+    
+    static bool jit_ret(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins)
+    {
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_ri(jc, X86_EXT_CMP, X86_RAX, 14);
+        jit_check(jc, X86_CC_B, pc);
+        x86_ri(jc, X86_EXT_SUB, X86_RAX, 14);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        
+        // Only restore the registers CALL saved, as marked in the saved PSR
+        int8_t disp = 0;
+        int8_t psr_disp = 4 * (REG_CODE_R9 - REG_CODE_R0 + 2);
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, psr_disp);
+        for (uint32_t i = REG_CODE_R0; i <= REG_CODE_R9; ++i, disp += 4)
+        {
+            x86_test_ri(jc, X86_RCX, 1 << (i - REG_CODE_R0 + PSR_FRAME_SHIFT));
+            size_t skip = x86_jcc(jc, X86_CC_NE);
+            x86_stack(jc, X86_MOV_LOAD, X86_RDX, X86_RAX, disp);
+            jit_store_register(jc, i, X86_RDX);
+            x86_patch(jc, skip, jc.code.size());
+        }
+        x86_stack(jc, X86_MOV_LOAD, X86_RDX, X86_RAX, disp);
+        jit_store_register(jc, REG_CODE_AB, X86_RDX);
+        x86_ri(jc, X86_EXT_AND, X86_RCX, ~PSR_FRAME);
+        jit_store_register(jc, REG_CODE_PSR, X86_RCX);
+        x86_stack(jc, X86_MOV_LOAD, X86_RDX, X86_RAX, disp + 8);
+        jit_store_register(jc, REG_CODE_PC, X86_RDX);
+        
+        // Leave if returning to another segment, or if the restored PSR stops
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, disp + 12);
+        x86_core(jc, X86_CMP_LOAD, X86_RCX, jit_register(REG_CODE_SEG));
+        jit_store_register(jc, REG_CODE_SEG, X86_RCX);
+        jit_store_register_imm(jc, REG_CODE_IR, ins.instr);
+        x86_patch(jc, x86_jcc(jc, X86_CC_NE), jc.exit_jump);
+        
+        // test dword [rbx + PSR], STOP
+        x86_byte(jc, 0xF7);
+        x86_byte(jc, 0x80 | X86_RBX);
+        x86_dword(jc, jit_register(REG_CODE_PSR));
+        x86_dword(jc, PSR_FLAG_STOP);
+        x86_patch(jc, x86_jcc(jc, X86_CC_NE), jc.exit_jump);
+        
+        x86_patch(jc, x86_jmp(jc), jc.dispatch);
+        return false;
+    }
+    
+    static bool jit_jmp(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins)
+    {
+        if (ins.a.kind == OPK_IMM)
+            jit_goto(jc, ins, *ins.a.imm);
+        else
+        {
+            jit_operand_value(jc, pc, ins, ins.a, X86_RCX);
+            jit_store_register(jc, REG_CODE_PC, X86_RCX);
+            jit_dispatch(jc, ins);
+        }
+        return false;
+    }
+    
+    //! Conditional jumps clear the PSR flags, taken or not.
+    static bool jit_jump_if(jit_compiler& jc, uint32_t pc, decoded_instruction const& ins, uint32_t handler)
+    {
+        bool is_constant = ins.a.kind == OPK_IMM;
+        if (!is_constant)
+            jit_operand_value(jc, pc, ins, ins.a, X86_RCX);
+            
+        jit_load_register(jc, X86_RAX, REG_CODE_PSR);
+        x86_rr(jc, X86_MOV, X86_RAX, X86_RDX);
+        x86_ri(jc, X86_EXT_AND, X86_RDX, PSR_FLAG_CLR);
+        jit_store_register(jc, REG_CODE_PSR, X86_RDX);
+        
+        // Test the condition (see flow_condition in vm_core.cpp),
+        //   getting the condition code for which the jump is taken
+        uint32_t mask;
+        uint8_t cc;
+        switch (handler)
+        {
+            case H_CODE_JZ:
+            case H_CODE_JE:  mask = PSR_FLAG_Z; cc = X86_CC_NE; break;
+            case H_CODE_JNZ:
+            case H_CODE_JNE: mask = PSR_FLAG_Z; cc = X86_CC_E; break;
+            case H_CODE_JL:  mask = PSR_FLAG_N; cc = X86_CC_NE; break;
+            case H_CODE_JLE: mask = PSR_FLAG_N | PSR_FLAG_Z; cc = X86_CC_NE; break;
+            case H_CODE_JG:  mask = PSR_FLAG_N; cc = X86_CC_E; break;
+            default:         mask = 0; cc = X86_CC_NE; break;
+        }
+        
+        if (handler == H_CODE_JGE)
+        {
+            // Taken unless N is set and Z is not
+            x86_ri(jc, X86_EXT_AND, X86_RAX, PSR_FLAG_N | PSR_FLAG_Z);
+            x86_ri(jc, X86_EXT_CMP, X86_RAX, PSR_FLAG_N);
+        }
+        else
+        {
+            // test eax, imm32
+            x86_byte(jc, 0xA9);
+            x86_dword(jc, mask);
+        }
+        
+        if (is_constant)
+            jit_branch(jc, ins, cc, *ins.a.imm);
+        else
+        {
+            size_t skip = x86_jcc(jc, cc ^ 1);
+            jit_store_register(jc, REG_CODE_PC, X86_RCX);
+            jit_dispatch(jc, ins);
+            x86_patch(jc, skip, jc.code.size());
+        }
+        return true;
+    }
+    
+    //! Load the two operands of an arithmetic instruction (lhs in ecx,
+    //!   rhs in r8d), with eax holding the new SP value minus one.
+    static void jit_arith_operands(jit_compiler& jc)
+    {
+        x86_stack(jc, X86_MOV_LOAD, X86_RCX, X86_RAX, 0);
+        x86_stack(jc, X86_MOV_LOAD, X86_R8, X86_RAX, 4);
+    }
+    
+    //! movd xmm0, ecx; movd xmm1, r8d
+    static void jit_float_operands(jit_compiler& jc)
+    {
+        x86_byte(jc, 0x66);
+        x86_byte(jc, 0x0F);
+        x86_byte(jc, 0x6E);
+        x86_byte(jc, 0xC1);
+        
+        x86_byte(jc, 0x66);
+        x86_byte(jc, 0x41);
+        x86_byte(jc, 0x0F);
+        x86_byte(jc, 0x6E);
+        x86_byte(jc, 0xC8);
+    }
+    
+    //! See arith_apply in vm_core.cpp.
+    static bool jit_arith(jit_compiler& jc, uint32_t pc, uint32_t handler)
+    {
+        // Two pops then a push, so we need 2 <= SP < stack_size + 2
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_ri(jc, X86_EXT_SUB, X86_RAX, 2);
+        x86_rr(jc, X86_CMP, X86_R15, X86_RAX);
+        jit_check(jc, X86_CC_AE, pc);
+        
+        jit_arith_operands(jc);
+        
+        switch (handler)
+        {
+            case H_CODE_UADD:
+            case H_CODE_IADD:
+                x86_rr(jc, X86_ADD, X86_R8, X86_RCX);
+                break;
+                
+            case H_CODE_USUB:
+            case H_CODE_ISUB:
+                x86_rr(jc, X86_SUB, X86_R8, X86_RCX);
+                break;
+                
+            case H_CODE_UAND:
+                x86_rr(jc, X86_AND, X86_R8, X86_RCX);
+                break;
+                
+            case H_CODE_UOR:
+                x86_rr(jc, X86_OR, X86_R8, X86_RCX);
+                break;
+                
+            case H_CODE_UXOR:
+                x86_rr(jc, X86_XOR, X86_R8, X86_RCX);
+                break;
+                
+            case H_CODE_UMUL:
+            case H_CODE_IMUL:
+                // imul ecx, r8d
+                x86_rex(jc, false, X86_RCX, 0, X86_R8);
+                x86_byte(jc, 0x0F);
+                x86_byte(jc, 0xAF);
+                x86_byte(jc, 0xC0 | (X86_RCX << 3) | (X86_R8 & 7));
+                break;
+                
+            case H_CODE_UDIV:
+            case H_CODE_IDIV:
+                x86_rr(jc, X86_MOV, X86_RAX, X86_R9);
+                x86_rr(jc, X86_MOV, X86_RCX, X86_RAX);
+                if (handler == H_CODE_UDIV)
+                    x86_rr(jc, X86_XOR, X86_RDX, X86_RDX);
+                else
+                    x86_byte(jc, 0x99);
+                    
+                // div r8d or idiv r8d
+                x86_rex(jc, false, 0, 0, X86_R8);
+                x86_byte(jc, 0xF7);
+                x86_byte(jc, handler == H_CODE_UDIV ? 0xF0 : 0xF8);
+                
+                x86_rr(jc, X86_MOV, X86_RAX, X86_RCX);
+                x86_rr(jc, X86_MOV, X86_R9, X86_RAX);
+                break;
+                
+            default:
+            {
+                // addss, subss, mulss or divss xmm0, xmm1, then movd ecx, xmm0
+                uint8_t op = 0x58;
+                if (handler == H_CODE_FSUB)
+                    op = 0x5C;
+                else if (handler == H_CODE_FMUL)
+                    op = 0x59;
+                else if (handler == H_CODE_FDIV)
+                    op = 0x5E;
+                    
+                jit_float_operands(jc);
+                x86_byte(jc, 0xF3);
+                x86_byte(jc, 0x0F);
+                x86_byte(jc, op);
+                x86_byte(jc, 0xC1);
+                
+                x86_byte(jc, 0x66);
+                x86_byte(jc, 0x0F);
+                x86_byte(jc, 0x7E);
+                x86_byte(jc, 0xC1);
+                break;
+            }
+        }
+        
+        x86_stack(jc, X86_MOV, X86_RCX, X86_RAX, 0);
+        x86_ri(jc, X86_EXT_ADD, X86_RAX, 1);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        return true;
+    }
+    
+    //! See arith_compare in vm_core.cpp.
+    static bool jit_compare(jit_compiler& jc, uint32_t pc, uint32_t handler)
+    {
+        jit_load_register(jc, X86_RAX, REG_CODE_SP);
+        x86_ri(jc, X86_EXT_CMP, X86_RAX, 2);
+        jit_check(jc, X86_CC_B, pc);
+        x86_ri(jc, X86_EXT_SUB, X86_RAX, 2);
+        jit_store_register(jc, REG_CODE_SP, X86_RAX);
+        
+        jit_arith_operands(jc);
+        
+        // Get N in al and Z in dl
+        x86_rr(jc, X86_XOR, X86_RAX, X86_RAX);
+        x86_rr(jc, X86_XOR, X86_RDX, X86_RDX);
+        
+        if (handler == H_CODE_FCMP)
+        {
+            jit_float_operands(jc);
+            
+            // ucomiss xmm1, xmm0 ; seta al (false if unordered)
+            x86_byte(jc, 0x0F);
+            x86_byte(jc, 0x2E);
+            x86_byte(jc, 0xC8);
+            x86_setcc(jc, X86_CC_A, X86_RAX);
+            
+            // ucomiss xmm0, xmm1 ; sete dl ; setnp cl ; and dl, cl
+            x86_byte(jc, 0x0F);
+            x86_byte(jc, 0x2E);
+            x86_byte(jc, 0xC1);
+            x86_setcc(jc, X86_CC_E, X86_RDX);
+            x86_setcc(jc, X86_CC_NP, X86_RCX);
+            x86_byte(jc, 0x20);
+            x86_byte(jc, 0xCA);
+        }
+        else
+        {
+            x86_rr(jc, X86_CMP, X86_R8, X86_RCX);
+            x86_setcc(jc, handler == H_CODE_UCMP ? X86_CC_B : X86_CC_L, X86_RAX);
+            x86_setcc(jc, X86_CC_E, X86_RDX);
+        }
+        
+        // PSR |= N << 1 | Z
+        x86_rr(jc, X86_ADD, X86_RAX, X86_RAX);
+        x86_rr(jc, X86_OR, X86_RDX, X86_RAX);
+        x86_core(jc, X86_OR, X86_RAX, jit_register(REG_CODE_PSR));
+        return true;
+    }
+    
+    //! Compile the instruction at pc.
+    static bool jit_translate(jit_compiler& jc, uint32_t pc)
+    {
+        decoded_instruction const& ins = jc.seg->code[pc];
+        
+        if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+        {
+            jit_step(jc, pc);
+            return false;
+        }
+        
+        // Note that the handler may be a superinstruction, so we
+        //   look at the instruction's code instead
+        uint32_t icode = decoder_icode(ins);
+        switch (icode)
+        {
+            case I_CODE_PUSH:
+                return jit_push(jc, pc, ins);
+                
+            case I_CODE_POP:
+                return jit_pop(jc, pc, ins);
+                
+            case I_CODE_DUP:
+                return jit_dup(jc, pc);
+                
+            case I_CODE_MOV:
+                return jit_mov(jc, pc, ins);
+                
+            case I_CODE_LOAD:
+                return jit_load(jc, pc);
+                
+            case I_CODE_STOR:
+                return jit_stor(jc, pc);
+                
+            case I_CODE_CALL:
+                return jit_call(jc, pc, ins);
+                
+            case I_CODE_RET:
+                return jit_ret(jc, pc, ins);
+                
+            case I_CODE_JMP:
+                return jit_jmp(jc, pc, ins);
+                
+            case I_CODE_JZ:  return jit_jump_if(jc, pc, ins, H_CODE_JZ);
+            case I_CODE_JNZ: return jit_jump_if(jc, pc, ins, H_CODE_JNZ);
+            case I_CODE_JE:  return jit_jump_if(jc, pc, ins, H_CODE_JE);
+            case I_CODE_JNE: return jit_jump_if(jc, pc, ins, H_CODE_JNE);
+            case I_CODE_JL:  return jit_jump_if(jc, pc, ins, H_CODE_JL);
+            case I_CODE_JLE: return jit_jump_if(jc, pc, ins, H_CODE_JLE);
+            case I_CODE_JG:  return jit_jump_if(jc, pc, ins, H_CODE_JG);
+            case I_CODE_JGE: return jit_jump_if(jc, pc, ins, H_CODE_JGE);
+            
+            case I_CODE_UADD: return jit_arith(jc, pc, H_CODE_UADD);
+            case I_CODE_USUB: return jit_arith(jc, pc, H_CODE_USUB);
+            case I_CODE_UMUL: return jit_arith(jc, pc, H_CODE_UMUL);
+            case I_CODE_UDIV: return jit_arith(jc, pc, H_CODE_UDIV);
+            case I_CODE_UAND: return jit_arith(jc, pc, H_CODE_UAND);
+            case I_CODE_UOR:  return jit_arith(jc, pc, H_CODE_UOR);
+            case I_CODE_UXOR: return jit_arith(jc, pc, H_CODE_UXOR);
+            case I_CODE_IADD: return jit_arith(jc, pc, H_CODE_IADD);
+            case I_CODE_ISUB: return jit_arith(jc, pc, H_CODE_ISUB);
+            case I_CODE_IMUL: return jit_arith(jc, pc, H_CODE_IMUL);
+            case I_CODE_IDIV: return jit_arith(jc, pc, H_CODE_IDIV);
+            case I_CODE_FADD: return jit_arith(jc, pc, H_CODE_FADD);
+            case I_CODE_FSUB: return jit_arith(jc, pc, H_CODE_FSUB);
+            case I_CODE_FMUL: return jit_arith(jc, pc, H_CODE_FMUL);
+            case I_CODE_FDIV: return jit_arith(jc, pc, H_CODE_FDIV);
+            
+            case I_CODE_UCMP: return jit_compare(jc, pc, H_CODE_UCMP);
+            case I_CODE_ICMP: return jit_compare(jc, pc, H_CODE_ICMP);
+            case I_CODE_FCMP: return jit_compare(jc, pc, H_CODE_FCMP);
+            
+            case I_CODE_HALT:
+            case I_CODE_RST:
+                jit_step(jc, pc);
+                return false;
+                
+            default:
+                // SYS, CST, DIVE, the bulk MEM instructions and VEC
+                jit_step(jc, pc);
+                return true;
+        }
+    }
+    
+    //! Emit the entry stub, followed by the exit and the dispatch stubs.
+    //! The entry stub is called as uint32_t(*)(core* vco, void* target, int64_t* budget).
+    static void jit_emit_stubs(jit_compiler& jc, std::atomic<void*> const* table)
+    {
+        // push rbx ; push rbp ; push r12 ; push r13 ; push r14 ; push r15
+        x86_byte(jc, 0x53);
+        x86_byte(jc, 0x55);
+        for (int reg = X86_R12; reg <= X86_R15; ++reg)
+        {
+            x86_byte(jc, 0x41);
+            x86_byte(jc, 0x50 + (reg & 7));
+        }
+        
+        // mov rbx, rdi ; mov rbp, rdx
+        x86_byte(jc, 0x48);
+        x86_byte(jc, 0x89);
+        x86_byte(jc, 0xFB);
+        x86_byte(jc, 0x48);
+        x86_byte(jc, 0x89);
+        x86_byte(jc, 0xD5);
+        
+        x86_core(jc, X86_MOV_LOAD, X86_R12, offsetof(core, stack), true);
+        x86_core(jc, X86_MOV_LOAD, X86_R15, offsetof(core, stack_size));
+        x86_rr(jc, X86_MOV, X86_R15, X86_R14);
+        x86_core(jc, X86_ADD_LOAD, X86_R14, offsetof(core, heap_size));
+        
+        // mov r13, table (whose entries are read as plain pointers)
+        static_assert(sizeof(std::atomic<void*>) == sizeof(void*), "vm::jit: atomic pointers can't be read natively");
+        x86_byte(jc, 0x49);
+        x86_byte(jc, 0xBD);
+        x86_qword(jc, (uint64_t) table);
+        
+        // jmp rsi
+        x86_byte(jc, 0xFF);
+        x86_byte(jc, 0xE6);
+        
+        jc.exit_jump = jc.code.size();
+        x86_mov_imm(jc, X86_RAX, JIT_EXIT_JUMP);
+        
+        // pop r15 ; pop r14 ; pop r13 ; pop r12 ; pop rbp ; pop rbx ; ret
+        jc.epilogue = jc.code.size();
+        for (int reg = X86_R15; reg >= X86_R12; --reg)
+        {
+            x86_byte(jc, 0x41);
+            x86_byte(jc, 0x58 + (reg & 7));
+        }
+        x86_byte(jc, 0x5D);
+        x86_byte(jc, 0x5B);
+        x86_byte(jc, 0xC3);
+        
+        // Jump to the native location of PC, or leave if there is none (or
+        //   if the budget is exhausted)
+        jc.dispatch = jc.code.size();
+        jit_charge(jc, 1);
+        x86_patch(jc, x86_jcc(jc, X86_CC_LE), jc.exit_jump);
+        jit_load_register(jc, X86_RAX, REG_CODE_PC);
+        x86_ri(jc, X86_EXT_CMP, X86_RAX, jc.seg->size);
+        x86_patch(jc, x86_jcc(jc, X86_CC_AE), jc.exit_jump);
+        
+        // mov rax, [r13 + rax * 8] ; test rax, rax
+        x86_byte(jc, 0x49);
+        x86_byte(jc, 0x8B);
+        x86_byte(jc, 0x44);
+        x86_byte(jc, 0xC5);
+        x86_byte(jc, 0x00);
+        x86_byte(jc, 0x48);
+        x86_byte(jc, 0x85);
+        x86_byte(jc, 0xC0);
+        x86_patch(jc, x86_jcc(jc, X86_CC_E), jc.exit_jump);
+        
+        // jmp rax
+        x86_byte(jc, 0xFF);
+        x86_byte(jc, 0xE0);
+    }
+    
+    //! Check if a PC was compiled in a previous chunk.
+    static bool jit_is_known(jit_compiler const& jc, uint32_t pc)
+    {
+        return jc.table[pc].load(std::memory_order_relaxed) != 0;
+    }
+    
+    //! Label a PC that was compiled in a previous chunk with a jump to it
+    //!   (chunks are too far apart for relative jumps).
+    static void jit_far_label(jit_compiler& jc, uint32_t pc)
+    {
+        jc.labels[pc] = jc.code.size();
+        
+        // jmp [rip + 0] ; dq target
+        x86_byte(jc, 0xFF);
+        x86_byte(jc, 0x25);
+        x86_dword(jc, 0);
+        x86_qword(jc, (uint64_t) jc.table[pc].load(std::memory_order_relaxed));
+    }
+    
+    //! Compile all the pending locations.
+    //! Each location is compiled along with the instructions that follow
+    //!   it, until the flow can't go on or reaches already compiled code.
+    static void jit_emit_code(jit_compiler& jc)
+    {
+        while (jc.pending.size())
+        {
+            uint32_t pc = jc.pending.back();
+            jc.pending.pop_back();
+            
+            if (pc < jc.seg->size && (jc.labels[pc] >= 0 || jit_is_known(jc, pc)))
+                continue;
+                
+            for (;;)
+            {
+                if (pc >= jc.seg->size)
+                {
+                    jit_exit(jc, jc.seg->code[jc.seg->size], pc);
+                    break;
+                }
+                
+                if (jc.labels[pc] >= 0)
+                {
+                    x86_patch(jc, x86_jmp(jc), jc.labels[pc]);
+                    break;
+                }
+                
+                if (jit_is_known(jc, pc))
+                {
+                    jit_far_label(jc, pc);
+                    break;
+                }
+                
+                jc.labels[pc] = jc.code.size();
+                if (!jit_translate(jc, pc))
+                    break;
+                    
+                pc = jc.seg->code[pc].next;
+            }
+        }
+    }
+    
+    //! Emit the cold stubs, that leave the native code for the interpreter
+    //!   to run an instruction (see jit_check).
+    static void jit_emit_colds(jit_compiler& jc)
+    {
+        std::vector<int64_t> stubs(jc.seg->size, -1);
+        
+        for (size_t i = 0; i < jc.colds.size(); ++i)
+        {
+            uint32_t pc = jc.colds[i].pc;
+            if (stubs[pc] < 0)
+            {
+                stubs[pc] = jc.code.size();
+                jit_store_register_imm(jc, REG_CODE_PC, pc);
+                x86_mov_imm(jc, X86_RAX, JIT_EXIT_STEP);
+                x86_patch(jc, x86_jmp(jc), jc.epilogue);
+            }
+            
+            x86_patch(jc, jc.colds[i].at, stubs[pc]);
+        }
+    }
+    
+    //! Collect the locations to compile a segment from : its first word, its
+    //!   entry point, and the targets of the constant long CALLs of all the
+    //!   segments (the functions that are only called from other modules).
+    //! The segments must all be decoded.
+    static std::vector<uint32_t> jit_entries(core const& vco, uint32_t seg)
+    {
+        segment const& callee = *vco.segments[seg];
+        std::vector<uint32_t> entries;
+        entries.push_back(0);
+        entries.push_back(callee.entry);
+        
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment const& caller = *vco.segments[i];
+            for (uint32_t pc = 0; caller.code && pc < caller.size; ++pc)
+            {
+                decoded_instruction const& ins = caller.code[pc];
+                uint32_t icode = decoder_icode(ins);
+                
+                if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH || icode != I_CODE_CALL)
+                    continue;
+                if (ins.a.kind == OPK_IMM && ins.b.kind == OPK_IMM && *ins.a.imm == seg && *ins.b.imm < callee.size)
+                    entries.push_back(*ins.b.imm);
+            }
+        }
+        
+        return entries;
+    }
+    
+    //! Compile a new chunk of a segment's native code, from the given
+    //!   locations (the ones that were compiled already are left alone).
+    //! Returns false if the chunk can't be mapped.
+    static bool jit_emit_chunk(jit_code& native, segment const& seg, std::vector<uint32_t> const& entries)
+    {
+        jit_compiler jc;
+        jc.seg = &seg;
+        jc.table = native.table;
+        jc.labels.assign(seg.size, -1);
+        jc.pending = entries;
+        
+        jit_emit_stubs(jc, native.table);
+        jit_emit_code(jc);
+        jit_emit_colds(jc);
+        
+        for (size_t i = 0; i < jc.jumps.size(); ++i)
+        {
+            uint32_t pc = jc.jumps[i].pc;
+            if (jc.labels[pc] < 0)
+                jit_far_label(jc, pc);
+            x86_patch(jc, jc.jumps[i].at, jc.labels[pc]);
+        }
+        
+        // Copy the code to executable memory (never writable and
+        //   executable at the same time)
+        jit_chunk chunk;
+        chunk.size = jc.code.size();
+        void* buffer = mmap(0, chunk.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            return false;
+            
+        chunk.buffer = (uint8_t*) buffer;
+        std::memcpy(chunk.buffer, &jc.code[0], chunk.size);
+        mprotect(chunk.buffer, chunk.size, PROT_READ | PROT_EXEC);
+        native.chunks.push_back(chunk);
+        
+        // Only publish the new locations once their code is executable
+        for (uint32_t pc = 0; pc < seg.size; ++pc)
+        {
+            if (jc.labels[pc] >= 0 && !jit_is_known(jc, pc))
+                native.table[pc].store(chunk.buffer + jc.labels[pc], std::memory_order_release);
+        }
+        
+        return true;
+    }
+    
+    //! Compile a segment's native code from a location that was not compiled
+    //!   yet (unless it has too many chunks already).
+    //! Returns the location's native address, or null if it can't be compiled.
+    static void* jit_extend(segment const& seg, uint32_t pc)
+    {
+        jit_code& native = *seg.native;
+        std::lock_guard<std::mutex> guard(native.lock);
+        
+        // Another core may have compiled it meanwhile
+        void* target = native.table[pc].load(std::memory_order_relaxed);
+        if (!target && native.chunks.size() < JIT_MAX_CHUNKS &&
+            jit_emit_chunk(native, seg, std::vector<uint32_t>(1, pc)))
+            target = native.table[pc].load(std::memory_order_relaxed);
+            
+        return target;
+    }
+    
+    //! Compile the segments of a core that were not yet, and bind its hatches.
+    static void jit_prepare(core& vco)
+    {
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            if (!vco.segments[i]->code)
+                vco.segments[i]->code = decoder_decode(*vco.segments[i]);
+        }
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment* seg = vco.segments[i];
+            if (!seg->native)
+            {
+                // Segments that can't be compiled are left alone (they may
+                //   be shared with other cores, see vm_pool.h)
+                jit_code* native = jit_compile(vco, i);
+                if (native)
+                    seg->native = native;
+            }
+        }
+        core_bind_hatches(vco);
+    }
+    
+    //! Run a prepared core until the end of the program (or the core halted),
+    //!   or until the budget is exhausted (down to zero or less).
+    //! Returns true if it was exhausted (or the core suspended) before the
+    //!   core halted.
+    static bool jit_loop(core& vco, int64_t& budget)
+    {
+        for (;;)
+        {
+            segment* seg = vco.segments[vco.registers[REG_CODE_SEG]];
+            uint32_t pc = vco.registers[REG_CODE_PC];
+            if (pc >= seg->size || vco.registers[REG_CODE_PSR] & PSR_FLAG_STOP)
+                return vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT;
+            if (budget <= 0)
+                return true;
+                
+            // Run native code if possible, compiling it first if needed (the
+            //   entries of core_call, dynamic jumps...), falling back to the
+            //   interpreter until the flow reaches native code
+            void* target = 0;
+            if (seg->native)
+            {
+                target = seg->native->table[pc].load(std::memory_order_acquire);
+                if (!target)
+                    target = jit_extend(*seg, pc);
+            }
+            
+            if (!target)
+                core_run_to_native(vco, budget);
+            else if (seg->native->enter(&vco, target, &budget) == JIT_EXIT_STEP)
+            {
+                core_step(vco);
+                --budget;
+            }
+        }
+    }
+    
+    #endif // BOLT_JIT_X86_64
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    jit_code* jit_compile(core const& vco, uint32_t seg)
+    {
+        #ifdef BOLT_JIT_X86_64
+        segment const& target = *vco.segments[seg];
+        if (!target.code || !target.size || decoder_is_self_modifying(target))
+            return 0;
+            
+        jit_code* native = new jit_code;
+        native->table = new std::atomic<void*>[target.size];
+        for (uint32_t pc = 0; pc < target.size; ++pc)
+            native->table[pc].store(0, std::memory_order_relaxed);
+            
+        if (!jit_emit_chunk(*native, target, jit_entries(vco, seg)))
+        {
+            delete[] native->table;
+            delete native;
+            return 0;
+        }
+        
+        native->enter = (uint32_t(*)(core*, void*, int64_t*)) native->chunks[0].buffer;
+        return native;
+        #else
+        (void) vco;
+        (void) seg;
+        return 0;
+        #endif
+    }
+    
+    void jit_free(jit_code* native)
+    {
+        if (!native)
+            return;
+            
+        #ifdef BOLT_JIT_X86_64
+        for (size_t i = 0; i < native->chunks.size(); ++i)
+            munmap(native->chunks[i].buffer, native->chunks[i].size);
+        #endif
+        delete[] native->table;
+        delete native;
+    }
+    
+    bool jit_is_compiled(segment const& seg, uint32_t pc)
+    {
+        return seg.native && pc < seg.size && seg.native->table[pc].load(std::memory_order_acquire);
+    }
+    
+    void jit_run(core& vco)
+    {
+        #ifdef BOLT_JIT_X86_64
+        jit_prepare(vco);
+        
+        int64_t budget = INT64_MAX;
+        jit_loop(vco, budget);
+        
+        if (!(vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT))
+            vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+        #else
+        core_run(vco);
+        #endif
+    }
+    
+    uint32_t jit_run_for(core& vco, uint64_t budget, std::string* fault)
+    {
+        #ifdef BOLT_JIT_X86_64
+        try
+        {
+            jit_prepare(vco);
+            
+            int64_t left = budget < INT64_MAX ? budget : INT64_MAX;
+            if (jit_loop(vco, left))
+                return vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT ? CORE_SUSPENDED : CORE_EXHAUSTED;
+        }
+        catch (std::exception const& exc)
+        {
+            vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+            if (fault)
+                *fault = exc.what();
+            return CORE_FAULTED;
+        }
+        
+        vco.registers[REG_CODE_PSR] |= PSR_FLAG_HALT;
+        return CORE_HALTED;
+        #else
+        return core_run_for(vco, budget, fault);
+        #endif
+    }
+} }
@@ -0,0 +1,433 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bolt/vm_pool.h"
+#include "bolt/vm_decoder.h"
+#include "bolt/vm_jit.h"
+#include "bolt/vm_verifier.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace bolt { namespace vm
+{
+    //! A submitted job, with the promise of its result.
+    //! The job gets a core when it is first run, that it keeps until it is
+    //!   done (it holds the whole state of its run between slices).
+    struct pool_task
+    {
+        pool_job job;
+        std::promise<uint32_t> result;
+        
+        bool started;
+        core vco;
+    };
+    
+    //! A worker's deque of runnable tasks, guarded by lock.
+    //! The worker runs the tasks from the front, and puts them back at the
+    //!   end after each slice, while other workers steal from the end.
+    struct pool_worker
+    {
+        std::mutex lock;
+        std::deque<pool_task*> tasks;
+    };
+    
+    //! The pool structure.
+    //! The queued field counts the tasks in all the deques, and next is the
+    //!   worker which gets the next submitted job.
+    //! Idle workers wait for ready, which is notified when a task is queued
+    //!   or when the pool stops, under lock, which also guards :
+    //!   - live, the number of tasks that are not done yet,
+    //!   - suspended, the tasks whose core is suspended (see core_suspend),
+    //!     by core, and resumes, the return values of the hatch calls that
+    //!     were completed before their worker got to suspend the task,
+    //!   - spares, the cores of the tasks that were done, kept for the next ones.
+    //! The warm field is the snapshot the tasks start from, if any.
+    struct pool
+    {
+        core const* image;
+        snapshot const* warm;
+        uint32_t mode;
+        uint64_t slice;
+        
+        uint32_t workers_size;
+        pool_worker* workers;
+        std::vector<std::thread> threads;
+        
+        std::atomic<uint32_t> queued;
+        std::atomic<uint32_t> next;
+        
+        std::mutex lock;
+        std::condition_variable ready;
+        bool stopping;
+        uint32_t live;
+        std::map<core const*, pool_task*> suspended;
+        std::map<core const*, uint32_t> resumes;
+        std::vector<core> spares;
+    };
+    
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Create a task's core, which shares the image's segments and hatches.
+    //! A spare core gets its memory cleared, so that a task neither sees the
+    //!   previous one's data, nor inherits its heap allocator's state (see
+    //!   vm_runtime.cpp).
+    static core pool_core_create(pool& pl)
+    {
+        bool spare = false;
+        core vco;
+        
+        {
+            std::lock_guard<std::mutex> guard(pl.lock);
+            if (!pl.spares.empty())
+            {
+                vco = pl.spares.back();
+                pl.spares.pop_back();
+                spare = true;
+            }
+        }
+        
+        if (spare)
+        {
+            std::fill_n(vco.stack, vco.stack_size + vco.heap_size, 0);
+            return vco;
+        }
+        
+        core const& image = *pl.image;
+        vco = core_create(image.stack_size, image.heap_size, 0, 0);
+        vco.base = image.base;
+        
+        vco.segments_size = image.segments_size;
+        vco.segments = image.segments;
+        vco.hatches_size = image.hatches_size;
+        vco.hatches = image.hatches;
+        vco.hatch_entries = image.hatch_entries;
+        
+        return vco;
+    }
+    
+    //! Give a task's core back to the pool.
+    static void pool_core_release(pool& pl, core const& vco)
+    {
+        std::lock_guard<std::mutex> guard(pl.lock);
+        pl.spares.push_back(vco);
+    }
+    
+    //! Free a task's core, leaving the image's tables alone.
+    static void pool_core_free(core& vco)
+    {
+        vco.segments_size = 0;
+        vco.segments = 0;
+        vco.hatches_size = 0;
+        vco.hatches = 0;
+        vco.hatch_entries = 0;
+        
+        core_free(vco);
+    }
+    
+    //! Queue a runnable task in a worker's deque, waking an idle worker up.
+    static void pool_queue(pool& pl, uint32_t worker, pool_task* task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(pl.workers[worker].lock);
+            pl.workers[worker].tasks.push_back(task);
+        }
+        ++pl.queued;
+        
+        // Idle workers check queued under lock before waiting, so that
+        //   taking it here makes sure none of them misses the notification
+        {
+            std::lock_guard<std::mutex> guard(pl.lock);
+        }
+        pl.ready.notify_one();
+    }
+    
+    //! Take a runnable task from a worker's own deque, or else steal one
+    //!   from the others, returns null if there is none.
+    static pool_task* pool_take(pool& pl, uint32_t worker)
+    {
+        for (uint32_t i = 0; i < pl.workers_size; ++i)
+        {
+            pool_worker& victim = pl.workers[(worker + i) % pl.workers_size];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.tasks.empty())
+                continue;
+                
+            pool_task* task;
+            if (!i)
+            {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+            }
+            else
+            {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+            }
+            
+            --pl.queued;
+            return task;
+        }
+        
+        return 0;
+    }
+    
+    //! Set a task aside until the hatch call its core is suspended at is
+    //!   completed (see pool_resume), or queue it again if it already was.
+    static void pool_suspend(pool& pl, uint32_t worker, pool_task* task)
+    {
+        uint32_t rv;
+        {
+            std::lock_guard<std::mutex> guard(pl.lock);
+            std::map<core const*, uint32_t>::iterator it = pl.resumes.find(&task->vco);
+            if (it == pl.resumes.end())
+            {
+                pl.suspended[&task->vco] = task;
+                return;
+            }
+            
+            rv = it->second;
+            pl.resumes.erase(it);
+        }
+        
+        core_resume(task->vco, rv);
+        pool_queue(pl, worker, task);
+    }
+    
+    //! Run a slice of a task, returns the status of the run (see core_run_for).
+    static uint32_t pool_run(pool& pl, pool_task& task, std::string& fault)
+    {
+        if (!task.started)
+        {
+            task.vco = pool_core_create(pl);
+            task.started = true;
+            
+            // The call resets the registers, but the heap base is part of
+            //   the snapshot's heap state
+            if (pl.warm)
+                core_restore(task.vco, *pl.warm);
+                
+            pool_job const& job = task.job;
+            uint32_t const* args = job.arguments.empty() ? 0 : &job.arguments[0];
+            core_call(task.vco, job.segment, job.entry, args, job.arguments.size());
+            
+            if (pl.warm)
+                task.vco.registers[REG_CODE_HB] = pl.warm->registers[REG_CODE_HB];
+        }
+        
+        switch (pl.mode)
+        {
+            case POOL_TRUSTED: return core_run_trusted_for(task.vco, pl.slice, &fault);
+            case POOL_JIT:     return jit_run_for(task.vco, pl.slice, &fault);
+            default:           return core_run_for(task.vco, pl.slice, &fault);
+        }
+    }
+    
+    //! A worker thread's loop : run the tasks slice by slice until the pool
+    //!   stops and no task is left.
+    static void pool_work(pool* pl, uint32_t worker)
+    {
+        for (;;)
+        {
+            pool_task* task = pool_take(*pl, worker);
+            if (!task)
+            {
+                std::unique_lock<std::mutex> guard(pl->lock);
+                pl->ready.wait(guard, [pl] { return pl->queued || (pl->stopping && !pl->live); });
+                if (!pl->queued)
+                    break;
+                    
+                continue;
+            }
+            
+            try
+            {
+                std::string fault;
+                uint32_t status = pool_run(*pl, *task, fault);
+                if (status == CORE_EXHAUSTED)
+                {
+                    pool_queue(*pl, worker, task);
+                    continue;
+                }
+                if (status == CORE_SUSPENDED)
+                {
+                    pool_suspend(*pl, worker, task);
+                    continue;
+                }
+                if (status == CORE_FAULTED)
+                    throw std::runtime_error(fault);
+                    
+                task->result.set_value(task->vco.registers[REG_CODE_RV]);
+            }
+            catch (...)
+            {
+                task->result.set_exception(std::current_exception());
+            }
+            
+            if (task->started)
+                pool_core_release(*pl, task->vco);
+            delete task;
+            
+            // Let the idle workers leave once the last task is done
+            bool done;
+            {
+                std::lock_guard<std::mutex> guard(pl->lock);
+                done = !--pl->live;
+            }
+            if (done)
+                pl->ready.notify_all();
+        }
+    }
+    
+    //! Create a pool, whose tasks start from the given snapshot if not null.
+    static pool* pool_start(core& image, snapshot const* warm, uint32_t workers, uint32_t mode, uint64_t slice)
+    {
+        if (!workers)
+            throw std::logic_error("vm::pool_create: no workers");
+        if (!slice)
+            throw std::logic_error("vm::pool_create: empty slices");
+            
+        // Prepare the image once and for all, as the workers must only read it
+        for (uint32_t i = 0; i < image.segments_size; ++i)
+        {
+            segment* seg = image.segments[i];
+            if (!seg->code)
+                seg->code = decoder_decode(*seg);
+            if (decoder_is_self_modifying(*seg))
+                throw std::logic_error("vm::pool_create: self-modifying segments can't be shared (link them as read-only code)");
+        }
+        for (uint32_t i = 0; i < image.segments_size; ++i)
+        {
+            if (mode == POOL_JIT && !image.segments[i]->native)
+                image.segments[i]->native = jit_compile(image, i);
+        }
+        if (mode == POOL_TRUSTED)
+            verifier_verify(image);
+        core_bind_hatches(image);
+        
+        pool* pl = new pool;
+        pl->image = &image;
+        pl->warm = warm;
+        pl->mode = mode;
+        pl->slice = slice;
+        pl->workers_size = workers;
+        pl->workers = new pool_worker[workers];
+        pl->queued = 0;
+        pl->next = 0;
+        pl->stopping = false;
+        pl->live = 0;
+        
+        try
+        {
+            for (uint32_t i = 0; i < workers; ++i)
+                pl->threads.push_back(std::thread(pool_work, pl, i));
+        }
+        catch (...)
+        {
+            pool_free(pl);
+            throw;
+        }
+        
+        return pl;
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    pool* pool_create(core& image, uint32_t workers, uint32_t mode, uint64_t slice)
+    {
+        return pool_start(image, 0, workers, mode, slice);
+    }
+    
+    pool* pool_create(core& image, snapshot const& warm, uint32_t workers, uint32_t mode, uint64_t slice)
+    {
+        if (warm.segments != image.segments || warm.hatches != image.hatches ||
+            warm.stack_size != image.stack_size || warm.heap_size != image.heap_size)
+            throw std::logic_error("vm::pool_create: the snapshot wasn't taken of the image");
+            
+        return pool_start(image, &warm, workers, mode, slice);
+    }
+    
+    void pool_free(pool* pl)
+    {
+        {
+            std::lock_guard<std::mutex> guard(pl->lock);
+            pl->stopping = true;
+        }
+        pl->ready.notify_all();
+        
+        for (size_t i = 0; i < pl->threads.size(); ++i)
+            pl->threads[i].join();
+            
+        for (size_t i = 0; i < pl->spares.size(); ++i)
+            pool_core_free(pl->spares[i]);
+            
+        delete[] pl->workers;
+        delete pl;
+    }
+    
+    std::future<uint32_t> pool_submit(pool& pl, pool_job const& job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(pl.lock);
+            if (pl.stopping)
+                throw std::logic_error("vm::pool_submit: pool is stopping");
+            ++pl.live;
+        }
+        
+        pool_task* task = new pool_task;
+        task->job = job;
+        task->started = false;
+        std::future<uint32_t> result = task->result.get_future();
+        
+        // Spread the jobs over the workers, idle ones steal the rest
+        pool_queue(pl, pl.next++ % pl.workers_size, task);
+        
+        return result;
+    }
+    
+    void pool_resume(pool& pl, core& vco, uint32_t rv)
+    {
+        pool_task* task;
+        {
+            std::lock_guard<std::mutex> guard(pl.lock);
+            std::map<core const*, pool_task*>::iterator it = pl.suspended.find(&vco);
+            if (it == pl.suspended.end())
+            {
+                // The worker running the job did not get to suspend it yet
+                pl.resumes[&vco] = rv;
+                return;
+            }
+            
+            task = it->second;
+            pl.suspended.erase(it);
+        }
+        
+        core_resume(task->vco, rv);
+        pool_queue(pl, pl.next++ % pl.workers_size, task);
+    }
+} }
@@ -0,0 +1,264 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "bolt/vm_profiler.h"
+#include <algorithm>
+#include <iomanip>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Read the host's cycle counter (or a nanosecond clock where there is
+    //!   no time stamp counter).
+    static inline uint64_t profile_clock()
+    {
+        #if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+        #else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        #endif
+    }
+    
+    //! Enter the function at the given location, pushing its frame on
+    //!   the profiler's call stack.
+    static void profile_enter(profile& prof, uint32_t seg, uint32_t entry)
+    {
+        uint64_t key = (uint64_t) seg << 32 | entry;
+        std::map<uint64_t, uint32_t>::iterator it = prof.function_ids.find(key);
+        
+        if (it == prof.function_ids.end())
+        {
+            profile_function fn;
+            fn.segment = seg;
+            fn.entry = entry;
+            fn.calls = 0;
+            fn.self_count = 0;
+            fn.self_cycles = 0;
+            fn.total_count = 0;
+            fn.total_cycles = 0;
+            fn.active = 0;
+            
+            it = prof.function_ids.insert(std::make_pair(key, (uint32_t) prof.functions.size())).first;
+            prof.functions.push_back(fn);
+        }
+        
+        profile_function& fn = prof.functions[it->second];
+        ++fn.calls;
+        ++fn.active;
+        
+        profile_frame frame;
+        frame.function = it->second;
+        frame.count = prof.count;
+        frame.cycles = prof.cycles;
+        prof.frames.push_back(frame);
+    }
+    
+    //! Leave the running function, charging its total (unless it is still
+    //!   running below, when recursive).
+    static void profile_leave(profile& prof)
+    {
+        profile_frame frame = prof.frames.back();
+        prof.frames.pop_back();
+        
+        profile_function& fn = prof.functions[frame.function];
+        if (!--fn.active)
+        {
+            fn.total_count += prof.count - frame.count;
+            fn.total_cycles += prof.cycles - frame.cycles;
+        }
+    }
+    
+    //! Charge the last instruction dispatched, for the time elapsed up to now.
+    static void profile_charge(profile& prof, uint64_t now)
+    {
+        uint64_t elapsed = now - prof.stamp;
+        
+        profile_counter& counter = prof.counters[prof.last_segment][prof.last_pc];
+        ++counter.count;
+        counter.cycles += elapsed;
+        
+        profile_function& fn = prof.functions[prof.frames.back().function];
+        ++fn.self_count;
+        fn.self_cycles += elapsed;
+        
+        ++prof.count;
+        prof.cycles += elapsed;
+    }
+    
+    //! Print a count, and its share of a total.
+    static void profile_share(std::ostream& os, uint64_t value, uint64_t total)
+    {
+        os << std::setw(14) << value << " " << std::setw(6) << std::fixed << std::setprecision(2)
+           << (total ? 100.0 * value / total : 0.0) << "%";
+    }
+    
+    //! A location of the flat profile.
+    struct profile_location
+    {
+        uint32_t segment;
+        uint32_t pc;
+        profile_counter counter;
+    };
+    
+    //! Order locations by time, then count (descending).
+    static bool profile_location_before(profile_location const& lhs, profile_location const& rhs)
+    {
+        if (lhs.counter.cycles != rhs.counter.cycles)
+            return lhs.counter.cycles > rhs.counter.cycles;
+        return lhs.counter.count > rhs.counter.count;
+    }
+    
+    //! Order functions by total time, then self time (descending).
+    static bool profile_function_before(profile_function const& lhs, profile_function const& rhs)
+    {
+        if (lhs.total_cycles != rhs.total_cycles)
+            return lhs.total_cycles > rhs.total_cycles;
+        return lhs.self_cycles > rhs.self_cycles;
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    profile profile_create(core const& vco)
+    {
+        profile prof;
+        
+        profile_counter zero;
+        zero.count = 0;
+        zero.cycles = 0;
+        
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+            prof.counters.push_back(std::vector<profile_counter>(vco.segments[i]->size, zero));
+            
+        prof.last = 0;
+        prof.last_segment = 0;
+        prof.last_pc = 0;
+        prof.stamp = 0;
+        
+        prof.count = 0;
+        prof.cycles = 0;
+        
+        return prof;
+    }
+    
+    void profile_step(profile& prof, core const& vco, decoded_instruction const* ins)
+    {
+        uint64_t now = profile_clock();
+        uint32_t seg = vco.registers[REG_CODE_SEG];
+        uint32_t pc = ins - vco.segments[seg]->code;
+        
+        // Charge the last instruction, and follow the flow if it called or returned
+        if (prof.last)
+        {
+            profile_charge(prof, now);
+            
+            uint32_t icode = decoder_icode(*prof.last);
+            if (icode == I_CODE_CALL)
+                profile_enter(prof, seg, pc);
+            else if (icode == I_CODE_RET && prof.frames.size() > 1)
+                profile_leave(prof);
+        }
+        else
+            profile_enter(prof, seg, pc);
+            
+        // The terminating entry of a decoded stream only stops the run
+        if (ins->handler == H_CODE_END)
+        {
+            prof.last = 0;
+            return;
+        }
+        
+        prof.last = ins;
+        prof.last_segment = seg;
+        prof.last_pc = pc;
+        prof.stamp = profile_clock();
+    }
+    
+    void profile_stop(profile& prof)
+    {
+        if (prof.last)
+            profile_charge(prof, profile_clock());
+        prof.last = 0;
+        
+        while (prof.frames.size())
+            profile_leave(prof);
+    }
+    
+    void profile_report(profile const& prof, debug_symbols const& symbols, std::ostream& os)
+    {
+        std::vector<profile_location> locations;
+        for (uint32_t i = 0; i < prof.counters.size(); ++i)
+        {
+            for (uint32_t pc = 0; pc < prof.counters[i].size(); ++pc)
+            {
+                if (!prof.counters[i][pc].count)
+                    continue;
+                    
+                profile_location loc;
+                loc.segment = i;
+                loc.pc = pc;
+                loc.counter = prof.counters[i][pc];
+                locations.push_back(loc);
+            }
+        }
+        std::sort(locations.begin(), locations.end(), profile_location_before);
+        
+        std::vector<profile_function> functions(prof.functions);
+        std::sort(functions.begin(), functions.end(), profile_function_before);
+        
+        std::ios::fmtflags flags = os.flags();
+        
+        os << "---- Flat profile ----" << std::endl;
+        os << "        cycles       %          count       %  location" << std::endl;
+        for (size_t i = 0; i < locations.size(); ++i)
+        {
+            profile_location const& loc = locations[i];
+            profile_share(os, loc.counter.cycles, prof.cycles);
+            profile_share(os, loc.counter.count, prof.count);
+            os << "  " << symbols_name(symbols, loc.segment, loc.pc) << std::endl;
+        }
+        
+        os << "---- Functions ----" << std::endl;
+        os << "   self cycles       %   total cycles       %     self count    total count          calls  function"
+           << std::endl;
+        for (size_t i = 0; i < functions.size(); ++i)
+        {
+            profile_function const& fn = functions[i];
+            profile_share(os, fn.self_cycles, prof.cycles);
+            profile_share(os, fn.total_cycles, prof.cycles);
+            os << std::setw(15) << fn.self_count << std::setw(15) << fn.total_count << std::setw(15) << fn.calls;
+            os << "  " << symbols_name(symbols, fn.segment, fn.entry) << std::endl;
+        }
+        
+        os << "--------------------" << std::endl;
+        os.flags(flags);
+    }
+} }
@@ -17,6 +17,8 @@
  */
 
 #include "bolt/vm_runtime.h"
+#include <algorithm>
+#include <stdexcept>
 #include <iostream>
 #include <cmath>
 
@@ -53,6 +55,186 @@ namespace bolt
 
     static int getc()
     { return std::cin.get(); }
+    
+    //!
+    //! Heap functions
+    //!
+    
+    //! The heap allocator manages the core's memory from HB to its end.
+    //! Its state lives at HB, in the heap itself, so that it follows the core
+    //!   around (see core_snapshot), and is set up by the first allocation
+    //!   (when it doesn't find its magic word there) :
+    //!   - the top of the arena, its peak size, and the live and requested
+    //!     words of the blocks (see vm::heap_stats),
+    //!   - the heads of the free lists of each size class.
+    //! A block of class c holds 2^c words, after a header word holding its
+    //!   requested size and the HEAP_USED bit (or only its class when it is
+    //!   free). Blocks are taken from the free list of their class, or carved
+    //!   from the top of the arena, and freed blocks go back to their free
+    //!   list, or to the arena if they are at its top.
+    //! Allocations return 0 (which is never a heap address) when there is no
+    //!   room left.
+    enum : uint32_t
+    {
+        HEAP_MAGIC_VALUE = 0x4B4C4F42,
+        HEAP_USED = 0x80000000,
+        HEAP_CLASSES = 32,
+        
+        HEAP_MAGIC = 0,
+        HEAP_TOP,
+        HEAP_PEAK,
+        HEAP_LIVE,
+        HEAP_REQUESTED,
+        HEAP_LISTS,
+        HEAP_HEADER = HEAP_LISTS + HEAP_CLASSES
+    };
+    
+    //! Get the size class of a block of the given size.
+    static uint32_t heap_class(uint32_t size)
+    {
+        uint32_t c = 0;
+        while (c < HEAP_CLASSES && (1u << c) < size)
+            ++c;
+            
+        return c;
+    }
+    
+    //! Check if the heap allocator's state was set up, given the memory it
+    //!   manages.
+    static bool heap_ready(uint32_t const* state, uint32_t base, uint32_t end)
+    {
+        return state[HEAP_MAGIC] == HEAP_MAGIC_VALUE &&
+               state[HEAP_TOP] >= base + HEAP_HEADER && state[HEAP_TOP] <= end;
+    }
+    
+    //! Get the heap allocator's state of a core, setting it up if needed.
+    //! Returns 0 if there is no room for it.
+    static uint32_t* heap_state(vm::core& vco)
+    {
+        uint32_t base = vco.registers[vm::REG_CODE_HB];
+        uint32_t end = vco.stack_size + vco.heap_size;
+        if (base > end || end - base < HEAP_HEADER)
+            return 0;
+            
+        uint32_t* state = vco.stack + base;
+        if (!heap_ready(state, base, end))
+        {
+            state[HEAP_MAGIC] = HEAP_MAGIC_VALUE;
+            state[HEAP_TOP] = base + HEAP_HEADER;
+            state[HEAP_PEAK] = 0;
+            state[HEAP_LIVE] = 0;
+            state[HEAP_REQUESTED] = 0;
+            std::fill_n(state + HEAP_LISTS, HEAP_CLASSES, 0);
+        }
+        
+        return state;
+    }
+    
+    //! Get the header word of a live block, checking that it is one.
+    static uint32_t& heap_block(vm::core& vco, uint32_t* state, uint32_t addr, char const* what)
+    {
+        uint32_t start = vco.registers[vm::REG_CODE_HB] + HEAP_HEADER;
+        if (!state || addr <= start || addr >= state[HEAP_TOP] || !(vco.stack[addr - 1] & HEAP_USED))
+            throw std::logic_error(what);
+            
+        return vco.stack[addr - 1];
+    }
+    
+    //! Allocate a block of size words, returning its address.
+    static uint32_t alloc(vm::core& vco, uint32_t size)
+    {
+        uint32_t* state = heap_state(vco);
+        uint32_t c = heap_class(size);
+        if (!state || c >= HEAP_CLASSES)
+            return 0;
+            
+        uint32_t words = (1u << c) + 1;
+        uint32_t addr = state[HEAP_LISTS + c];
+        if (addr)
+            state[HEAP_LISTS + c] = vco.stack[addr];
+        else
+        {
+            uint32_t top = state[HEAP_TOP];
+            if (vco.stack_size + vco.heap_size - top < words)
+                return 0;
+                
+            addr = top + 1;
+            state[HEAP_TOP] = top + words;
+            
+            uint32_t arena = state[HEAP_TOP] - (vco.registers[vm::REG_CODE_HB] + HEAP_HEADER);
+            state[HEAP_PEAK] = std::max(state[HEAP_PEAK], arena);
+        }
+        
+        vco.stack[addr - 1] = HEAP_USED | size;
+        state[HEAP_LIVE] += words;
+        state[HEAP_REQUESTED] += size;
+        return addr;
+    }
+    
+    //! Free a block (0 is ignored).
+    static void free(vm::core& vco, uint32_t addr)
+    {
+        if (!addr)
+            return;
+            
+        uint32_t* state = heap_state(vco);
+        uint32_t& header = heap_block(vco, state, addr, "vm::free: invalid block address");
+        uint32_t size = header & ~HEAP_USED;
+        uint32_t c = heap_class(size);
+        
+        state[HEAP_LIVE] -= (1u << c) + 1;
+        state[HEAP_REQUESTED] -= size;
+        
+        if (addr + (1u << c) == state[HEAP_TOP])
+            state[HEAP_TOP] = addr - 1;
+        else
+        {
+            header = c;
+            vco.stack[addr] = state[HEAP_LISTS + c];
+            state[HEAP_LISTS + c] = addr;
+        }
+    }
+    
+    //! Resize a block, returning its new address (the block is moved if its
+    //!   size class changes), or 0 if there is no room left (the block is left
+    //!   alone then).
+    static uint32_t realloc(vm::core& vco, uint32_t addr, uint32_t size)
+    {
+        if (!addr)
+            return alloc(vco, size);
+            
+        uint32_t* state = heap_state(vco);
+        uint32_t& header = heap_block(vco, state, addr, "vm::realloc: invalid block address");
+        uint32_t old = header & ~HEAP_USED;
+        if (heap_class(size) == heap_class(old))
+        {
+            header = HEAP_USED | size;
+            state[HEAP_REQUESTED] += size - old;
+            return addr;
+        }
+        
+        uint32_t moved = alloc(vco, size);
+        if (!moved)
+            return 0;
+            
+        std::copy_n(vco.stack + addr, std::min(old, size), vco.stack + moved);
+        free(vco, addr);
+        return moved;
+    }
+    
+    //! Free all the blocks at once, in constant time, by emptying the arena
+    //!   and the free lists.
+    static void arena_reset(vm::core& vco)
+    {
+        uint32_t* state = heap_state(vco);
+        if (!state)
+            return;
+            
+        state[HEAP_TOP] = vco.registers[vm::REG_CODE_HB] + HEAP_HEADER;
+        state[HEAP_LIVE] = 0;
+        state[HEAP_REQUESTED] = 0;
+        std::fill_n(state + HEAP_LISTS, HEAP_CLASSES, 0);
+    }
 }
 
 /*************************/
@@ -73,6 +255,11 @@ namespace bolt { namespace vm
         EXPOSE(void(*)(int*),          bolt, puts)
         EXPOSE(int (*)(void),          bolt, getc)
         
+        EXPOSE(uint32_t(*)(core&, uint32_t),           bolt, alloc)
+        EXPOSE(void(*)(core&, uint32_t),               bolt, free)
+        EXPOSE(uint32_t(*)(core&, uint32_t, uint32_t), bolt, realloc)
+        EXPOSE(void(*)(core&),                         bolt, arena_reset)
+        
         EXPOSE(float(*)(float),        std,  cos)
         EXPOSE(float(*)(float),        std,  sin)
         EXPOSE(float(*)(float),        std,  tan)
@@ -92,4 +279,25 @@ namespace bolt { namespace vm
         
         #undef EXPOSE
     }
+    
+    heap_stats runtime_heap_stats(core const& vco)
+    {
+        heap_stats stats = heap_stats();
+        uint32_t base = vco.registers[REG_CODE_HB];
+        uint32_t end = vco.stack_size + vco.heap_size;
+        if (base > end || end - base < HEAP_HEADER)
+            return stats;
+            
+        stats.capacity = end - base - HEAP_HEADER;
+        
+        uint32_t const* state = vco.stack + base;
+        if (!heap_ready(state, base, end))
+            return stats;
+            
+        stats.arena = state[HEAP_TOP] - base - HEAP_HEADER;
+        stats.peak = state[HEAP_PEAK];
+        stats.live = state[HEAP_LIVE];
+        stats.requested = state[HEAP_REQUESTED];
+        return stats;
+    }
 } }
@@ -0,0 +1,319 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "bolt/vm_sampler.h"
+#include "bolt/vm_decoder.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Find the instruction of the given code that ends right before a location
+    //!   (for a return location, the CALL that pushed it).
+    //! Returns 0 if there is none.
+    static decoded_instruction const* sampler_before(core const& vco, uint32_t seg, uint32_t pc, uint32_t icode)
+    {
+        segment const* s = vco.segments[seg];
+        if (!s->code || pc > s->size)
+            return 0;
+            
+        // Instructions are one to three words long
+        for (uint32_t size = 1; size <= 3 && size <= pc; ++size)
+        {
+            decoded_instruction const& ins = s->code[pc - size];
+            if (ins.next == pc && decoder_icode(ins) == icode)
+                return &ins;
+        }
+        
+        return 0;
+    }
+    
+    //! Find the hatch a DIVE calls, reading its operand like the interpreter
+    //!   would (with PC past the instruction), right before it runs.
+    //! Returns vco.hatches_size if the operand can't be read.
+    static uint32_t sampler_hatch(core const& vco, decoded_instruction const& dive)
+    {
+        decoded_operand const& op = dive.a;
+        uint32_t base = op.reg == REG_CODE_PC ? dive.next : vco.registers[op.reg];
+        uint32_t hatch = vco.hatches_size;
+        
+        if (op.kind == OPK_IMM)
+            hatch = *op.imm;
+        else if (op.kind == OPK_REG)
+            hatch = base;
+        else if (op.kind == OPK_REG_IND || op.kind == OPK_IMM_IND)
+        {
+            uint32_t addr = (op.kind == OPK_IMM_IND ? *op.imm : base) + op.offset;
+            if (addr < vco.stack_size + vco.heap_size)
+                hatch = vco.stack[addr];
+        }
+        
+        return hatch < vco.hatches_size ? hatch : vco.hatches_size;
+    }
+    
+    //! Name a hatch found by sampler_hatch, or DIVE if it is unknown.
+    static std::string sampler_hatch_name(core const& vco, uint32_t hatch)
+    {
+        if (hatch < vco.hatches_size)
+            return vco.hatches[hatch]->name;
+        return "DIVE";
+    }
+    
+    //! Add a function entry to a sampler (once).
+    static void sampler_add_entry(sampler& smp, uint32_t seg, uint32_t entry)
+    {
+        if (seg >= smp.entries.size())
+            return;
+            
+        std::vector<uint32_t>& entries = smp.entries[seg];
+        std::vector<uint32_t>::iterator it = std::lower_bound(entries.begin(), entries.end(), entry);
+        if (it == entries.end() || *it != entry)
+            entries.insert(it, entry);
+    }
+    
+    //! Name the function a location belongs to.
+    static std::string sampler_function(sampler const& smp, debug_symbols const& symbols, uint32_t seg, uint32_t pc)
+    {
+        std::vector<uint32_t> const& entries = smp.entries[seg];
+        std::vector<uint32_t>::const_iterator it = std::upper_bound(entries.begin(), entries.end(), pc);
+        
+        if (it == entries.begin())
+            return symbols_name(symbols, seg, pc);
+        return symbols_name(symbols, seg, *(it - 1));
+    }
+    
+    //! The registers a call stack is walked from, saved before a hatch call
+    //!   (which may change them) to name its stack afterwards.
+    struct sampler_location
+    {
+        uint32_t seg;
+        uint32_t pc;
+        uint32_t ab;
+        uint32_t sp;
+    };
+    
+    //! Get the location a core's run is at.
+    static sampler_location sampler_locate(core const& vco)
+    {
+        sampler_location at;
+        at.seg = vco.registers[REG_CODE_SEG];
+        at.pc = vco.registers[REG_CODE_PC];
+        at.ab = vco.registers[REG_CODE_AB];
+        at.sp = vco.registers[REG_CODE_SP];
+        return at;
+    }
+    
+    //! Fold the call stack at a location (the functions from the outermost
+    //!   one, separated by semicolons), with a last frame for a hatch if one
+    //!   is named. Returns false if the location is not in a valid segment.
+    static bool sampler_stack(sampler const& smp, core const& vco, debug_symbols const& symbols,
+                              sampler_location const& at, std::string const& hatch, std::string& stack)
+    {
+        if (at.seg >= vco.segments_size)
+            return false;
+            
+        // The functions on the stack, innermost first
+        std::vector<std::string> names;
+        if (!hatch.empty())
+            names.push_back(hatch);
+        names.push_back(sampler_function(smp, symbols, at.seg, at.pc));
+        
+        // Walk the frames down the stack, each one must be below the previous one
+        uint32_t ab = at.ab;
+        uint32_t limit = std::min(at.sp, vco.stack_size);
+        
+        for (;;)
+        {
+            uint32_t base = ab + 1;
+            if (base > limit || limit - base < CALL_FRAME_SIZE)
+                break;
+                
+            uint32_t const* frame = vco.stack + base + CALL_FRAME_SIZE;
+            uint32_t ret_seg = frame[-1];
+            uint32_t ret_pc = frame[-2];
+            
+            // This also stops at the frame of core_call, which returns to the end
+            //   of its segment (unless it ends with a CALL)
+            if (ret_seg >= vco.segments_size || !sampler_before(vco, ret_seg, ret_pc, I_CODE_CALL))
+                break;
+                
+            names.push_back(sampler_function(smp, symbols, ret_seg, ret_pc - 1));
+            ab = frame[-4];
+            limit = base;
+        }
+        
+        stack.clear();
+        for (size_t i = names.size(); i > 0; --i)
+        {
+            stack += names[i - 1];
+            if (i > 1)
+                stack += ';';
+        }
+        
+        return true;
+    }
+    
+    //! Get the host time elapsed since a point, in nanoseconds.
+    static uint64_t sampler_since(std::chrono::steady_clock::time_point start)
+    {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    }
+    
+    //! Add a sample of a folded stack, with the given weight.
+    static void sampler_add(sampler& smp, std::string const& stack, uint64_t weight)
+    {
+        smp.stacks[stack] += weight;
+        ++smp.samples;
+        smp.weight += weight;
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    sampler sampler_create(core& vco)
+    {
+        sampler smp;
+        smp.entries.resize(vco.segments_size);
+        smp.samples = 0;
+        smp.weight = 0;
+        
+        // Sweep each segment's decoded stream for its CALL targets
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment& seg = *vco.segments[i];
+            if (!seg.code)
+                seg.code = decoder_decode(seg);
+                
+            sampler_add_entry(smp, i, seg.entry);
+            
+            for (uint32_t pc = 0; pc < seg.size; pc = seg.code[pc].next)
+            {
+                decoded_instruction const& ins = seg.code[pc];
+                if (ins.handler != H_CODE_CALL || ins.a.kind != OPK_IMM)
+                    continue;
+                    
+                if (ins.b.kind == OPK_NONE)
+                    sampler_add_entry(smp, i, *ins.a.imm);
+                else if (ins.b.kind == OPK_IMM)
+                    sampler_add_entry(smp, *ins.a.imm, *ins.b.imm);
+            }
+        }
+        
+        return smp;
+    }
+    
+    void sampler_sample(sampler& smp, core const& vco, debug_symbols const& symbols, uint64_t weight)
+    {
+        sampler_location at = sampler_locate(vco);
+        std::string hatch;
+        std::string stack;
+        
+        // A core suspended in a hatch stopped right after its DIVE
+        if (vco.registers[REG_CODE_PSR] & PSR_FLAG_WAIT && at.seg < vco.segments_size)
+        {
+            decoded_instruction const* dive = sampler_before(vco, at.seg, at.pc, I_CODE_DIVE);
+            if (dive)
+                hatch = sampler_hatch_name(vco, sampler_hatch(vco, *dive));
+        }
+        
+        if (sampler_stack(smp, vco, symbols, at, hatch, stack))
+            sampler_add(smp, stack, weight);
+    }
+    
+    uint32_t sampler_run(sampler& smp, core& vco, debug_symbols const& symbols, uint64_t period, std::string* fault)
+    {
+        if (!period)
+            throw std::logic_error("vm::sampler_run: null period");
+            
+        // The dispatches left before the next sample, and the time run by
+        //   the interpreter and by the hatches since their last sample
+        uint64_t left = period;
+        uint64_t interpreted = 0;
+        uint64_t hatched = 0;
+        uint64_t quantum = 0;
+        
+        for (;;)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            uint32_t status = core_run_sampled(vco, left, fault);
+            interpreted += sampler_since(start);
+            
+            if (!left || status != CORE_EXHAUSTED)
+            {
+                sampler_sample(smp, vco, symbols, interpreted);
+                quantum = interpreted;
+                interpreted = 0;
+                left = period;
+            }
+            if (status != CORE_EXHAUSTED)
+                return status;
+                
+            // Run the DIVE it may have stopped at alone : the hatches' time is
+            //   sampled whenever it adds up to as much as the last sample of
+            //   the interpreter's, with the stack of the DIVE that completes it
+            //   (located before its hatch runs), and its hatch as a last frame
+            segment const* seg = vco.segments[vco.registers[REG_CODE_SEG]];
+            decoded_instruction const& dive = seg->code[vco.registers[REG_CODE_PC]];
+            if (dive.handler != H_CODE_DIVE)
+                continue;
+                
+            sampler_location at = sampler_locate(vco);
+            uint32_t hatch = sampler_hatch(vco, dive);
+            uint64_t one = 1;
+            
+            start = std::chrono::steady_clock::now();
+            status = core_run_sampled(vco, one, fault);
+            hatched += sampler_since(start);
+            --left;
+            
+            if (hatched >= quantum || status != CORE_EXHAUSTED)
+            {
+                std::string stack;
+                if (sampler_stack(smp, vco, symbols, at, sampler_hatch_name(vco, hatch), stack))
+                    sampler_add(smp, stack, hatched);
+                hatched = 0;
+            }
+            
+            // The run stops in the hatch, what the interpreter ran before it
+            //   can't wait for the next sample
+            if (status != CORE_EXHAUSTED)
+            {
+                std::string stack;
+                if (interpreted && sampler_stack(smp, vco, symbols, at, std::string(), stack))
+                    sampler_add(smp, stack, interpreted);
+                return status;
+            }
+        }
+    }
+    
+    void sampler_write(sampler const& smp, std::ostream& os)
+    {
+        std::map<std::string, uint64_t>::const_iterator it;
+        for (it = smp.stacks.begin(); it != smp.stacks.end(); ++it)
+            os << it->first << " " << it->second << std::endl;
+    }
+} }
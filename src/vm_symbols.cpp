@@ -0,0 +1,88 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "bolt/vm_symbols.h"
+#include <algorithm>
+#include <sstream>
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Order labels by segment, then location.
+    static bool symbols_before(debug_label const& lhs, debug_label const& rhs)
+    {
+        return lhs.segment < rhs.segment || (lhs.segment == rhs.segment && lhs.location < rhs.location);
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    void symbols_add(debug_symbols& symbols, std::string const& name, uint32_t segment, uint32_t location)
+    {
+        debug_label label;
+        label.name = name;
+        label.segment = segment;
+        label.location = location;
+        
+        // Keep the table sorted, labels at the same location stay in order
+        std::vector<debug_label>::iterator it = std::upper_bound(symbols.labels.begin(), symbols.labels.end(),
+                                                                 label, symbols_before);
+        symbols.labels.insert(it, label);
+    }
+    
+    debug_label const* symbols_find(debug_symbols const& symbols, uint32_t segment, uint32_t location)
+    {
+        debug_label key;
+        key.segment = segment;
+        key.location = location;
+        
+        std::vector<debug_label>::const_iterator it = std::upper_bound(symbols.labels.begin(), symbols.labels.end(),
+                                                                       key, symbols_before);
+        if (it == symbols.labels.begin() || (it - 1)->segment != segment)
+            return 0;
+            
+        // Several labels may share a location, name it after the first one
+        debug_label const* label = &*(it - 1);
+        while (label != &symbols.labels.front() && (label - 1)->segment == segment &&
+               (label - 1)->location == label->location)
+            --label;
+            
+        return label;
+    }
+    
+    std::string symbols_name(debug_symbols const& symbols, uint32_t segment, uint32_t location)
+    {
+        std::ostringstream os;
+        
+        debug_label const* label = symbols_find(symbols, segment, location);
+        if (!label)
+            os << segment << ":" << location;
+        else if (label->location == location)
+            os << label->name;
+        else
+            os << label->name << "+" << location - label->location;
+            
+        return os.str();
+    }
+} }
@@ -0,0 +1,191 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "bolt/vm_trace.h"
+#include <iomanip>
+#include <stdexcept>
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! The trace file header (the magic reads "BTRC" in the file).
+    enum : uint32_t
+    {
+        TRACE_MAGIC   = 0x43525442,
+        TRACE_VERSION = 1
+    };
+    
+    //! Get the mnemonic of an instruction code.
+    static char const* trace_mnemonic(uint32_t icode)
+    {
+        #define DECL_INSTR(group, name, offset, f, a, b) \
+            case I_CODE_ ## name: \
+                return #name;
+                
+        switch (icode)
+        {
+            #include "bolt/vm_instructions.inc"
+            
+            default:
+                return "???";
+        }
+        
+        #undef DECL_INSTR
+    }
+    
+    //! Write a word to a binary stream, as little endian.
+    static void trace_write_word(std::ostream& os, uint32_t word)
+    {
+        char bytes[4] = { (char) word, (char) (word >> 8), (char) (word >> 16), (char) (word >> 24) };
+        os.write(bytes, 4);
+    }
+    
+    //! Read a little endian word from a binary stream.
+    static uint32_t trace_read_word(std::istream& is)
+    {
+        unsigned char bytes[4];
+        if (!is.read((char*) bytes, 4))
+            throw std::runtime_error("vm::trace_read: truncated trace");
+            
+        return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    trace_buffer trace_create(uint32_t size)
+    {
+        if (size > 0x80000000)
+            throw std::logic_error("vm::trace_create: trace too large");
+            
+        trace_buffer trace;
+        trace.size = 1;
+        while (trace.size < size)
+            trace.size <<= 1;
+            
+        trace.position = 0;
+        trace.entries = new trace_entry[trace.size];
+        
+        return trace;
+    }
+    
+    void trace_free(trace_buffer& trace)
+    {
+        if (trace.entries)
+            delete[] trace.entries;
+        trace.entries = 0;
+        trace.size = 0;
+        trace.position = 0;
+    }
+    
+    uint32_t trace_count(trace_buffer const& trace)
+    {
+        return trace.position < trace.size ? trace.position : trace.size;
+    }
+    
+    trace_entry const& trace_get(trace_buffer const& trace, uint32_t i)
+    {
+        return trace.entries[(trace.position - trace_count(trace) + i) & (trace.size - 1)];
+    }
+    
+    void trace_write(trace_buffer const& trace, std::ostream& os)
+    {
+        uint32_t count = trace_count(trace);
+        
+        trace_write_word(os, TRACE_MAGIC);
+        trace_write_word(os, TRACE_VERSION);
+        trace_write_word(os, count);
+        trace_write_word(os, trace.position);
+        trace_write_word(os, trace.position >> 32);
+        
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            trace_entry const& entry = trace_get(trace, i);
+            trace_write_word(os, entry.seg);
+            trace_write_word(os, entry.pc);
+            trace_write_word(os, entry.ir);
+            trace_write_word(os, entry.sp);
+        }
+    }
+    
+    trace_buffer trace_read(std::istream& is)
+    {
+        if (trace_read_word(is) != TRACE_MAGIC)
+            throw std::runtime_error("vm::trace_read: not a trace");
+        if (trace_read_word(is) != TRACE_VERSION)
+            throw std::runtime_error("vm::trace_read: unsupported trace version");
+            
+        uint32_t count = trace_read_word(is);
+        uint64_t position = trace_read_word(is);
+        position |= (uint64_t) trace_read_word(is) << 32;
+        if (count > position)
+            throw std::runtime_error("vm::trace_read: corrupted trace");
+            
+        // Record the entries again, so that they end up at the same positions
+        trace_buffer trace = trace_create(count);
+        trace.position = position - count;
+        
+        try
+        {
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t seg = trace_read_word(is);
+                uint32_t pc = trace_read_word(is);
+                uint32_t ir = trace_read_word(is);
+                uint32_t sp = trace_read_word(is);
+                trace_record(trace, seg, pc, ir, sp);
+            }
+        }
+        catch (...)
+        {
+            trace_free(trace);
+            throw;
+        }
+        
+        return trace;
+    }
+    
+    void trace_dump(trace_buffer const& trace, debug_symbols const& symbols, std::ostream& os)
+    {
+        uint32_t count = trace_count(trace);
+        std::ios::fmtflags flags = os.flags();
+        
+        os << "---- Trace (" << count << " of " << trace.position << " instructions) ----" << std::endl;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            trace_entry const& entry = trace_get(trace, i);
+            uint32_t icode = (entry.ir & I_CODE_MASK) >> I_CODE_SHIFT;
+            
+            os << std::dec << std::setfill(' ') << std::setw(12) << trace.position - count + i << "  ";
+            os << std::setw(4) << entry.seg << ":" << std::left << std::setw(6) << entry.pc << std::right << "  ";
+            os << std::left << std::setw(6) << trace_mnemonic(icode) << std::right;
+            os << "  IR " << std::hex << std::setfill('0') << std::setw(8) << entry.ir;
+            os << "  SP " << std::dec << entry.sp;
+            os << "  " << symbols_name(symbols, entry.seg, entry.pc) << std::endl;
+        }
+        os << "--------------------" << std::endl;
+        
+        os.flags(flags);
+    }
+} }
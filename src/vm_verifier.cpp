@@ -0,0 +1,521 @@
+/* This file is part of bolt.
+ * 
+ * Copyright (c) 2015, Alexandre Monti
+ * 
+ * bolt is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * bolt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with bolt.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bolt/vm_verifier.h"
+#include "bolt/vm_decoder.h"
+#include <vector>
+
+namespace bolt { namespace vm
+{
+    /**************************************/
+    /*** Private implementation section ***/
+    /**************************************/
+    
+    //! Operand proof states, merged over all the verified functions
+    //!   an instruction belongs to.
+    enum : uint8_t
+    {
+        VERIFIER_UNSEEN    = 0x0,
+        VERIFIER_SEEN      = 0x1,
+        VERIFIER_DISPROVEN = 0x2
+    };
+    
+    //! The verifier's state.
+    //! The entries vectors flag the locations already queued as function
+    //!   entries, and the proofs vectors hold the proof states of the A and B
+    //!   operands of each location (two per location).
+    struct verifier
+    {
+        core* vco;
+        
+        std::vector<bool> self_modifying;
+        std::vector<std::vector<bool> > entries;
+        std::vector<std::vector<uint8_t> > proofs;
+        
+        std::vector<uint32_t> pending;
+        uint32_t failures;
+    };
+    
+    //! Check if an instruction is a conditional jump.
+    static bool verifier_is_jump_if(uint32_t icode)
+    {
+        return icode == I_CODE_JZ || icode == I_CODE_JNZ || icode == I_CODE_JE || icode == I_CODE_JNE ||
+               icode == I_CODE_JL || icode == I_CODE_JLE || icode == I_CODE_JG || icode == I_CODE_JGE;
+    }
+
+    //! Queue a function entry (once).
+    static void verifier_queue(verifier& v, uint32_t seg, uint32_t entry)
+    {
+        if (seg >= v.vco->segments_size || entry >= v.vco->segments[seg]->size || v.entries[seg][entry])
+            return;
+            
+        v.entries[seg][entry] = true;
+        v.pending.push_back(seg);
+        v.pending.push_back(entry);
+    }
+    
+    //! Get the number of words an instruction pops off the stack, and pushes back.
+    static void verifier_stack_effect(decoded_instruction const& ins, uint32_t icode, uint32_t& pops, uint32_t& pushes)
+    {
+        uint32_t igroup = (icode & I_GROUP_MASK) >> I_GROUP_SHIFT;
+        
+        pops = 0;
+        pushes = 0;
+        
+        if (icode == I_CODE_PUSH)
+            pushes = 1;
+        else if (icode == I_CODE_POP)
+            pops = 1;
+        else if (icode == I_CODE_DUP)
+        {
+            pops = 1;
+            pushes = 2;
+        }
+        else if (icode == I_CODE_LOAD)
+        {
+            pops = 1;
+            pushes = 1;
+        }
+        else if (icode == I_CODE_STOR)
+            pops = 2;
+        else if (icode == I_CODE_MCPY || icode == I_CODE_MCST || icode == I_CODE_MSET || icode == I_CODE_MCMP)
+            pops = 1;
+        else if (icode == I_CODE_CST)
+        {
+            pops = ins.a.kind == OPK_NONE ? 1 : 0;
+            pushes = 1;
+        }
+        else if (igroup == I_GROUP_ARITH)
+        {
+            pops = 2;
+            pushes = icode == I_CODE_UCMP || icode == I_CODE_ICMP || icode == I_CODE_FCMP ? 0 : 1;
+        }
+        else if (igroup == I_GROUP_VEC)
+        {
+            pops = icode == I_CODE_VFMA ? 2 : 1;
+            pushes = icode >= I_CODE_VFDOT ? 1 : 0;
+        }
+    }
+    
+    //! The abstract state of the core before an instruction.
+    //! Depths are relative to the function's entry, and registers are
+    //!   either unknown (-1), or hold a known depth (that is, the function's
+    //!   entry SP plus this value). SP's entry is unused, see depth.
+    struct verifier_state
+    {
+        int64_t depth;
+        int64_t registers[REG_COUNT];
+    };
+    
+    //! Get the depth held by a register, or -1 if unknown.
+    static int64_t verifier_register(verifier_state const& state, uint32_t reg)
+    {
+        return reg == REG_CODE_SP ? state.depth : state.registers[reg];
+    }
+    
+    //! Check if a memory operand is always in bounds, given the abstract state
+    //!   and the function's maximum stack depth (room).
+    //! Only the accesses to the function's own stack words (through SP, or a
+    //!   register holding a known depth) and constant addresses are proven.
+    static bool verifier_prove(verifier const& v, decoded_operand const& op, verifier_state const& state, int64_t room)
+    {
+        if (op.kind == OPK_REG_IND)
+        {
+            int64_t depth = verifier_register(state, op.reg);
+            return depth >= 0 && depth + op.offset >= 0 && depth + op.offset < room;
+        }
+        
+        if (op.kind == OPK_IMM_IND)
+        {
+            uint32_t addr = *op.imm + op.offset;
+            return (uint64_t) addr < (uint64_t) v.vco->stack_size + v.vco->heap_size;
+        }
+        
+        return false;
+    }
+    
+    //! Merge an abstract state into the one of a location, queuing the location
+    //!   if it changed.
+    //! Returns false if the location was reached before with another depth.
+    static bool verifier_merge(std::vector<verifier_state>& states, std::vector<uint32_t>& pending,
+                               uint32_t pc, verifier_state const& state)
+    {
+        if (pc >= states.size())
+            return true;
+            
+        verifier_state& current = states[pc];
+        if (current.depth < 0)
+        {
+            current = state;
+            pending.push_back(pc);
+            return true;
+        }
+        
+        if (current.depth != state.depth)
+            return false;
+            
+        bool changed = false;
+        for (uint32_t i = 0; i < REG_COUNT; ++i)
+        {
+            if (current.registers[i] >= 0 && current.registers[i] != state.registers[i])
+            {
+                current.registers[i] = -1;
+                changed = true;
+            }
+        }
+        
+        if (changed)
+            pending.push_back(pc);
+        return true;
+    }
+    
+    //! Mark a location as a point where the trusted interpreter can resume.
+    //! A location may belong to several functions, so we keep the largest
+    //!   requirements.
+    static void verifier_resume(decoded_instruction& ins, uint32_t depth, uint32_t room)
+    {
+        if (ins.room == ROOM_UNTRUSTED)
+        {
+            ins.depth = depth;
+            ins.room = room;
+        }
+        else
+        {
+            ins.depth = depth > ins.depth ? depth : ins.depth;
+            ins.room = room > ins.room ? room : ins.room;
+        }
+    }
+    
+    //! A call made by a function : the depth it is made at, and its target.
+    struct verifier_call
+    {
+        int64_t depth;
+        uint32_t seg;
+        uint32_t entry;
+    };
+    
+    //! Follow the program's flow from a function's entry (stepping over calls),
+    //!   computing the abstract state before each of its instructions, its
+    //!   maximum stack depth (room), its return locations and its calls.
+    //! Returns false if the function can't be verified.
+    static bool verifier_flow(verifier const& v, uint32_t seg, uint32_t entry, std::vector<verifier_state>& states,
+                              std::vector<uint32_t>& returns, std::vector<verifier_call>& calls, int64_t& room)
+    {
+        segment& s = *v.vco->segments[seg];
+        decoded_instruction* code = s.code;
+        
+        verifier_state unknown;
+        unknown.depth = -1;
+        for (uint32_t i = 0; i < REG_COUNT; ++i)
+            unknown.registers[i] = -1;
+            
+        states.assign(s.size, unknown);
+        std::vector<uint32_t> pending;
+        bool valid = !v.self_modifying[seg];
+        room = 0;
+        
+        verifier_state state = unknown;
+        state.depth = 0;
+        verifier_merge(states, pending, entry, state);
+        
+        while (valid && pending.size())
+        {
+            uint32_t pc = pending.back();
+            pending.pop_back();
+            
+            decoded_instruction const& ins = code[pc];
+            uint32_t icode = decoder_icode(ins);
+            state = states[pc];
+            
+            if (ins.handler == H_CODE_BAD || ins.handler == H_CODE_FETCH)
+            {
+                valid = false;
+                break;
+            }
+            
+            uint32_t pops, pushes;
+            verifier_stack_effect(ins, icode, pops, pushes);
+            if (state.depth < pops)
+            {
+                valid = false;
+                break;
+            }
+            
+            int64_t depth = state.depth;
+            state.depth = depth - pops + pushes;
+            room = state.depth > room ? state.depth : room;
+            
+            bool sequential = true;
+            if (icode == I_CODE_HALT || icode == I_CODE_RST)
+                sequential = false;
+            else if (icode == I_CODE_RET)
+            {
+                valid = depth == 0;
+                sequential = false;
+            }
+            else if (icode == I_CODE_JMP || verifier_is_jump_if(icode))
+            {
+                valid = ins.a.kind == OPK_IMM && verifier_merge(states, pending, *ins.a.imm, state);
+                sequential = icode != I_CODE_JMP;
+            }
+            else if (icode == I_CODE_CALL || icode == I_CODE_DIVE)
+            {
+                if (icode == I_CODE_CALL)
+                {
+                    valid = ins.a.kind == OPK_IMM && (ins.b.kind == OPK_NONE || ins.b.kind == OPK_IMM);
+                    if (valid && ins.b.kind == OPK_NONE)
+                        calls.push_back(verifier_call { depth, seg, *ins.a.imm });
+                    else if (valid)
+                        calls.push_back(verifier_call { depth, *ins.a.imm, *ins.b.imm });
+                    if (ins.next < s.size)
+                        returns.push_back(ins.next);
+                }
+                
+                // The registers restored by RET come from the stack frame (that
+                //   the callee may have written to), and hatches may write to them
+                for (uint32_t i = 0; i < REG_COUNT; ++i)
+                    state.registers[i] = -1;
+            }
+            else if ((icode == I_CODE_POP || icode == I_CODE_MOV) && ins.a.kind == OPK_REG)
+            {
+                valid = ins.a.reg != REG_CODE_PC && ins.a.reg != REG_CODE_SEG && ins.a.reg != REG_CODE_SP;
+                
+                // Keep track of the registers holding a copy of SP
+                if (icode == I_CODE_MOV && ins.b.kind == OPK_REG)
+                    state.registers[ins.a.reg] = verifier_register(states[pc], ins.b.reg);
+                else
+                    state.registers[ins.a.reg] = -1;
+            }
+            
+            if (valid && sequential)
+                valid = verifier_merge(states, pending, ins.next, state);
+        }
+        
+        if (!valid)
+            return false;
+            
+        // Jumps must land on instruction boundaries : no location of the
+        //   body may be an operand word of another one
+        std::vector<bool> operands(s.size, false);
+        for (uint32_t pc = 0; pc < s.size; ++pc)
+        {
+            for (uint32_t i = pc + 1; states[pc].depth >= 0 && i < code[pc].next; ++i)
+                operands[i] = true;
+        }
+        
+        for (uint32_t pc = 0; pc < s.size; ++pc)
+        {
+            if (states[pc].depth >= 0 && operands[pc])
+                return false;
+        }
+        
+        return true;
+    }
+    
+    //! Verify the function starting at the given location, and queue its
+    //!   call targets.
+    //! Returns false if the function can't be verified.
+    static bool verifier_function(verifier& v, uint32_t seg, uint32_t entry)
+    {
+        segment& s = *v.vco->segments[seg];
+        decoded_instruction* code = s.code;
+        
+        std::vector<verifier_state> states;
+        std::vector<uint32_t> returns;
+        std::vector<verifier_call> calls;
+        int64_t room;
+        
+        bool valid = verifier_flow(v, seg, entry, states, returns, calls, room);
+        for (size_t i = 0; i < calls.size(); ++i)
+            verifier_queue(v, calls[i].seg, calls[i].entry);
+            
+        if (!valid)
+            return false;
+            
+        // The function is verified, record its resume points and its proofs
+        verifier_resume(code[entry], 0, room);
+        for (size_t i = 0; i < returns.size(); ++i)
+            verifier_resume(code[returns[i]], states[returns[i]].depth, room - states[returns[i]].depth);
+            
+        std::vector<uint8_t>& proofs = v.proofs[seg];
+        for (uint32_t pc = 0; pc < s.size; ++pc)
+        {
+            if (states[pc].depth < 0)
+                continue;
+                
+            proofs[2 * pc] |= VERIFIER_SEEN;
+            if (!verifier_prove(v, code[pc].a, states[pc], room))
+                proofs[2 * pc] |= VERIFIER_DISPROVEN;
+                
+            proofs[2 * pc + 1] |= VERIFIER_SEEN;
+            if (!verifier_prove(v, code[pc].b, states[pc], room))
+                proofs[2 * pc + 1] |= VERIFIER_DISPROVEN;
+        }
+        
+        return true;
+    }
+    
+    //! Stack bound states of the function entries, besides the bounds themselves.
+    enum : int64_t
+    {
+        VERIFIER_BOUND_UNSEEN    = -1,
+        VERIFIER_BOUND_VISITING  = -2,
+        VERIFIER_BOUND_UNBOUNDED = -3
+    };
+    
+    //! Get the maximum stack depth reached by the function starting at the
+    //!   given location, its callees included (each call adding its frame).
+    //! Returns VERIFIER_BOUND_UNBOUNDED if the function (or one of its callees)
+    //!   can't be verified, or is recursive.
+    static int64_t verifier_bound(verifier const& v, uint32_t seg, uint32_t entry,
+                                  std::vector<std::vector<int64_t> >& bounds)
+    {
+        if (seg >= v.vco->segments_size || entry >= v.vco->segments[seg]->size)
+            return VERIFIER_BOUND_UNBOUNDED;
+            
+        int64_t& bound = bounds[seg][entry];
+        if (bound == VERIFIER_BOUND_VISITING)
+            return VERIFIER_BOUND_UNBOUNDED;
+        if (bound != VERIFIER_BOUND_UNSEEN)
+            return bound;
+            
+        std::vector<verifier_state> states;
+        std::vector<uint32_t> returns;
+        std::vector<verifier_call> calls;
+        int64_t room;
+        
+        if (!verifier_flow(v, seg, entry, states, returns, calls, room))
+            return bound = VERIFIER_BOUND_UNBOUNDED;
+            
+        bound = VERIFIER_BOUND_VISITING;
+        for (size_t i = 0; i < calls.size(); ++i)
+        {
+            int64_t callee = verifier_bound(v, calls[i].seg, calls[i].entry, bounds);
+            if (callee < 0)
+                return bounds[seg][entry] = VERIFIER_BOUND_UNBOUNDED;
+                
+            int64_t depth = calls[i].depth + CALL_FRAME_SIZE + callee;
+            room = depth > room ? depth : room;
+        }
+        
+        return bounds[seg][entry] = room;
+    }
+    
+    /*************************/
+    /*** Public module API ***/
+    /*************************/
+    
+    uint32_t verifier_verify(core& vco)
+    {
+        verifier v;
+        v.vco = &vco;
+        v.failures = 0;
+        
+        // Decode the segments that were not by the linker, and forget
+        //   the results of any previous verification
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment& seg = *vco.segments[i];
+            if (!seg.code)
+                seg.code = decoder_decode(seg);
+                
+            for (uint32_t pc = 0; pc <= seg.size; ++pc)
+            {
+                seg.code[pc].depth = 0;
+                seg.code[pc].room = ROOM_UNTRUSTED;
+                seg.code[pc].a.proven = 0;
+                seg.code[pc].b.proven = 0;
+            }
+            
+            v.self_modifying.push_back(decoder_is_self_modifying(seg));
+            v.entries.push_back(std::vector<bool>(seg.size, false));
+            v.proofs.push_back(std::vector<uint8_t>(2 * seg.size, VERIFIER_UNSEEN));
+        }
+        
+        if (vco.base < vco.segments_size)
+            verifier_queue(v, vco.base, vco.segments[vco.base]->entry);
+            
+        while (v.pending.size())
+        {
+            uint32_t entry = v.pending.back();
+            v.pending.pop_back();
+            uint32_t seg = v.pending.back();
+            v.pending.pop_back();
+            
+            if (!verifier_function(v, seg, entry))
+                ++v.failures;
+        }
+        
+        // An operand is proven if it is in all the verified functions
+        //   it belongs to
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment& seg = *vco.segments[i];
+            for (uint32_t pc = 0; pc < seg.size; ++pc)
+            {
+                seg.code[pc].a.proven = v.proofs[i][2 * pc] == VERIFIER_SEEN;
+                seg.code[pc].b.proven = v.proofs[i][2 * pc + 1] == VERIFIER_SEEN;
+            }
+        }
+        
+        return v.failures;
+    }
+    
+    bool verifier_stack_bound(core& vco, uint32_t& bound)
+    {
+        if (vco.base >= vco.segments_size)
+            return false;
+            
+        std::vector<uint32_t> functions;
+        functions.push_back(vco.base);
+        functions.push_back(vco.segments[vco.base]->entry);
+        
+        return verifier_functions_bound(vco, functions, bound);
+    }
+    
+    bool verifier_functions_bound(core& vco, std::vector<uint32_t> const& functions, uint32_t& bound)
+    {
+        verifier v;
+        v.vco = &vco;
+        v.failures = 0;
+        
+        std::vector<std::vector<int64_t> > bounds;
+        for (uint32_t i = 0; i < vco.segments_size; ++i)
+        {
+            segment& seg = *vco.segments[i];
+            if (!seg.code)
+                seg.code = decoder_decode(seg);
+                
+            v.self_modifying.push_back(decoder_is_self_modifying(seg));
+            bounds.push_back(std::vector<int64_t>(seg.size, VERIFIER_BOUND_UNSEEN));
+        }
+        
+        int64_t words = 0;
+        for (size_t i = 0; i + 1 < functions.size(); i += 2)
+        {
+            int64_t function = verifier_bound(v, functions[i], functions[i + 1], bounds);
+            if (function < 0 || function > UINT32_MAX)
+                return false;
+                
+            words = function > words ? function : words;
+        }
+        
+        bound = words;
+        return true;
+    }
+} }